@@ -0,0 +1,243 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "cache.h"
+#include "dat.h"
+
+#define INDEX_FILE "index"
+
+struct cache_job {
+	char filename[256];
+	const char *data;
+	unsigned int size;
+	int owned;		// data is freed once it is written
+	struct cache_job *next;
+};
+
+struct index_entry {
+	char filename[40];
+	unsigned int size;
+	struct hashes hash;
+	struct index_entry *next;
+};
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t cache_done = PTHREAD_COND_INITIALIZER;
+static struct cache_job *queue_head;
+static struct cache_job *queue_tail;
+static int busy = 0;
+static int started = 0;
+
+static pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct index_entry *index_head;
+static int index_loaded = 0;
+
+// Write the whole image to a temp file, sync it and rename it over the old one
+static int write_atomic(struct cache_job *job){
+	char tmpname[264];
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", job->filename);
+
+	int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return 1;
+
+	unsigned int written = 0;
+	while (written < job->size) {
+		ssize_t n = write(fd, job->data + written, job->size - written);
+		if (n <= 0) break;
+		written += n;
+	}
+	if (written != job->size || fsync(fd)) {
+		close(fd);
+		unlink(tmpname);
+		return 1;
+	}
+	close(fd);
+
+	if (rename(tmpname, job->filename)) {
+		unlink(tmpname);
+		return 1;
+	}
+
+	// Make the rename itself durable
+	int dir = open(".", O_RDONLY);
+	if (dir >= 0) {
+		fsync(dir);
+		close(dir);
+	}
+	return 0;
+}
+
+static void *cache_writer(void *ptr){
+	(void) ptr;
+	pthread_mutex_lock(&cache_mutex);
+	while (1) {
+		while (queue_head == NULL) pthread_cond_wait(&cache_cond, &cache_mutex);
+		struct cache_job *job = queue_head;
+		queue_head = job->next;
+		if (queue_head == NULL) queue_tail = NULL;
+		busy = 1;
+		pthread_mutex_unlock(&cache_mutex);
+
+		if (write_atomic(job)) fprintf(stderr, "Writing %s to cache failed\n", job->filename);
+		else printf("%s written to cache.\n", job->filename);
+		if (job->owned) free((char *) job->data);
+		free(job);
+
+		pthread_mutex_lock(&cache_mutex);
+		busy = 0;
+		if (queue_head == NULL) pthread_cond_broadcast(&cache_done);
+	}
+	return NULL;
+}
+
+static void queue_job(const char *filename, const char *data, unsigned int size, int owned){
+	struct cache_job *job = malloc(sizeof(*job));
+	if (job == NULL) {
+		if (owned) free((char *) data);
+		return;
+	}
+	snprintf(job->filename, sizeof(job->filename), "%s", filename);
+	job->data = data;
+	job->size = size;
+	job->owned = owned;
+	job->next = NULL;
+
+	pthread_mutex_lock(&cache_mutex);
+	if (!started) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, cache_writer, NULL)) {
+			pthread_mutex_unlock(&cache_mutex);
+			write_atomic(job);		// no writer thread, do it here instead
+			if (owned) free((char *) data);
+			free(job);
+			return;
+		}
+		pthread_detach(thread);
+		started = 1;
+	}
+	if (queue_tail) queue_tail->next = job;
+	else queue_head = job;
+	queue_tail = job;
+	pthread_cond_signal(&cache_cond);
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+void cache_write_async(const char *filename, const char *data, unsigned int size){
+	queue_job(filename, data, size, 0);
+}
+
+void cache_write_owned(const char *filename, char *data, unsigned int size){
+	queue_job(filename, data, size, 1);
+}
+
+void cache_write_wait(void){
+	pthread_mutex_lock(&cache_mutex);
+	while (queue_head != NULL || busy) pthread_cond_wait(&cache_done, &cache_mutex);
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+static int parse_hex(const char *str, uint8_t *bytes, int len){
+	if (strlen(str) != (size_t) len * 2) return 1;
+	for (int i = 0; i < len; i++) {
+		unsigned int byte;
+		if (sscanf(str + 2 * i, "%2x", &byte) != 1) return 1;
+		bytes[i] = byte;
+	}
+	return 0;
+}
+
+// Read the index into memory, one tab separated line per image: name, size, crc32, md5, sha1, DAT status
+static void load_index(void){
+	char line[256];
+	index_loaded = 1;
+	FILE *fp = fopen(INDEX_FILE, "r");
+	if (fp == NULL) return;
+
+	while (fgets(line, sizeof(line), fp)) {
+		struct index_entry *entry = calloc(1, sizeof(*entry));
+		if (entry == NULL) break;
+		char *name = strtok(line, "\t\n");
+		char *size = strtok(NULL, "\t\n");
+		char *crc = strtok(NULL, "\t\n");
+		char *md5 = strtok(NULL, "\t\n");
+		char *sha1 = strtok(NULL, "\t\n");
+		char *status = strtok(NULL, "\t\n");
+		if (!sha1 || parse_hex(md5, entry->hash.md5, 16) || parse_hex(sha1, entry->hash.sha1, 20)) {
+			free(entry);
+			continue;
+		}
+		snprintf(entry->filename, sizeof(entry->filename), "%s", name);
+		entry->size = strtoul(size, NULL, 10);
+		entry->hash.crc32 = strtoul(crc, NULL, 16);
+		entry->hash.valid = 1;
+		for (int verify = DAT_UNKNOWN; status && verify <= DAT_BAD; verify++) {
+			if (!strcmp(status, dat_status_name(verify))) entry->hash.verify = verify;
+		}
+		entry->next = index_head;
+		index_head = entry;
+	}
+	fclose(fp);
+}
+
+int cache_index_lookup(const char *filename, unsigned int size, struct hashes *hash){
+	int ret = 1;
+	pthread_mutex_lock(&index_mutex);
+	if (!index_loaded) load_index();
+	for (struct index_entry *entry = index_head; entry; entry = entry->next) {
+		if (!strcmp(entry->filename, filename) && entry->size == size) {
+			*hash = entry->hash;
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&index_mutex);
+	return ret;
+}
+
+void cache_index_store(const char *filename, unsigned int size, const struct hashes *hash){
+	struct index_entry *entry;
+	pthread_mutex_lock(&index_mutex);
+	if (!index_loaded) load_index();
+	for (entry = index_head; entry; entry = entry->next) {
+		if (!strcmp(entry->filename, filename)) break;
+	}
+	if (entry == NULL) {
+		entry = calloc(1, sizeof(*entry));
+		if (entry == NULL) {
+			pthread_mutex_unlock(&index_mutex);
+			return;
+		}
+		snprintf(entry->filename, sizeof(entry->filename), "%s", filename);
+		entry->next = index_head;
+		index_head = entry;
+	}
+	entry->size = size;
+	entry->hash = *hash;
+
+	// Serialize the whole index and let the writer replace the file
+	unsigned int count = 0, len = 0;
+	for (entry = index_head; entry; entry = entry->next) count++;
+	char *data = malloc(count * 170 + 1);
+	if (data != NULL) {
+		for (entry = index_head; entry; entry = entry->next) {
+			char md5[33], sha1[41];
+			hash_to_hex(entry->hash.md5, 16, md5);
+			hash_to_hex(entry->hash.sha1, 20, sha1);
+			len += sprintf(data + len, "%s\t%u\t%08x\t%s\t%s\t%s\n", entry->filename, entry->size, entry->hash.crc32, md5, sha1,
+						   dat_status_name(entry->hash.verify));
+		}
+		queue_job(INDEX_FILE, data, len, 1);
+	}
+	pthread_mutex_unlock(&index_mutex);
+}
@@ -0,0 +1,24 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ */
+
+#include "hash.h"
+
+// Hand an image to the background writer. It is written to <filename>.tmp, synced and renamed into place,
+// so a crash never leaves a truncated file behind. data has to stay untouched until cache_write_wait() returns.
+void cache_write_async(const char *filename, const char *data, unsigned int size);
+
+// Like cache_write_async(), but the writer takes data over and frees it once it is written
+void cache_write_owned(const char *filename, char *data, unsigned int size);
+
+// Block until the background writer has finished every image it was handed
+void cache_write_wait(void);
+
+// Look up the hashes stored in the cache index for a cached image, returns 0 when found
+int cache_index_lookup(const char *filename, unsigned int size, struct hashes *hash);
+
+// Store the hashes of a cached image in the index, the index is written out by the background writer
+void cache_index_store(const char *filename, unsigned int size, const struct hashes *hash);
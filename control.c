@@ -0,0 +1,236 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ A Unix socket to drive the cartridge thread from scripts. Every line sent is one command, every answer
+ is "ok" or "err <reason>", maybe some "<key> <value>" lines, and an empty line:
+
+   status              event number, cartridge state, ROM and save names
+   dump                read the cartridge again as if it was just inserted
+   save                read only the save again
+   commit              write the save back now, answers once it is on the cartridge
+   verify              hash the served ROM again and check it against the DAT
+   cancel              stop the ROM dump in progress
+   mode gb|gba|auto    only look for one kind of cartridge
+   watch               send the status after every event and "progress <done> <total>" during dumps
+   devices             the name and port of every device
+   device <name>       send the commands after this to another device, they go to the first one until then
+
+ The commands go into the job queue of the device like everything else its cartridge thread does, so
+ they run as soon as the current bank is done instead of on the next 5s check.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "control.h"
+#include "gbxcart.h"
+#include "jobs.h"
+#include "stats.h"
+#include "dat.h"
+
+static int listener = -1;
+static char socketPath[108];
+
+static int send_all(int fd, const char *text) {
+	size_t len = strlen(text);
+	while (len) {
+		ssize_t n = send(fd, text, len, MSG_NOSIGNAL);
+		if (n <= 0) return 1;
+		text += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// The answer to a job the cartridge thread ran, see rereadCart() and friends in gbxcart.c
+static const char *job_error(int result) {
+	switch (result) {
+		case 0: return NULL;
+		case 1: return "err nothing to do\n\n";
+		case 2: return "err the save has writes that aren't on the cartridge yet\n\n";
+		default: return "err cancelled, the cartridge went away\n\n";
+	}
+}
+
+// Stream events and progress until the client hangs up
+static void watch(int fd, struct device *d) {
+	char text[320];
+	unsigned int seen = 0;
+	uint32_t done, total, lastDone = 0;
+	struct pollfd pfd = {fd, POLLIN, 0};
+
+	if (send_all(fd, "ok\n\n")) return;
+	for (;;) {
+		unsigned int event = cartWaitEvent(d, seen, 250);
+		if (event != seen) {
+			seen = cartStatus(d, text, sizeof(text) - 1);
+			strcat(text, "\n");
+			if (send_all(fd, text)) return;
+		}
+		if (stats_progress_get(&d->progress, &done, &total) && done != lastDone) {
+			snprintf(text, sizeof(text), "progress %u %u\n\n", done, total);
+			if (send_all(fd, text)) return;
+			lastDone = done;
+		}
+		// Anything sent while watching, including the hangup, ends it
+		if (poll(&pfd, 1, 0) > 0) return;
+	}
+}
+
+// One command of a client that works on the device *d
+static void command(int fd, struct device **d, char *line) {
+	struct jobs *jobs;
+	char text[4096];
+	const char *reply = "ok\n\n";
+	char *arg = strchr(line, ' ');
+	int result;
+
+	if (arg) *arg++ = 0;
+	if (*d == NULL) *d = getDevice(0);		// --multi may not have found one when the client connected
+	jobs = *d ? (*d)->jobs : NULL;
+	if (*d == NULL && strcmp(line, "devices") && strcmp(line, "device"))
+		reply = "err no GBxCart found yet\n\n";
+	else if (!strcmp(line, "status")) {
+		strcpy(text, "ok\n");
+		cartStatus(*d, text + 3, sizeof(text) - 4);
+		strcat(text, "\n");
+		reply = text;
+	}
+	else if (!strcmp(line, "watch")) {
+		watch(fd, *d);
+		return;
+	}
+	else if (!strcmp(line, "devices")) {
+		size_t len = sprintf(text, "ok\n");
+		struct device *other;
+		for (int i = 0; (other = getDevice(i)) != NULL && len + 2 < sizeof(text); i++)
+			len += snprintf(text + len, sizeof(text) - len - 1, "device %s %s\n", other->name, other->port[0] ? other->port : "-");
+		strcat(text, "\n");
+		reply = text;
+	}
+	else if (!strcmp(line, "device")) {
+		struct device *other = arg ? findDevice(arg) : NULL;
+		if (other == NULL) reply = "err no such device\n\n";
+		else *d = other;
+	}
+	else if (options.image && strcmp(line, "commit"))
+		reply = "err there is no cartridge in image mode\n\n";
+	else if (!strcmp(line, "dump"))
+		reply = job_error(jobs_run(jobs, JOB_REREAD, REREAD_ALL));
+	else if (!strcmp(line, "save"))
+		reply = job_error(jobs_run(jobs, JOB_REREAD, REREAD_SAVE));
+	else if (!strcmp(line, "commit"))
+		reply = saveSync(*d) ? "err the cartridge went away before the save was written\n\n" : NULL;
+	else if (!strcmp(line, "cancel"))
+		reply = (result = jobs_run(jobs, JOB_CANCEL, 0)) == 1 ? "err no ROM dump running\n\n" : job_error(result);
+	else if (!strcmp(line, "verify")) {
+		result = jobs_run(jobs, JOB_CHECK, 0);
+		if (result < 0) reply = "err no ROM is served\n\n";
+		else {
+			snprintf(text, sizeof(text), "ok\nverify %s\n\n", dat_status_name(result));
+			reply = text;
+		}
+	}
+	else if (!strcmp(line, "mode")) {
+		int mode = !arg ? -1 : !strcmp(arg, "gb") ? GB_MODE : !strcmp(arg, "gba") ? GBA_MODE : !strcmp(arg, "auto") ? 0 : -1;
+		if (mode < 0) reply = "err mode takes gb, gba or auto\n\n";
+		else if ((result = jobs_run(jobs, JOB_MODE, mode)) == 1) reply = NULL;	// switched, there just isn't a cartridge of that kind
+		else reply = job_error(result);
+	}
+	else reply = "err unknown command\n\n";
+
+	send_all(fd, reply ? reply : "ok\n\n");
+}
+
+static void *client_thread(void *ptr) {
+	int fd = (int) (intptr_t) ptr;
+	struct device *d = getDevice(0);
+	char buf[256];
+	size_t len = 0;
+
+	for (;;) {
+		char *end;
+		while ((end = memchr(buf, '\n', len)) == NULL) {
+			ssize_t n;
+			if (len == sizeof(buf)) len = 0;		// too long to be a command, drop it
+			n = recv(fd, buf + len, sizeof(buf) - len, 0);
+			if (n <= 0) {
+				close(fd);
+				return NULL;
+			}
+			len += n;
+		}
+		*end = 0;
+		if (end > buf && end[-1] == '\r') end[-1] = 0;
+		command(fd, &d, buf);
+		len -= end + 1 - buf;
+		memmove(buf, end + 1, len);
+	}
+}
+
+static void *accept_thread(void *ptr) {
+	(void) ptr;
+	for (;;) {
+		pthread_t thread;
+		int fd = accept(listener, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			break;
+		}
+		if (pthread_create(&thread, NULL, client_thread, (void *) (intptr_t) fd)) close(fd);
+		else pthread_detach(thread);
+	}
+	return NULL;
+}
+
+int control_open(const char *path) {
+	struct sockaddr_un addr = {0};
+	struct stat st;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: control socket path too long\n", path);
+		return 1;
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);		// left behind by an earlier run
+
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) || chmod(path, 0600) || listen(listener, 8)) {
+		perror(path);
+		if (listener >= 0) close(listener);
+		listener = -1;
+		return 1;
+	}
+	// Remember it absolute, startDevices() changes into the cache folder
+	if (path[0] != '/' && getcwd(socketPath, sizeof(socketPath) - 1)) {
+		size_t cwd = strlen(socketPath);
+		snprintf(socketPath + cwd, sizeof(socketPath) - cwd, "/%s", path);
+	}
+	else snprintf(socketPath, sizeof(socketPath), "%s", path);
+	return 0;
+}
+
+void control_start(void) {
+	pthread_t thread;
+	if (listener < 0) return;
+	if (pthread_create(&thread, NULL, accept_thread, NULL)) fprintf(stderr, "Control socket not started\n");
+	else pthread_detach(thread);
+}
+
+void control_close(void) {
+	if (listener < 0) return;
+	close(listener);
+	unlink(socketPath);
+	listener = -1;
+}
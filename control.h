@@ -0,0 +1,20 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+// Create the control socket at path, before daemonizing so a relative path still works. Returns 0 on success
+int control_open(const char *path);
+
+// Start answering on the socket, after daemonizing since threads don't survive the fork
+void control_start(void);
+
+// Remove the socket
+void control_close(void);
+
+#endif
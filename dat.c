@@ -0,0 +1,321 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ The DAT is parsed once into a compact index file: a header, the entries sorted by CRC32,
+ entry numbers sorted by game code and a string table with the ROM names. Lookups are
+ binary searches straight on the mapping.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dat.h"
+
+#define DAT_MAGIC "GBXDAT1"
+
+struct dat_header {
+	char magic[8];
+	uint32_t count;
+	uint32_t datSize;	// size and mtime of the DAT the index was built from
+	uint32_t datMtime;
+	uint32_t stringsSize;
+};
+
+static const char *index_data;
+static const struct dat_header *header;
+static const struct dat_entry *entries;
+static const uint32_t *serials;
+static const char *strings;
+
+static const char *save_names[] = {"", "none", "sram256k", "sram512k", "flash512k", "flash1m", "eeprom4k", "eeprom64k"};
+
+// Copy the value of an attribute inside a tag, XML entities are decoded
+static int get_attribute(const char *tag, const char *end, const char *name, char *value, int len) {
+	char pattern[20];
+	snprintf(pattern, sizeof(pattern), " %s=\"", name);
+	const char *p = strstr(tag, pattern);
+	if (p == NULL || p >= end) return 0;
+	p += strlen(pattern);
+
+	int n = 0;
+	while (p < end && *p != '"' && n < len - 1) {
+		if (*p == '&') {
+			static const char *entities[][2] = {{"&amp;", "&"}, {"&apos;", "'"}, {"&quot;", "\""}, {"&lt;", "<"}, {"&gt;", ">"}};
+			int found = 0;
+			for (int e = 0; e < 5; e++) {
+				size_t l = strlen(entities[e][0]);
+				if (!strncmp(p, entities[e][0], l)) {
+					value[n++] = entities[e][1][0];
+					p += l;
+					found = 1;
+					break;
+				}
+			}
+			if (found) continue;
+		}
+		value[n++] = *p++;
+	}
+	value[n] = 0;
+	return 1;
+}
+
+// Game codes come as "AXVE" or as a full serial like "AGB-AXVE-USA"
+static void parse_serial(const char *value, char serial[4]) {
+	memset(serial, 0, 4);
+	if (strlen(value) == 4) memcpy(serial, value, 4);
+	else if (!strncmp(value, "AGB-", 4) && strlen(value) >= 8 && (value[8] == '-' || value[8] == 0)) memcpy(serial, value + 4, 4);
+}
+
+static int compare_crc(const void *a, const void *b) {
+	const struct dat_entry *x = a, *y = b;
+	return x->crc32 < y->crc32 ? -1 : x->crc32 > y->crc32;
+}
+
+static const struct dat_entry *sort_entries;
+static int compare_serial(const void *a, const void *b) {
+	return memcmp(sort_entries[*(const uint32_t *) a].serial, sort_entries[*(const uint32_t *) b].serial, 4);
+}
+
+// Parse the DAT and lay the index out in one buffer
+static char *build_index(const char *dat, size_t datLen, const struct stat *st, size_t *size) {
+	uint32_t count = 0, capacity = 1024, stringsSize = 0, stringsCapacity = 65536;
+	struct dat_entry *list = malloc(capacity * sizeof(*list));
+	char *names = malloc(stringsCapacity);
+	if (list == NULL || names == NULL) {
+		free(list);
+		free(names);
+		return NULL;
+	}
+
+	const char *p = dat;
+	while ((p = strstr(p, "<rom ")) != NULL && p < dat + datLen) {
+		const char *end = strchr(p, '>');
+		if (end == NULL) break;
+
+		char name[256], value[64], sha1[48];
+		struct dat_entry entry;
+		memset(&entry, 0, sizeof(entry));
+		if (get_attribute(p, end, "name", name, sizeof(name)) &&
+			get_attribute(p, end, "size", value, sizeof(value))) {
+			entry.size = strtoul(value, NULL, 10);
+			if (get_attribute(p, end, "crc", value, sizeof(value))) entry.crc32 = strtoul(value, NULL, 16);
+			if (get_attribute(p, end, "sha1", sha1, sizeof(sha1)) && strlen(sha1) == 40) {
+				for (int i = 0; i < 20; i++) {
+					unsigned int byte;
+					sscanf(sha1 + 2 * i, "%2x", &byte);
+					entry.sha1[i] = byte;
+				}
+			}
+			if (get_attribute(p, end, "serial", value, sizeof(value))) parse_serial(value, entry.serial);
+			if (get_attribute(p, end, "save", value, sizeof(value))) {
+				for (int s = 1; s < 8; s++) {
+					if (!strcmp(value, save_names[s])) entry.saveType = s;
+				}
+			}
+
+			size_t nameLen = strlen(name) + 1;
+			if (stringsSize + nameLen > stringsCapacity) {
+				char *grown = realloc(names, stringsCapacity * 2);
+				if (grown == NULL) break;
+				names = grown;
+				stringsCapacity *= 2;
+			}
+			if (count == capacity) {
+				struct dat_entry *grown = realloc(list, capacity * 2 * sizeof(*list));
+				if (grown == NULL) break;
+				list = grown;
+				capacity *= 2;
+			}
+			entry.name = stringsSize;
+			memcpy(names + stringsSize, name, nameLen);
+			stringsSize += nameLen;
+			list[count++] = entry;
+		}
+		p = end;
+	}
+
+	qsort(list, count, sizeof(*list), compare_crc);
+
+	*size = sizeof(struct dat_header) + count * (sizeof(struct dat_entry) + sizeof(uint32_t)) + stringsSize;
+	char *data = malloc(*size);
+	if (data != NULL) {
+		struct dat_header *h = (struct dat_header *) data;
+		memset(h, 0, sizeof(*h));
+		memcpy(h->magic, DAT_MAGIC, 8);
+		h->count = count;
+		h->datSize = st->st_size;
+		h->datMtime = st->st_mtime;
+		h->stringsSize = stringsSize;
+
+		struct dat_entry *e = (struct dat_entry *) (data + sizeof(*h));
+		uint32_t *s = (uint32_t *) (e + count);
+		memcpy(e, list, count * sizeof(*list));
+		for (uint32_t i = 0; i < count; i++) s[i] = i;
+		sort_entries = e;
+		qsort(s, count, sizeof(*s), compare_serial);
+		memcpy(s + count, names, stringsSize);
+	}
+	free(list);
+	free(names);
+	return data;
+}
+
+static void set_index(const char *data) {
+	index_data = data;
+	header = (const struct dat_header *) data;
+	entries = (const struct dat_entry *) (data + sizeof(*header));
+	serials = (const uint32_t *) (entries + header->count);
+	strings = (const char *) (serials + header->count);
+}
+
+// Map an existing index if it was built from this DAT
+static int map_index(const char *idxPath, const struct stat *st) {
+	struct stat ist;
+	int fd = open(idxPath, O_RDONLY);
+	if (fd < 0) return 1;
+	if (fstat(fd, &ist) || ist.st_size < (off_t) sizeof(struct dat_header)) {
+		close(fd);
+		return 1;
+	}
+	char *data = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return 1;
+
+	const struct dat_header *h = (const struct dat_header *) data;
+	if (memcmp(h->magic, DAT_MAGIC, 8) || h->datSize != (uint32_t) st->st_size || h->datMtime != (uint32_t) st->st_mtime ||
+		sizeof(*h) + (size_t) h->count * (sizeof(struct dat_entry) + sizeof(uint32_t)) + h->stringsSize != (size_t) ist.st_size) {
+		munmap(data, ist.st_size);
+		return 1;
+	}
+	set_index(data);
+	return 0;
+}
+
+int dat_open(const char *path) {
+	struct stat st;
+	char idxPath[4096];
+
+	if (stat(path, &st)) {
+		fprintf(stderr, "DAT %s not found\n", path);
+		return 1;
+	}
+	snprintf(idxPath, sizeof(idxPath), "%s.idx", path);
+	if (!map_index(idxPath, &st)) {
+		printf("DAT index %s loaded, %u entries\n", idxPath, header->count);
+		return 0;
+	}
+
+	// Build the index from the DAT
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) return 1;
+	char *dat = malloc(st.st_size + 1);
+	if (dat == NULL || fread(dat, 1, st.st_size, fp) != (size_t) st.st_size) {
+		fclose(fp);
+		free(dat);
+		return 1;
+	}
+	fclose(fp);
+	dat[st.st_size] = 0;
+
+	size_t size;
+	char *data = build_index(dat, st.st_size, &st, &size);
+	free(dat);
+	if (data == NULL) return 1;
+
+	// Store it for the next start, if that isn't possible keep using it from the heap
+	char tmpPath[4100];
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", idxPath);
+	FILE *out = fopen(tmpPath, "w");
+	if (out != NULL) {
+		int ok = fwrite(data, 1, size, out) == size;
+		if (fclose(out) || !ok || rename(tmpPath, idxPath)) unlink(tmpPath);
+		else if (!map_index(idxPath, &st)) {
+			free(data);
+			printf("DAT index %s built, %u entries\n", idxPath, header->count);
+			return 0;
+		}
+	}
+	set_index(data);
+	printf("DAT index built in memory, %u entries\n", header->count);
+	return 0;
+}
+
+int dat_loaded(void) {
+	return index_data != NULL;
+}
+
+// Position in the serial index of the first entry with this game code, header->count if there is none
+static uint32_t first_serial(const char *serial) {
+	uint32_t lo = 0, hi = header->count;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		int cmp = memcmp(entries[serials[mid]].serial, serial, 4);
+		if (cmp < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo < header->count && !memcmp(entries[serials[lo]].serial, serial, 4)) return lo;
+	return header->count;
+}
+
+const struct dat_entry *dat_find_serial(const char *serial) {
+	if (!dat_loaded() || serial == NULL || serial[0] == 0) return NULL;
+
+	uint32_t i = first_serial(serial);
+	return i < header->count ? &entries[serials[i]] : NULL;
+}
+
+const struct dat_entry *dat_find_layout(const char *serial) {
+	if (!dat_loaded() || serial == NULL || serial[0] == 0) return NULL;
+
+	uint32_t i = first_serial(serial);
+	if (i == header->count) return NULL;
+	const struct dat_entry *first = &entries[serials[i]];
+
+	// Revisions of a game can differ in size or save type, only answer when they all agree
+	for (; i < header->count && !memcmp(entries[serials[i]].serial, serial, 4); i++) {
+		const struct dat_entry *entry = &entries[serials[i]];
+		if (entry->size != first->size || entry->saveType != first->saveType) return NULL;
+	}
+	return first;
+}
+
+int dat_verify(const struct hashes *hash, uint32_t size, const char *serial, const struct dat_entry **match) {
+	if (match) *match = NULL;
+	if (!dat_loaded() || !hash->valid) return DAT_UNKNOWN;
+
+	// First entry with this CRC32
+	uint32_t lo = 0, hi = header->count;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (entries[mid].crc32 < hash->crc32) lo = mid + 1;
+		else hi = mid;
+	}
+	for (; lo < header->count && entries[lo].crc32 == hash->crc32; lo++) {
+		static const uint8_t nosha1[20];
+		if (entries[lo].size != size) continue;
+		if (memcmp(entries[lo].sha1, nosha1, 20) && memcmp(entries[lo].sha1, hash->sha1, 20)) continue;
+		if (match) *match = &entries[lo];
+		return DAT_VERIFIED;
+	}
+
+	// The game is known but this isn't what it should look like
+	if (dat_find_serial(serial)) return DAT_BAD;
+	return DAT_UNKNOWN;
+}
+
+const char *dat_name(const struct dat_entry *entry) {
+	return strings + entry->name;
+}
+
+const char *dat_status_name(int status) {
+	if (status == DAT_VERIFIED) return "verified";
+	if (status == DAT_BAD) return "bad";
+	return "unknown";
+}
@@ -0,0 +1,63 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ */
+
+#ifndef DAT_H
+#define DAT_H
+
+#include <stdint.h>
+#include "hash.h"
+
+// Verification result of a dump
+#define DAT_UNKNOWN 0
+#define DAT_VERIFIED 1
+#define DAT_BAD 2
+
+// Save types, DATs don't carry these by default but an entry can have a save="..." attribute
+#define DAT_SAVE_UNKNOWN 0
+#define DAT_SAVE_NONE 1
+#define DAT_SAVE_SRAM_256K 2
+#define DAT_SAVE_SRAM_512K 3
+#define DAT_SAVE_FLASH_512K 4
+#define DAT_SAVE_FLASH_1M 5
+#define DAT_SAVE_EEPROM_4K 6
+#define DAT_SAVE_EEPROM_64K 7
+
+// One ROM of the DAT as it is stored in the memory-mapped index
+struct dat_entry {
+	uint32_t crc32;
+	uint32_t size;
+	uint8_t sha1[20];
+	char serial[4];		// GBA game code, not terminated
+	uint8_t saveType;
+	uint8_t pad[3];
+	uint32_t name;		// offset of the ROM name in the string table
+};
+
+// Load a No-Intro style XML DAT. The index is built next to it as <path>.idx and mapped,
+// it is only rebuilt when the DAT changes. Returns 0 on success.
+int dat_open(const char *path);
+
+// Returns 1 when a DAT is loaded
+int dat_loaded(void);
+
+// Find the entry of a GBA game code, NULL if the DAT doesn't know it
+const struct dat_entry *dat_find_serial(const char *serial);
+
+// Like dat_find_serial() but NULL as well when revisions of the game differ in size or save type
+const struct dat_entry *dat_find_layout(const char *serial);
+
+// Look up a dump by its hashes. serial is the game code of the dump or NULL, a known game code
+// with hashes that don't match makes the dump bad. The matching entry is stored in match if given.
+int dat_verify(const struct hashes *hash, uint32_t size, const char *serial, const struct dat_entry **match);
+
+// Name of the ROM of an entry
+const char *dat_name(const struct dat_entry *entry);
+
+// Text for a verification result
+const char *dat_status_name(int status);
+
+#endif
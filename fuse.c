@@ -15,31 +15,23 @@
 #include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <signal.h>
+#include <poll.h>
 #include "gbxcart.h"
+#include "dat.h"
+#include "stats.h"
+#include "probes.h"
+#include "history.h"
+#include "control.h"
+#include "hotplug.h"
+#include "library.h"
+#include "cache.h"
 #include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-struct FileInfo nogame = {
-	.size = 17,
-	.name = "no game",
-	.data = "Filled with data"
-};
-
-struct FileInfo nosave = {
-	.size = 18,
-	.name = "no save function",
-	.data = "save data"
-};
-
-struct FileInfo dmp;
-struct FileInfo dmp_save;
-struct FileInfo ramOnlyFile = {0, "only reading ram"};
-
-struct FileInfo *save = &nosave;
-struct FileInfo *game = &nogame;
 struct options options;
 
-int condition = 0;
-
 #define OPTION(t, p) { t, offsetof(struct options, p), 1 }
 static const struct fuse_opt gbx_opts[] = {
 	OPTION("--save", ramOnly),
@@ -50,12 +42,174 @@ static const struct fuse_opt gbx_opts[] = {
 	OPTION("-r", readonly),
 	OPTION("--name=%s", filename),
 	OPTION("--cache=%s", cache_path),
+	OPTION("--dat=%s", dat_path),
+	OPTION("--port=%s", port),
+	OPTION("--image=%s", image),
+	OPTION("--trace=%s", trace_path),
+	OPTION("--control=%s", control_path),
+	OPTION("--sysfs=%s", sysfs_path),
+	OPTION("--single-thread", singlethread),
+	OPTION("--no-leds", noLeds),
+	OPTION("--multi", multi),
+	OPTION("--archive=%s", archive_path),
+	OPTION("--library", library),
 	FUSE_OPT_END
 };
 
+// The device an inode belongs to and its inode in the tree of that device, which starts at 1 like the root.
+// NULL for the root of a --multi mount, which only holds the folders of the devices
+static struct device *inode_device(fuse_ino_t ino, fuse_ino_t *local) {
+	*local = ino;
+	if (!options.multi) return getDevice(0);
+	if (ino == 1) return NULL;
+	*local = ino & ((1 << DEVICE_INO_SHIFT) - 1);
+	return getDevice((ino >> DEVICE_INO_SHIFT) - 1);
+}
+
+// --library: /library holds a folder per cartridge in the cache, see library.c. Its inodes have LIBRARY_INO set,
+// the links to the cartridge in each device follow /library itself and every folder gets 1 << 20 inodes
+#define LIBRARY_INO ((fuse_ino_t) 1 << 40)
+#define LIBRARY_ENTRY_SHIFT 20
+#define LIB_DIR 0
+#define LIB_ROM 1
+#define LIB_SAVE 2			// the newest version
+#define LIB_HISTORY_DIR 3
+#define LIB_VERSION 3		// plus the version number
+
+// The folder of a library inode and what it is in there, the folder is -1 for /library and the links
+static int library_inode(fuse_ino_t ino, int *slot) {
+	*slot = ino & ((1 << LIBRARY_ENTRY_SHIFT) - 1);
+	return (int) ((ino & ~LIBRARY_INO) >> LIBRARY_ENTRY_SHIFT) - 1;
+}
+
+static fuse_ino_t library_ino(int entry, int slot) {
+	return LIBRARY_INO + ((fuse_ino_t) (entry + 1) << LIBRARY_ENTRY_SHIFT) + slot;
+}
+
+// Name of the link to the cartridge in a device, and the folder it points to. Returns 1 if nothing is in it
+static int library_link(struct device *d, char *name, size_t size, char *target, size_t targetSize) {
+	snprintf(name, size, "%s", options.multi ? d->name : "current");
+	return history_folder(d->history, target, targetSize);
+}
+
+// The save is named like the ROM so emulators find it next to it
+static void library_save_name(int entry, char *name, size_t size) {
+	char *ext;
+	if (library_rom(entry, name, size) && library_name(entry, name, size)) return;
+	if ((ext = strrchr(name, '.')) != NULL && strchr(ext, '-') == NULL) *ext = 0;
+	strncat(name, ".sav", size - strlen(name) - 1);
+}
+
+static int library_stat(fuse_ino_t ino, struct stat *stbuf) {
+	int slot, entry = library_inode(ino, &slot);
+	char name[64], target[64];
+	struct history *h;
+	uint32_t size;
+
+	if (entry < 0) {
+		struct device *d = getDevice(slot - 1);
+		if (slot == 0) {
+			stbuf->st_mode = S_IFDIR | 0555;
+			stbuf->st_nlink = 2;
+		}
+		else if (d && !library_link(d, name, sizeof(name), target, sizeof(target))) {
+			stbuf->st_mode = S_IFLNK | 0777;
+			stbuf->st_nlink = 1;
+			stbuf->st_size = strlen(target);
+		}
+		else return -1;
+		return 0;
+	}
+	if (library_name(entry, name, sizeof(name))) return -1;
+	h = library_history(entry);
+	switch (slot) {
+	case LIB_DIR:
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+		break;
+
+	case LIB_ROM: {
+		struct stat file;
+		if (library_rom(entry, name, sizeof(name)) || stat(name, &file)) return -1;
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = file.st_size;
+		stbuf->st_mtime = file.st_mtime;
+		break;
+	}
+
+	case LIB_HISTORY_DIR:
+		if (h == NULL) return -1;
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+		break;
+
+	default:
+		if (h == NULL || history_stat(h, slot == LIB_SAVE ? history_versions(h) : slot - LIB_VERSION, &size, &stbuf->st_mtime)) return -1;
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = size;
+	}
+	return 0;
+}
+
+// Inode of name in a library folder, 0 if there is no such thing
+static fuse_ino_t library_lookup(fuse_ino_t parent, const char *name) {
+	int slot, entry = library_inode(parent, &slot);
+	char expected[64], target[64];
+	struct device *d;
+	struct history *h;
+
+	if (entry < 0) {
+		if (slot != 0) return 0;
+		for (int i = 0; (d = getDevice(i)) != NULL; i++) {
+			if (!library_link(d, expected, sizeof(expected), target, sizeof(target)) && !strcmp(name, expected))
+				return LIBRARY_INO + 1 + i;
+		}
+		if ((entry = library_find(name)) < 0 && library_scan() && (entry = library_find(name)) < 0) return 0;
+		library_refresh(entry);
+		return library_ino(entry, LIB_DIR);
+	}
+	h = library_history(entry);
+	if (slot == LIB_DIR) {
+		if (!library_rom(entry, expected, sizeof(expected)) && !strcmp(name, expected))
+			return library_ino(entry, LIB_ROM);
+		library_save_name(entry, expected, sizeof(expected));
+		if (h && history_versions(h) && !strcmp(name, expected))
+			return library_ino(entry, LIB_SAVE);
+		if (h && !strcmp(name, "history"))
+			return library_ino(entry, LIB_HISTORY_DIR);
+	}
+	else if (slot == LIB_HISTORY_DIR && h) {
+		int version = atoi(name);
+		if (!history_name(h, version, expected, sizeof(expected)) && !strcmp(name, expected))
+			return library_ino(entry, LIB_VERSION + version);
+	}
+	return 0;
+}
+
 static int file_stat(fuse_ino_t ino, struct stat *stbuf) {
+	fuse_ino_t local;
+	struct device *d = inode_device(ino, &local);
+
 	stbuf->st_ino = ino;
-	switch (ino) {
+	if (ino & LIBRARY_INO)
+		return library_stat(ino, stbuf);
+	if (d == NULL) {
+		if (ino != 1) return -1;
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+		return 0;
+	}
+	if (local > HISTORY_INO) {
+		uint32_t size;
+		if (history_stat(d->history, local - HISTORY_INO, &size, &stbuf->st_mtime)) return -1;
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = size;
+		return 0;
+	}
+	switch (local) {
 	case 1:
 		stbuf->st_mode = S_IFDIR | 0755;
 		stbuf->st_nlink = 2;
@@ -64,13 +218,25 @@ static int file_stat(fuse_ino_t ino, struct stat *stbuf) {
 	case GAME_INO:
 		stbuf->st_mode = S_IFREG | 0444;
 		stbuf->st_nlink = 1;
-		stbuf->st_size = game->size;
+		stbuf->st_size = d->game->size;
 		break;
 			
 	case SAVE_INO:
 		stbuf->st_mode = S_IFREG | 0644;
 		stbuf->st_nlink = 1;
-		stbuf->st_size = save->size;
+		stbuf->st_size = d->save->size;
+		break;
+
+	case STATS_DIR_INO:
+	case HISTORY_DIR_INO:
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+		break;
+
+	case STATS_INO:
+	case EVENTS_INO:
+		stbuf->st_mode = S_IFREG | 0444;	// generated on open, the size isn't known before
+		stbuf->st_nlink = 1;
 		break;
 	default:
 		return -1;
@@ -79,39 +245,65 @@ static int file_stat(fuse_ino_t ino, struct stat *stbuf) {
 }
 
 static void fun_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	uint64_t start = stats_time();
 	struct stat stbuf;
+	fuse_ino_t local;
 
 	(void) fi;
 
+	inode_device(ino, &local);
 	memset(&stbuf, 0, sizeof(stbuf));
 	if (file_stat(ino, &stbuf) == -1)
 		fuse_reply_err(req, ENOENT);
 	else
-		fuse_reply_attr(req, &stbuf, 1.0);
+		fuse_reply_attr(req, &stbuf, local == STATS_INO || local == EVENTS_INO ? 0.0 : 1.0);
+	stats_latency(LAT_GETATTR, start);
 }
 
 static void fun_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	uint64_t start = stats_time();
 	struct fuse_entry_param e;
+	fuse_ino_t dir;
+	struct device *d = inode_device(parent, &dir);
+
+	memset(&e, 0, sizeof(e));
+	if (parent & LIBRARY_INO)
+		e.ino = library_lookup(parent, name);
+	else if (parent == 1 && options.library && !strcmp(name, "library"))
+		e.ino = LIBRARY_INO;
+	else if (d == NULL) {
+		d = parent == 1 ? findDevice(name) : NULL;
+		if (d && !strcmp(name, d->name))
+			e.ino = d->ino + 1;
+	}
+	else if (dir == 1 && !strcmp(name, d->game->name))
+		e.ino = d->ino + GAME_INO;
+	else if (dir == 1 && !strcmp(name, d->save->name))
+		e.ino = d->ino + SAVE_INO;
+	else if (dir == 1 && !strcmp(name, ".gbx"))
+		e.ino = d->ino + STATS_DIR_INO;
+	else if (dir == STATS_DIR_INO && !strcmp(name, "stats"))
+		e.ino = d->ino + STATS_INO;
+	else if (dir == STATS_DIR_INO && !strcmp(name, "events"))
+		e.ino = d->ino + EVENTS_INO;
+	else if (dir == 1 && !strcmp(name, "history"))
+		e.ino = d->ino + HISTORY_DIR_INO;
+	else if (dir == HISTORY_DIR_INO) {
+		char expected[48];
+		int version = atoi(name);
+		if (!history_name(d->history, version, expected, sizeof(expected)) && !strcmp(name, expected))
+			e.ino = d->ino + HISTORY_INO + version;
+	}
 
-	if (parent != 1 || (strcmp(name, game->name) && strcmp(name, save->name)) != 0)
+	if (e.ino == 0)
 		fuse_reply_err(req, ENOENT);
 	else {
-		if (!strcmp(name, game->name)){
-			memset(&e, 0, sizeof(e));
-			e.ino = GAME_INO;
-			e.attr_timeout = 1.0;
-			e.entry_timeout = 1.0;
-			file_stat(e.ino, &e.attr);
-		} else {
-			memset(&e, 0, sizeof(e));
-			e.ino = SAVE_INO;
-			e.attr_timeout = 1.0;
-			e.entry_timeout = 1.0;
-			file_stat(e.ino, &e.attr);
-		}
-
+		e.attr_timeout = 1.0;
+		e.entry_timeout = 1.0;
+		file_stat(e.ino, &e.attr);
 		fuse_reply_entry(req, &e);
 	}
+	stats_latency(LAT_LOOKUP, start);
 }
 
 struct dirbuf {
@@ -139,64 +331,491 @@ static int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize, of
 		return fuse_reply_buf(req, NULL, 0);
 }
 
+// List a library folder into b, returns 0 or the error to reply with
+static int library_readdir(fuse_req_t req, struct dirbuf *b, fuse_ino_t ino) {
+	int slot, entry = library_inode(ino, &slot);
+	char name[64], target[64];
+	struct history *h;
+	struct device *d;
+
+	if (entry < 0) {
+		if (slot != 0) return ENOTDIR;
+		dirbuf_add(req, b, ".", ino);
+		dirbuf_add(req, b, "..", 1);
+		for (int i = 0; (d = getDevice(i)) != NULL; i++) {
+			if (!library_link(d, name, sizeof(name), target, sizeof(target))) dirbuf_add(req, b, name, LIBRARY_INO + 1 + i);
+		}
+		for (int i = 0, count = library_scan(); i < count; i++) {
+			if (!library_name(i, name, sizeof(name))) dirbuf_add(req, b, name, library_ino(i, LIB_DIR));
+		}
+		return 0;
+	}
+	if (slot != LIB_DIR && slot != LIB_HISTORY_DIR) return ENOTDIR;
+	if (library_name(entry, name, sizeof(name))) return ENOENT;
+	library_refresh(entry);
+	h = library_history(entry);
+	dirbuf_add(req, b, ".", ino);
+	dirbuf_add(req, b, "..", slot == LIB_DIR ? LIBRARY_INO : library_ino(entry, LIB_DIR));
+	if (slot == LIB_DIR) {
+		if (!library_rom(entry, name, sizeof(name))) dirbuf_add(req, b, name, library_ino(entry, LIB_ROM));
+		library_save_name(entry, name, sizeof(name));
+		if (h && history_versions(h)) dirbuf_add(req, b, name, library_ino(entry, LIB_SAVE));
+		if (h) dirbuf_add(req, b, "history", library_ino(entry, LIB_HISTORY_DIR));
+	}
+	else if (h) {
+		for (int version = 1; !history_name(h, version, name, sizeof(name)); version++)
+			dirbuf_add(req, b, name, library_ino(entry, LIB_VERSION + version));
+	}
+	return 0;
+}
+
 static void fun_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	uint64_t start = stats_time();
+	fuse_ino_t dir;
+	struct device *d = inode_device(ino, &dir);
 	(void) fi;
-	if (ino != 1)
-		fuse_reply_err(req, ENOTDIR);
+	if (ino & LIBRARY_INO) {
+		struct dirbuf b;
+		int err;
+
+		memset(&b, 0, sizeof(b));
+		err = library_readdir(req, &b, ino);
+		if (err)
+			fuse_reply_err(req, err);
+		else
+			reply_buf_limited(req, b.p, b.size, off, size);
+		free(b.p);
+	}
+	else if (d == NULL ? ino != 1 : dir != 1 && dir != STATS_DIR_INO && dir != HISTORY_DIR_INO)
+		fuse_reply_err(req, d == NULL ? ENOENT : ENOTDIR);
 	else {
 		struct dirbuf b;
 
 		memset(&b, 0, sizeof(b));
-		dirbuf_add(req, &b, ".", 1);
+		dirbuf_add(req, &b, ".", ino);
 		dirbuf_add(req, &b, "..", 1);
-		dirbuf_add(req, &b, game->name, GAME_INO);
-		dirbuf_add(req, &b, save->name, SAVE_INO);
+		if (options.library && ino == 1)
+			dirbuf_add(req, &b, "library", LIBRARY_INO);
+		if (d == NULL) {
+			for (int i = 0; (d = getDevice(i)) != NULL; i++)
+				dirbuf_add(req, &b, d->name, d->ino + 1);
+		}
+		else if (dir == 1) {
+			dirbuf_add(req, &b, d->game->name, d->ino + GAME_INO);
+			dirbuf_add(req, &b, d->save->name, d->ino + SAVE_INO);
+			dirbuf_add(req, &b, ".gbx", d->ino + STATS_DIR_INO);
+			dirbuf_add(req, &b, "history", d->ino + HISTORY_DIR_INO);
+		}
+		else if (dir == HISTORY_DIR_INO) {
+			char name[48];
+			for (int version = 1; !history_name(d->history, version, name, sizeof(name)); version++)
+				dirbuf_add(req, &b, name, d->ino + HISTORY_INO + version);
+		}
+		else {
+			dirbuf_add(req, &b, "stats", d->ino + STATS_INO);
+			dirbuf_add(req, &b, "events", d->ino + EVENTS_INO);
+		}
 		reply_buf_limited(req, b.p, b.size, off, size);
 		free(b.p);
 	}
+	stats_latency(LAT_READDIR, start);
 }
 
-static void fun_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+// An open /.gbx/events. Polling it waits for the next cartridge event, reading it from the start gives the state after it
+struct event_reader {
+	struct device *device;
+	unsigned int seen;				// last event this reader has read about
+	char text[256];					// state as of the last read from offset 0
+	struct fuse_pollhandle *ph;		// the kernel is waiting for the next event
+	struct event_reader *next;
+};
+
+static pthread_mutex_t readers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct event_reader *readers;
+
+// Runs on the cartridge thread of d after every event, wakes everyone who polls its events
+static void wake_readers(struct device *d, unsigned int event) {
+	(void) event;
+	pthread_mutex_lock(&readers_mutex);
+	for (struct event_reader *r = readers; r; r = r->next) {
+		if (r->ph && r->device == d) {
+			fuse_lowlevel_notify_poll(r->ph);
+			fuse_pollhandle_destroy(r->ph);
+			r->ph = NULL;
+		}
+	}
+	pthread_mutex_unlock(&readers_mutex);
+}
 
-	if (ino != GAME_INO && ino != SAVE_INO)
+// An open version in /history, or a file in /library
+struct history_file {
+	int size;
+	char *data;
+	int mapped;			// a ROM in the cache folder mapped with mmap()
+};
+
+// Open a file in /library. A ROM is mapped from the cache folder and never changes, so the kernel may keep
+// its pages across opens. A save is put together from its chunks like the ones in /history
+static void library_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	int slot, entry = library_inode(ino, &slot);
+	struct history_file *file = calloc(1, sizeof(*file));
+	struct history *h = library_history(entry);
+	char name[64];
+
+	if (entry < 0 || slot == LIB_DIR || slot == LIB_HISTORY_DIR)
+		fuse_reply_err(req, EISDIR);
+	else if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		fuse_reply_err(req, EACCES);
+	else if (file == NULL)
+		fuse_reply_err(req, ENOMEM);
+	else if (slot == LIB_ROM) {
+		struct stat st;
+		int fd = library_rom(entry, name, sizeof(name)) ? -1 : open(name, O_RDONLY);
+		if (fd >= 0 && !fstat(fd, &st) && st.st_size > 0) {
+			file->data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			file->size = st.st_size;
+			file->mapped = 1;
+		}
+		if (fd >= 0) close(fd);
+		if (!file->mapped || file->data == MAP_FAILED)
+			fuse_reply_err(req, EIO);
+		else {
+			fi->fh = (uint64_t) (uintptr_t) file;
+			fi->keep_cache = 1;
+			file = NULL;
+			fuse_reply_open(req, fi);
+		}
+	}
+	else if (h == NULL || (file->size = history_read(h, slot == LIB_SAVE ? history_versions(h) : slot - LIB_VERSION, &file->data)) < 0)
+		fuse_reply_err(req, EIO);
+	else {
+		fi->fh = (uint64_t) (uintptr_t) file;
+		file = NULL;
+		fuse_reply_open(req, fi);
+	}
+	free(file);
+}
+
+static void fun_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	uint64_t start = stats_time();
+	fuse_ino_t local;
+	struct device *d = inode_device(ino, &local);
+
+	if (ino & LIBRARY_INO)
+		library_open(req, ino, fi);
+	else if (d == NULL)
+		fuse_reply_err(req, ino == 1 ? EISDIR : ENOENT);
+	else if (local == EVENTS_INO) {
+		struct event_reader *r = calloc(1, sizeof(*r));
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			fuse_reply_err(req, EACCES);
+		else if (r == NULL)
+			fuse_reply_err(req, ENOMEM);
+		else {
+			pthread_mutex_lock(&readers_mutex);
+			r->device = d;
+			r->seen = cartStatus(d, r->text, sizeof(r->text));
+			r->next = readers;
+			readers = r;
+			pthread_mutex_unlock(&readers_mutex);
+			fi->fh = (uint64_t) (uintptr_t) r;
+			fi->direct_io = 1;
+			r = NULL;
+			fuse_reply_open(req, fi);
+		}
+		free(r);
+	}
+	else if (local == STATS_INO) {
+		// Take the snapshot now so every read of this open sees the same numbers
+		char *text = malloc(8192);
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			fuse_reply_err(req, EACCES);
+		else if (text == NULL)
+			fuse_reply_err(req, ENOMEM);
+		else {
+			stats_format(text, 8192);
+			fi->fh = (uint64_t) (uintptr_t) text;
+			fi->direct_io = 1;
+			text = NULL;
+			fuse_reply_open(req, fi);
+		}
+		free(text);
+	}
+	else if (local > HISTORY_INO) {
+		// Put the version together once, reads are served from memory
+		struct history_file *file = malloc(sizeof(*file));
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			fuse_reply_err(req, EACCES);
+		else if (file == NULL || (file->size = history_read(d->history, local - HISTORY_INO, &file->data)) < 0)
+			fuse_reply_err(req, EIO);
+		else {
+			fi->fh = (uint64_t) (uintptr_t) file;
+			file = NULL;
+			fuse_reply_open(req, fi);
+		}
+		free(file);
+	}
+	else if (local != GAME_INO && local != SAVE_INO)
 		fuse_reply_err(req, EISDIR);
 	//else if ((fi->flags & O_ACCMODE) != O_RDONLY)
 	//	fuse_reply_err(req, EACCES);
 	else
 		fuse_reply_open(req, fi);
+	stats_latency(LAT_OPEN, start);
 }
 
-static void fun_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+static void fun_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	fuse_ino_t local;
+	struct device *d = inode_device(ino, &local);
+
+	if (ino & LIBRARY_INO) {
+		struct history_file *file = (struct history_file *) (uintptr_t) fi->fh;
+		if (file->mapped) munmap(file->data, file->size);
+		else free(file->data);
+		free(file);
+	}
+	else if (d == NULL)
+		;
+	else if (local == STATS_INO)
+		free((char *) (uintptr_t) fi->fh);
+	else if (local == SAVE_INO)
+		saveCommit(d);		// the last close, don't wait for the quiet window
+	else if (local > HISTORY_INO) {
+		struct history_file *file = (struct history_file *) (uintptr_t) fi->fh;
+		free(file->data);
+		free(file);
+	}
+	else if (local == EVENTS_INO) {
+		struct event_reader *r = (struct event_reader *) (uintptr_t) fi->fh;
+		pthread_mutex_lock(&readers_mutex);
+		for (struct event_reader **p = &readers; *p; p = &(*p)->next) {
+			if (*p == r) {
+				*p = r->next;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&readers_mutex);
+		if (r->ph) fuse_pollhandle_destroy(r->ph);
+		free(r);
+	}
+	fuse_reply_err(req, 0);
+}
+
+// Every close() of the save, the writer is most likely done
+static void fun_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	fuse_ino_t local;
+	struct device *d = inode_device(ino, &local);
 	(void) fi;
+	if (d && local == SAVE_INO) saveCommit(d);
+	fuse_reply_err(req, 0);
+}
+
+// Only returns once the save is on the cartridge
+static void fsync_done(void *arg, int err) {
+	fuse_reply_err((fuse_req_t) arg, err);
+}
 
-	if (ino == GAME_INO) {
-		reply_buf_limited(req, game->data, game->size, off, size);
+// Answered once the save is on the cartridge, the worker thread doesn't wait for it
+static void fun_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	fuse_ino_t local;
+	struct device *d = inode_device(ino, &local);
+	(void) datasync;
+	(void) fi;
+	if (d && local == SAVE_INO) saveSyncAsync(d, fsync_done, req);
+	else fuse_reply_err(req, 0);
+}
+
+static void fun_poll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, struct fuse_pollhandle *ph) {
+	unsigned revents = POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM;	// what the kernel reports for files without poll
+	fuse_ino_t local;
+	struct device *d = inode_device(ino, &local);
+
+	if (d && local == EVENTS_INO) {
+		struct event_reader *r = (struct event_reader *) (uintptr_t) fi->fh;
+		// Checked under the lock the cartridge thread wakes us with, so an event in between isn't missed
+		pthread_mutex_lock(&readers_mutex);
+		if (r->seen != cartStatus(d, NULL, 0))
+			revents = POLLIN | POLLRDNORM;
+		else {
+			revents = 0;
+			if (ph) {
+				if (r->ph) fuse_pollhandle_destroy(r->ph);
+				r->ph = ph;
+				ph = NULL;
+			}
+		}
+		pthread_mutex_unlock(&readers_mutex);
 	}
-	else if (ino == SAVE_INO) reply_buf_limited(req, save->data, save->size, off, size);
+	if (ph) fuse_pollhandle_destroy(ph);
+	fuse_reply_poll(req, revents);
+}
+
+static void fun_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	uint64_t start = stats_time();
+	fuse_ino_t local;
+	struct device *d = inode_device(ino, &local);
+	struct FileInfo *file;
+
+	PROBE3(read_start, ino, off, size);
+	if (ino & LIBRARY_INO) {
+		struct history_file *file = (struct history_file *) (uintptr_t) fi->fh;
+		reply_buf_limited(req, file->data, file->size, off, size);
+	}
+	else if (d == NULL)
+		fuse_reply_err(req, EISDIR);
+	else if (local == GAME_INO) {
+		file = gameRead(d);		// the cartridge thread keeps it mapped until we are done
+		reply_buf_limited(req, file->data, file->size, off, size);
+		gameReadDone(d);
+	}
+	else if (local == SAVE_INO) {
+		file = d->save;			// taken once, the cartridge thread swaps it
+		reply_buf_limited(req, file->data, file->size, off, size);
+	}
+	else if (local > HISTORY_INO) {
+		struct history_file *file = (struct history_file *) (uintptr_t) fi->fh;
+		reply_buf_limited(req, file->data, file->size, off, size);
+	}
+	else if (local == STATS_INO) {
+		const char *text = (const char *) (uintptr_t) fi->fh;
+		reply_buf_limited(req, text, strlen(text), off, size);
+	}
+	else if (local == EVENTS_INO) {
+		struct event_reader *r = (struct event_reader *) (uintptr_t) fi->fh;
+		pthread_mutex_lock(&readers_mutex);
+		if (off == 0) r->seen = cartStatus(d, r->text, sizeof(r->text));
+		pthread_mutex_unlock(&readers_mutex);
+		reply_buf_limited(req, r->text, strlen(r->text), off, size);
+	}
+	else
+		fuse_reply_err(req, EISDIR);
+	stats_latency(LAT_READ, start);
+	PROBE1(read_done, ino);
 }
 
 static void fun_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+	uint64_t start = stats_time();
+	fuse_ino_t local;
+	struct device *d = inode_device(ino, &local);
 	(void) fi;
 
-	if (ino == GAME_INO){
+	if (ino & LIBRARY_INO) {
+		fuse_reply_err(req, EACCES);
+	}
+
+	else if (d == NULL) {
+		fuse_reply_err(req, ino == 1 ? EISDIR : ENOENT);
+	}
+
+	else if (local == GAME_INO){
 		fuse_reply_err(req, EACCES);						//Permission denied
 	} 
 	
-	else if (ino == SAVE_INO) {
-		if (save == &nosave) fuse_reply_err(req, EAGAIN); 	//if there is no save, tell user to retry later
-		else if (size+off <= dmp_save.size){
-			memcpy(dmp_save.data+off, buf, size);
-			fuse_reply_write(req, size);
-			condition = 1;
-			pthread_cond_signal(&cond);
+	else if (local == SAVE_INO) {
+		if (d->save == &nosave) fuse_reply_err(req, EAGAIN); 	//if there is no save, tell user to retry later
+		else if (size+off <= d->dmp_save.size){
+			int err = saveWrite(d, buf, size, off);
+			if (err) fuse_reply_err(req, err);
+			else fuse_reply_write(req, size);
 		} else fuse_reply_err(req, EFBIG);
 	}
 
+	else if (local == STATS_INO || local == EVENTS_INO || local > HISTORY_INO) fuse_reply_err(req, EACCES);
 	else fuse_reply_err(req, ENOENT);
+	stats_latency(LAT_WRITE, start);
+}
+
+// Format one of the hashes of a file as hex, returns the length of the value or 0 if there is none
+static int hash_xattr(const struct hashes *hash, const char *name, char *value) {
+	if (!hash->valid) return 0;
+	if (!strcmp(name, "user.crc32")) sprintf(value, "%08x", hash->crc32);
+	else if (!strcmp(name, "user.md5")) hash_to_hex(hash->md5, 16, value);
+	else if (!strcmp(name, "user.sha1")) hash_to_hex(hash->sha1, 20, value);
+	else if (!strcmp(name, "user.verify") && dat_loaded()) strcpy(value, dat_status_name(hash->verify));
+	else return 0;
+	return strlen(value);
+}
+
+// Hashes of a ROM in /library from the cache index, returns 1 for anything else or a ROM that isn't in it
+static int library_hash(fuse_ino_t ino, struct hashes *hash) {
+	int slot, entry = library_inode(ino, &slot);
+	struct stat st;
+	char name[64];
+	if (slot != LIB_ROM || entry < 0 || library_rom(entry, name, sizeof(name)) || stat(name, &st)) return 1;
+	return cache_index_lookup(name, st.st_size, hash);
+}
+
+static void fun_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+	uint64_t start = stats_time();
+	fuse_ino_t local;
+	struct device *d = inode_device(ino, &local);
+	int rom = (ino & LIBRARY_INO) || local == GAME_INO;
+	struct hashes hash;
+	char value[41];
+	int len;
+
+	if (ino & LIBRARY_INO) {
+		if (library_hash(ino, &hash)) hash.valid = 0;
+	}
+	else if (d && local == GAME_INO) hash = d->game->hash;
+	else if (d && local == SAVE_INO) hash = d->save->hash;
+	else hash.valid = 0;
+
+	// Only the ROM is checked against the DAT
+	if (!rom && !strcmp(name, "user.verify")) hash.valid = 0;
+
+	len = hash_xattr(&hash, name, value);
+	if (len == 0)
+		fuse_reply_err(req, ENODATA);
+	else if (size == 0)
+		fuse_reply_xattr(req, len);
+	else if (size < len)
+		fuse_reply_err(req, ERANGE);
+	else
+		fuse_reply_buf(req, value, len);
+	stats_latency(LAT_XATTR, start);
+}
+
+static void fun_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+	static const char names[] = "user.crc32\0user.md5\0user.sha1\0user.verify";
+	uint64_t start = stats_time();
+	fuse_ino_t local;
+	struct device *d = inode_device(ino, &local);
+	struct hashes hash;
+	size_t len = 0;
+
+	if (ino & LIBRARY_INO) {
+		if (!library_hash(ino, &hash))
+			len = dat_loaded() ? sizeof(names) : sizeof(names) - sizeof("user.verify");
+	}
+	else if (d && ((local == GAME_INO && d->game->hash.valid) || (local == SAVE_INO && d->save->hash.valid)))
+		len = local == GAME_INO && dat_loaded() ? sizeof(names) : sizeof(names) - sizeof("user.verify");
+
+	if (size == 0)
+		fuse_reply_xattr(req, len);
+	else if (size < len)
+		fuse_reply_err(req, ERANGE);
+	else
+		fuse_reply_buf(req, names, len);
+	stats_latency(LAT_XATTR, start);
+}
+
+// The links in /library to the cartridge in each device
+static void fun_readlink(fuse_req_t req, fuse_ino_t ino) {
+	int slot, entry = library_inode(ino, &slot);
+	struct device *d = (ino & LIBRARY_INO) && entry < 0 ? getDevice(slot - 1) : NULL;
+	char name[64], target[64];
+
+	if (d && !library_link(d, name, sizeof(name), target, sizeof(target)))
+		fuse_reply_readlink(req, target);
+	else
+		fuse_reply_err(req, d ? ENOENT : EINVAL);
 }
 
 static void fun_unlink(fuse_req_t req, fuse_ino_t parent, const char *name){
-	if (!strcmp(name, save->name))
+	fuse_ino_t dir;
+	struct device *d = inode_device(parent, &dir);
+	if (d && !strcmp(name, d->save->name))
 	fuse_reply_err(req, 0);
 	fuse_reply_err(req, EACCES);
 }
@@ -206,9 +825,16 @@ static const struct fuse_lowlevel_ops fun_oper = {
 	.getattr	= fun_getattr,
 	.readdir	= fun_readdir,
 	.open		= fun_open,
+	.release	= fun_release,
 	.read		= fun_read,
+	.flush		= fun_flush,
+	.fsync		= fun_fsync,
+	.poll		= fun_poll,
 	.write		= fun_write,
 	.unlink		= fun_unlink,
+	.readlink	= fun_readlink,
+	.getxattr	= fun_getxattr,
+	.listxattr	= fun_listxattr,
 };
 
 
@@ -237,6 +863,17 @@ int main(int argc, char *argv[])
 				"    -e   --reread          Re-read the cartridge on reinsert\n"\
 				"         --cache=<..>      Path to cached files for faster loading\n"\
 				"         --name=<..>       Custom name\n"\
+				"         --dat=<..>        No-Intro DAT to verify dumps against\n"\
+				"         --port=<..>       Serial device to use instead of detecting it, several separated by commas\n"\
+				"         --multi           Serve every GBxCart found, each in a folder of its own\n"\
+				"         --archive=<..>    Don't mount, dump every cartridge inserted into this folder\n"\
+				"         --library         Browse every cartridge in the cache folder in /library\n"\
+				"         --sysfs=<..>      Where to look for USB serial devices, /sys by default\n"\
+				"         --image=<..>      Serve a ROM file instead of a cartridge, SIGUSR1 swaps it out and in\n"\
+				"         --single-thread   Single threaded loop, -s is taken by --save\n"\
+				"         --trace=<..>      Record the serial traffic, gbxemu --replay plays it back\n"\
+				"         --no-leds         Leave the progress and done/error LEDs alone\n"\
+				"         --control=<..>    Unix socket to send commands to, see control.c\n"\
 				);
 		ret = 0;
 		goto err_out1;
@@ -247,16 +884,60 @@ int main(int argc, char *argv[])
 		goto err_out1;
 	}
 
-	if(opts.mountpoint == NULL) {
+	if(opts.mountpoint == NULL && !options.archive_path) {
 		printf("usage: %s [options] <mountpoint>\n", argv[0]);
 		printf("       %s --help\n", argv[0]);
 		ret = 1;
 		goto err_out1;
 	}
 
-	if (gba()) {
+	if (options.dat_path && dat_open(options.dat_path)) {
+		goto err_out1;
+	}
+
+	if (options.library && (options.cache_path == NULL || access(options.cache_path, F_OK))) {
+		fprintf(stderr, "--library needs an existing --cache folder\n");
+		goto err_out1;
+	}
+
+	if (options.archive_path) {
+		ret = setupDevice();
+		if (ret == 0) {
+			hotplug_start(options.port, devicesChanged);
+			ret = archiveCarts(options.archive_path);
+		}
+		goto err_out1;
+	}
+
+	if (options.port && strchr(options.port, ','))
+		options.multi = 1;
+	if (options.image) {
+		options.multi = 0;
+		useDevice(addDevice(NULL));
+		if (loadImage(options.image))
+			goto err_out1;
+	} else if (setupDevice()) {
+		goto err_out1;		// the GBxCart itself is looked for by the cartridge thread once mounted
+	} else if (options.multi && options.trace_path) {
+		fprintf(stderr, "--trace records a single GBxCart, it can't be used with --multi\n");
+		goto err_out1;
+	} else if (options.multi && options.port) {
+		char ports[4096], *save;
+		snprintf(ports, sizeof(ports), "%s", options.port);
+		for (char *port = strtok_r(ports, ",", &save); port; port = strtok_r(NULL, ",", &save)) {
+			if (addDevice(port) == NULL)
+				goto err_out1;
+		}
+	} else if (options.multi) {
+		if (scanDevices() < 0)
+			fprintf(stderr, "No sysfs to find GBxCarts in, only the ones given with --port are served\n");
+	} else if (addDevice(options.port) == NULL) {
 		goto err_out1;
 	}
+	if (options.control_path && control_open(options.control_path))
+		goto err_out1;
+	if (options.singlethread)
+		opts.singlethread = 1;
 	
 	se = fuse_session_new(&args, &fun_oper, sizeof(fun_oper), &options);
 	if (se == NULL)
@@ -269,14 +950,20 @@ int main(int argc, char *argv[])
 	    goto err_out3;
 	
 	fuse_daemonize(opts.foreground);
+	control_start();
+	if (!options.image) hotplug_start(options.multi ? NULL : options.port, devicesChanged);
 	
-	/* Start thread to update file contents */
-
-	pthread_t thread;
-	int rc = pthread_create(&thread, NULL, Thandler, (void *) se);
-	if (rc){
-        fprintf(stderr, "pthread_create failed with %s\n", strerror(rc));
+	/* Start a thread per device to update file contents */
+
+	setCartEventListener(wake_readers);
+	if (options.image) {
+		// Only the image thread takes SIGUSR1, the loop threads inherit the mask
+		sigset_t set;
+		sigemptyset(&set);
+		sigaddset(&set, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
 	}
+	startDevices(se);
 
 	/* Block until ctrl+c or fusermount -u */
 	if (opts.singlethread)
@@ -293,6 +980,7 @@ err_out3:
 err_out2:
 	fuse_session_destroy(se);
 err_out1:
+	control_close();
 	free(opts.mountpoint);
 	fuse_opt_free_args(&args);
 
@@ -0,0 +1,401 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ Benchmark of the FUSE side. gbxfuse is mounted with --image over a generated ROM, so no cartridge or
+ serial port is involved, and the mount is read with a few access patterns, once with the single
+ threaded loop and once with the multithreaded one. One JSON object per pattern is printed on stdout.
+ Reads use O_DIRECT so every read reaches fun_read instead of the page cache (--cached to allow it).
+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#ifndef GBX_REVISION
+#define GBX_REVISION "unknown"
+#endif
+
+#define MAX_SAMPLES 1000000		// latencies kept per thread, later ones are not recorded
+
+static struct {
+	const char *fuse;
+	const char *image;
+	const char *pattern;
+	uint32_t size;
+	int threads;
+	double seconds;
+	int cached;
+	int verbose;
+} bench = {"./gbxfuse", NULL, NULL, 0x800000, 8, 3.0, 0, 0};
+
+static char workDir[64];
+static char mountPoint[128];
+static char romPath[4096];
+static char gameName[20];		// as gbxfuse names it, FileInfo.name holds 19 characters
+static pid_t fusePid;
+
+struct pattern;
+
+struct worker {
+	const struct pattern *pattern;
+	pthread_t thread;
+	uint32_t seed;
+	uint32_t *samples;		// latency of every operation in microseconds
+	uint32_t count;
+	uint64_t ops, bytes, errors;
+};
+
+struct pattern {
+	const char *name;
+	int (*op)(struct worker *w, int fd, char *buf, off_t *pos);
+	int threads;			// 0 takes --threads
+	int swap;				// remove and reinsert the cartridge while reading
+};
+
+static volatile int running;
+
+static uint32_t next_random(uint32_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// CPU time of a process from /proc, in seconds
+static double process_cpu(pid_t pid) {
+	char path[64], line[1024];
+	unsigned long utime = 0, stime = 0;
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) return 0;
+	if (fgets(line, sizeof(line), fp)) {
+		char *p = strrchr(line, ')');		// the name can hold spaces
+		if (p) sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+	}
+	fclose(fp);
+	return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double self_cpu(void) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static int open_game(void) {
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%s", mountPoint, gameName);
+	int fd = open(path, O_RDONLY | (bench.cached ? 0 : O_DIRECT));
+	if (fd < 0 && errno == EINVAL && !bench.cached) {
+		fprintf(stderr, "O_DIRECT not supported, reads may come from the page cache\n");
+		bench.cached = 1;
+		fd = open(path, O_RDONLY);
+	}
+	return fd;
+}
+
+static int read_sequential(struct worker *w, int fd, char *buf, off_t *pos) {
+	ssize_t n = pread(fd, buf, 0x20000, *pos);
+	if (n <= 0) {		// past the end of "no game" while it is swapped out
+		*pos = 0;
+		return 1;
+	}
+	w->bytes += n;
+	*pos += n;
+	if (*pos >= bench.size) *pos = 0;
+	return n != 0x20000;
+}
+
+static int read_random(struct worker *w, int fd, char *buf, off_t *pos) {
+	*pos = (off_t) (next_random(&w->seed) % (bench.size / 0x1000)) * 0x1000;
+	ssize_t n = pread(fd, buf, 0x1000, *pos);
+	if (n > 0) w->bytes += n;
+	return n != 0x1000;
+}
+
+// lookup and getattr of the game, a lookup that fails and a readdir of the mount
+static int read_metadata(struct worker *w, int fd, char *buf, off_t *pos) {
+	char path[256];
+	struct stat st;
+	int failed = 0;
+
+	(void) w, (void) fd, (void) buf, (void) pos;
+	snprintf(path, sizeof(path), "%s/%s", mountPoint, gameName);
+	failed |= stat(path, &st) != 0;
+	snprintf(path, sizeof(path), "%s/missing", mountPoint);
+	failed |= stat(path, &st) == 0;
+
+	DIR *dir = opendir(mountPoint);
+	if (dir == NULL) return 1;
+	int entries = 0;
+	while (readdir(dir)) entries++;
+	closedir(dir);
+	return failed || entries != 4;
+}
+
+static const struct pattern patterns[] = {
+	{"seq128k", read_sequential, 1, 0},
+	{"rand4k", read_random, 1, 0},
+	{"concurrent4k", read_random, 0, 0},
+	{"concurrent128k", read_sequential, 0, 0},
+	{"metadata", read_metadata, 1, 0},
+	{"swap128k", read_sequential, 4, 1},
+};
+
+static void *run_worker(void *ptr) {
+	struct worker *w = ptr;
+	char *buf;
+	off_t pos = 0;
+
+	if (posix_memalign((void **) &buf, 0x1000, 0x20000)) return NULL;
+	int fd = open_game();
+	if (fd < 0) w->errors++;
+	while (fd >= 0 && running) {
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		int failed = w->pattern->op(w, fd, buf, &pos);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		uint64_t us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+		if (w->count < MAX_SAMPLES) w->samples[w->count++] = us;
+		w->ops++;
+		if (failed) w->errors++;
+	}
+	if (fd >= 0) close(fd);
+	free(buf);
+	return NULL;
+}
+
+static int compare_samples(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void run_pattern(const struct pattern *p, const char *loop) {
+	int threads = p->threads ? p->threads : bench.threads;
+	struct worker *workers = calloc(threads, sizeof(*workers));
+
+	double startCpu = process_cpu(fusePid), startSelf = self_cpu(), start = now();
+	running = 1;
+	for (int i = 0; i < threads; i++) {
+		workers[i].pattern = p;
+		workers[i].seed = 0x9E3779B9 * (i + 1);
+		workers[i].samples = malloc(MAX_SAMPLES * sizeof(uint32_t));
+		pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+	}
+
+	// Swap the cartridge out and back in every 100ms, like pulling it out of the GBxCart
+	int swaps = 0;
+	while (now() - start < bench.seconds) {
+		usleep(p->swap ? 100000 : 20000);
+		if (p->swap) {
+			kill(fusePid, SIGUSR1);
+			swaps++;
+		}
+	}
+	running = 0;
+	if (swaps & 1) kill(fusePid, SIGUSR1);
+
+	uint64_t ops = 0, bytes = 0, errors = 0;
+	uint32_t count = 0;
+	for (int i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+		bytes += workers[i].bytes;
+		errors += workers[i].errors;
+		count += workers[i].count;
+	}
+	double wall = now() - start;
+	double fuseCpu = process_cpu(fusePid) - startCpu, clientCpu = self_cpu() - startSelf;
+
+	uint32_t *all = malloc((count ? count : 1) * sizeof(uint32_t)), n = 0;
+	for (int i = 0; i < threads; i++) {
+		memcpy(all + n, workers[i].samples, workers[i].count * sizeof(uint32_t));
+		n += workers[i].count;
+		free(workers[i].samples);
+	}
+	qsort(all, count, sizeof(uint32_t), compare_samples);
+	uint32_t p50 = count ? all[count / 2] : 0, p99 = count ? all[(uint64_t) count * 99 / 100] : 0;
+	double gb = bytes / 1e9;
+
+	printf("{\"revision\":\"%s\",\"loop\":\"%s\",\"pattern\":\"%s\",\"threads\":%d,\"direct\":%s,\"ops\":%llu,"
+		"\"bytes\":%llu,\"wall_s\":%.6f,\"mb_per_s\":%.1f,\"ops_per_s\":%.0f,\"p50_us\":%u,\"p99_us\":%u,"
+		"\"fuse_cpu_s\":%.3f,\"fuse_cpu_s_per_gb\":%.3f,\"client_cpu_s_per_gb\":%.3f,\"swaps\":%d,\"errors\":%llu}\n",
+		GBX_REVISION, loop, p->name, threads, bench.cached ? "false" : "true", (unsigned long long) ops,
+		(unsigned long long) bytes, wall, bytes / wall / 1e6, ops / wall, p50, p99, fuseCpu,
+		gb > 0 ? fuseCpu / gb : 0, gb > 0 ? clientCpu / gb : 0, swaps, (unsigned long long) errors);
+	fflush(stdout);
+	free(all);
+	free(workers);
+}
+
+// Mount the image and wait until the game shows up
+static pid_t start_fuse(int singleThread) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		char image[4200];
+		snprintf(image, sizeof(image), "--image=%s", romPath);
+		if (!bench.verbose) {
+			int devNull = open("/dev/null", O_WRONLY);
+			dup2(devNull, 1);
+			dup2(devNull, 2);
+		}
+		if (singleThread) execl(bench.fuse, bench.fuse, "-f", "--single-thread", image, mountPoint, (char *) NULL);
+		else execl(bench.fuse, bench.fuse, "-f", image, mountPoint, (char *) NULL);
+		perror(bench.fuse);
+		_exit(1);
+	}
+
+	char path[256];
+	struct stat st;
+	snprintf(path, sizeof(path), "%s/%s", mountPoint, gameName);
+	for (int i = 0; i < 500; i++) {
+		if (!stat(path, &st) && st.st_size == bench.size) return pid;
+		if (waitpid(pid, NULL, WNOHANG) == pid) return -1;
+		usleep(10000);
+	}
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+static void stop_fuse(pid_t pid) {
+	kill(pid, SIGTERM);		// the fuse signal handlers end the loop and unmount
+	waitpid(pid, NULL, 0);
+}
+
+static int make_image(void) {
+	uint32_t state = 0x12345678;
+	snprintf(romPath, sizeof(romPath), "%s/bench.gba", workDir);
+	FILE *fp = fopen(romPath, "wb");
+	if (fp == NULL) return 1;
+	for (uint32_t i = 0; i < bench.size; i += 4) {
+		uint32_t r = next_random(&state);
+		fwrite(&r, 4, 1, fp);
+	}
+	if (fclose(fp)) return 1;
+
+	char savePath[4096];
+	snprintf(savePath, sizeof(savePath), "%s/bench.sav", workDir);
+	fp = fopen(savePath, "wb");
+	if (fp == NULL) return 1;
+	for (int i = 0; i < 0x10000; i++) fputc(i & 0xFF, fp);
+	return fclose(fp) != 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [options]\n\n"
+		"    --fuse=<path>         gbxfuse to run (default ./gbxfuse)\n"
+		"    --image=<path>        ROM to serve instead of a generated one\n"
+		"    --size=<bytes>        Size of the generated ROM (default 8MB)\n"
+		"    --pattern=<name>      Only run patterns containing this name\n"
+		"    --threads=<n>         Readers of the concurrent patterns (default 8)\n"
+		"    --seconds=<n>         Time per pattern (default 3)\n"
+		"    --cached              Read through the page cache instead of O_DIRECT\n"
+		"    -v   --verbose        Show the output of gbxfuse\n\n"
+		"patterns:", name);
+	for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) fprintf(stderr, " %s", patterns[i].name);
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+	static const struct option longOptions[] = {
+		{"fuse", required_argument, NULL, 'f'},
+		{"image", required_argument, NULL, 'i'},
+		{"size", required_argument, NULL, 's'},
+		{"pattern", required_argument, NULL, 'p'},
+		{"threads", required_argument, NULL, 't'},
+		{"seconds", required_argument, NULL, 'S'},
+		{"cached", no_argument, NULL, 'c'},
+		{"verbose", no_argument, NULL, 'v'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	char fusePath[4096];
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "vh", longOptions, NULL)) != -1) {
+		switch (opt) {
+			case 'f': bench.fuse = optarg; break;
+			case 'i': bench.image = optarg; break;
+			case 's': bench.size = strtoul(optarg, NULL, 0); break;
+			case 'p': bench.pattern = optarg; break;
+			case 't': bench.threads = atoi(optarg); break;
+			case 'S': bench.seconds = atof(optarg); break;
+			case 'c': bench.cached = 1; break;
+			case 'v': bench.verbose = 1; break;
+			default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (bench.threads < 1) bench.threads = 1;
+
+	if (realpath(bench.fuse, fusePath) == NULL) {
+		fprintf(stderr, "%s not found, build it with make\n", bench.fuse);
+		return 1;
+	}
+	bench.fuse = fusePath;
+
+	strcpy(workDir, "/tmp/fusebench.XXXXXX");
+	if (mkdtemp(workDir) == NULL) {
+		perror("Can't create a work directory");
+		return 1;
+	}
+	snprintf(mountPoint, sizeof(mountPoint), "%s/mnt", workDir);
+	mkdir(mountPoint, 0755);
+
+	if (bench.image) {
+		struct stat st;
+		if (realpath(bench.image, romPath) == NULL || stat(romPath, &st)) {
+			fprintf(stderr, "%s not found\n", bench.image);
+			return 1;
+		}
+		bench.size = st.st_size;
+	} else if (bench.size < 0x1000 || make_image()) {
+		fprintf(stderr, "Can't create the image\n");
+		return 1;
+	}
+	const char *base = strrchr(romPath, '/');
+	snprintf(gameName, sizeof(gameName), "%s", base + 1);
+
+	int failed = 0;
+	for (int singleThread = 1; singleThread >= 0; singleThread--) {
+		fusePid = start_fuse(singleThread);
+		if (fusePid < 0) {
+			fprintf(stderr, "%s didn't mount %s\n", bench.fuse, mountPoint);
+			failed = 1;
+			break;
+		}
+		for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+			if (bench.pattern && !strstr(patterns[i].name, bench.pattern)) continue;
+			run_pattern(&patterns[i], singleThread ? "single" : "multi");
+		}
+		stop_fuse(fusePid);
+	}
+
+	char command[128];
+	snprintf(command, sizeof(command), "rm -rf %s", workDir);
+	system(command);
+	return failed;
+}
@@ -0,0 +1,364 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ Benchmark of the dumping code against gbxemu. Every profile gets a generated ROM and save, an emulator
+ on a pty and runs header detection, save dump, ROM dump, save write and a cache miss and hit.
+ One JSON object per phase is printed on stdout, everything the dumping code prints goes to /dev/null
+ (or stderr with --verbose).
+
+ */
+
+#include "gbxcart.h"
+#include "cache.h"
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#ifndef GBX_REVISION
+#define GBX_REVISION "unknown"
+#endif
+
+struct options options;
+
+static const struct profile {
+	const char *name;
+	uint8_t mode;
+	uint32_t romSize;
+	uint8_t type, romCode, ramCode;		// GB header
+	uint32_t saveSize;
+	const char *saveType;				// for the emulator
+} profiles[] = {
+	{"gb-mbc1", GB_MODE, 0x80000, 0x03, 4, 2, 0x2000, "sram"},
+	{"gb-mbc3", GB_MODE, 0x200000, 0x13, 6, 3, 0x8000, "sram"},
+	{"gb-mbc5", GB_MODE, 0x400000, 0x1B, 7, 4, 0x20000, "sram"},
+	{"gb-camera", GB_MODE, 0x100000, 0xFC, 5, 4, 0x20000, "sram"},
+	{"gba-sram-4m", GBA_MODE, 0x400000, 0, 0, 0, 0x8000, "sram"},
+	{"gba-eeprom-8m", GBA_MODE, 0x800000, 0, 0, 0, 0x2000, "eeprom"},
+	{"gba-flash-16m", GBA_MODE, 0x1000000, 0, 0, 0, 0x10000, "flash"},
+	{"gba-flash1m-32m", GBA_MODE, 0x2000000, 0, 0, 0, 0x20000, "flash"},
+};
+
+static struct {
+	const char *emu;
+	const char *profile;
+	const char *baud;
+	const char *latency;
+	const char *drop;
+	const char *corrupt;
+	int fast;
+	int verbose;
+} bench = {"./gbxemu", NULL, "0", "0", "0", "0", 0, 0};
+
+static FILE *out;
+static char workDir[64];
+
+struct sample {
+	struct timespec time;
+	uint64_t sleepNs;
+	uint32_t sleeps;
+	unsigned long syscr, syscw;
+};
+
+static void take_sample(struct sample *s) {
+	char line[64];
+	FILE *io = fopen("/proc/self/io", "r");
+	s->syscr = s->syscw = 0;
+	while (io && fgets(line, sizeof(line), io)) {
+		sscanf(line, "syscr: %lu", &s->syscr);
+		sscanf(line, "syscw: %lu", &s->syscw);
+	}
+	if (io) fclose(io);
+	s->sleepNs = sleepTimeNs;
+	s->sleeps = sleepCount;
+	clock_gettime(CLOCK_MONOTONIC, &s->time);
+}
+
+static void report(const char *profile, const char *phase, const struct sample *start, uint32_t bytes, int ok) {
+	struct sample end;
+	take_sample(&end);
+	double wall = (end.time.tv_sec - start->time.tv_sec) + (end.time.tv_nsec - start->time.tv_nsec) / 1e9;
+	double sleep = (end.sleepNs - start->sleepNs) / 1e9;
+
+	fprintf(out, "{\"revision\":\"%s\",\"profile\":\"%s\",\"phase\":\"%s\",\"bytes\":%u,\"wall_s\":%.6f,"
+		"\"bytes_per_s\":%.0f,\"sleep_s\":%.6f,\"sleeps\":%u,\"transfer_s\":%.6f,\"syscalls_read\":%lu,"
+		"\"syscalls_write\":%lu,\"ok\":%s}\n",
+		GBX_REVISION, profile, phase, bytes, wall, wall > 0 ? bytes / wall : 0, sleep, end.sleeps - start->sleeps,
+		wall - sleep, end.syscr - start->syscr, end.syscw - start->syscw, ok ? "true" : "false");
+	fflush(out);
+}
+
+// Deterministic filler, the images only need to look like real data
+static uint32_t next_random(uint32_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static uint8_t *make_rom(const struct profile *p) {
+	uint8_t *rom = malloc(p->romSize);
+	uint32_t state = 0x12345678;
+	for (uint32_t i = 0; i < p->romSize; i += 4) {
+		uint32_t r = next_random(&state);
+		memcpy(rom + i, &r, 4);
+	}
+
+	if (p->mode == GB_MODE) {
+		memset(rom + 0x134, 0, 16);
+		memcpy(rom + 0x134, "BENCHMARK", 9);
+		rom[0x147] = p->type;
+		rom[0x148] = p->romCode;
+		rom[0x149] = p->ramCode;
+
+		uint8_t check = 0;
+		for (int x = 0x134; x <= 0x14C; x++) check = check - rom[x] - 1;
+		rom[0x14D] = check;
+
+		uint16_t sum = 0;
+		for (uint32_t x = 0; x < p->romSize; x++) {
+			if (x != 0x14E && x != 0x14F) sum += rom[x];
+		}
+		rom[0x14E] = sum >> 8;
+		rom[0x14F] = sum & 0xFF;
+	}
+	else {
+		memcpy(rom + 0x04, nintendoLogoGBA, sizeof(nintendoLogoGBA));
+		memset(rom + 0xA0, 0, 12);
+		memcpy(rom + 0xA0, "BENCHMARK", 9);
+		memcpy(rom + 0xAC, "BNCE", 4);
+		rom[0xB2] = 0x96;
+
+		uint8_t complement = 0;
+		for (int x = 0xA0; x <= 0xBC; x++) complement -= rom[x];
+		rom[0xBD] = complement - 0x19;
+	}
+	return rom;
+}
+
+static int write_file(const char *path, const uint8_t *data, uint32_t size) {
+	FILE *fp = fopen(path, "wb");
+	if (fp == NULL) return 1;
+	int ok = fwrite(data, 1, size, fp) == size;
+	return fclose(fp) || !ok;
+}
+
+// Start the emulator and wait until its pty is there
+static pid_t start_emulator(const struct profile *p, const char *romPath, const char *savePath, const char *link) {
+	int pipeFd[2];
+	if (pipe(pipeFd)) return -1;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char baud[32], latency[32], drop[32], corrupt[32], saveType[32], linkArg[160];
+		snprintf(baud, sizeof(baud), "--baud=%s", bench.baud);
+		snprintf(latency, sizeof(latency), "--latency=%s", bench.latency);
+		snprintf(drop, sizeof(drop), "--drop=%s", bench.drop);
+		snprintf(corrupt, sizeof(corrupt), "--corrupt=%s", bench.corrupt);
+		snprintf(saveType, sizeof(saveType), "--save-type=%s", p->saveType);
+		snprintf(linkArg, sizeof(linkArg), "--link=%s", link);
+
+		dup2(pipeFd[1], 1);
+		if (!bench.verbose) {
+			int devNull = open("/dev/null", O_WRONLY);
+			dup2(devNull, 2);
+		}
+		close(pipeFd[0]);
+		execl(bench.emu, bench.emu, baud, latency, drop, corrupt, saveType, linkArg, romPath, savePath, (char *) NULL);
+		perror(bench.emu);
+		_exit(1);
+	}
+	close(pipeFd[1]);
+
+	char line[128];
+	FILE *fp = fdopen(pipeFd[0], "r");
+	int ready = fp && fgets(line, sizeof(line), fp) != NULL;
+	if (fp) fclose(fp);
+	if (!ready) {
+		if (pid > 0) waitpid(pid, NULL, 0);
+		return -1;
+	}
+	return pid;
+}
+
+static int files_equal(const char *path, const char *data, uint32_t size) {
+	struct stat st;
+	if (stat(path, &st) || st.st_size < size) return 0;
+	char *file = malloc(size);
+	FILE *fp = fopen(path, "rb");
+	int equal = fp && fread(file, 1, size, fp) == size && !memcmp(file, data, size);
+	if (fp) fclose(fp);
+	free(file);
+	return equal;
+}
+
+static int run_profile(const struct profile *p) {
+	char romPath[128], savePath[128], link[128], cacheDir[128];
+	struct sample start;
+	const char *name = p->name;
+
+	snprintf(romPath, sizeof(romPath), "%s/%s%s", workDir, name, p->mode == GB_MODE ? ".gb" : ".gba");
+	snprintf(savePath, sizeof(savePath), "%s/%s.sav", workDir, name);
+	snprintf(link, sizeof(link), "%s/%s.pty", workDir, name);
+	snprintf(cacheDir, sizeof(cacheDir), "%s/%s.cache", workDir, name);
+
+	uint8_t *rom = make_rom(p);
+	uint8_t *saveData = malloc(p->saveSize);
+	uint32_t state = 0x9E3779B9;
+	for (uint32_t i = 0; i < p->saveSize; i++) saveData[i] = next_random(&state);
+	if (write_file(romPath, rom, p->romSize) || write_file(savePath, saveData, p->saveSize)) {
+		fprintf(stderr, "Can't write the images for %s\n", name);
+		return 1;
+	}
+	free(saveData);
+
+	pid_t emu = start_emulator(p, romPath, savePath, link);
+	if (emu < 0) {
+		fprintf(stderr, "Can't start %s\n", bench.emu);
+		free(rom);
+		return 1;
+	}
+
+	// A device of its own per profile, as if every emulator was another GBxCart
+	struct device *d = addDevice(link);
+	if (d == NULL) {
+		kill(emu, SIGTERM);
+		waitpid(emu, NULL, 0);
+		free(rom);
+		return 1;
+	}
+	useDevice(d);
+	take_sample(&start);
+	int ok = gba() == 0;
+	report(name, "connect", &start, 0, ok);
+	if (!ok) goto out;
+	if (bench.fast) fastReadEnabled = 1;		// gbxfuse never turns it on by itself
+
+	take_sample(&start);
+	updateTitle();
+	cartridgeMode = request_value(CART_MODE);
+	report(name, "header", &start, 0, strcmp(d->nogame.name, "no game") != 0);
+
+	take_sample(&start);
+	ok = dumpRam() == 0;
+	report(name, "save_dump", &start, d->dmp_save.size, ok && files_equal(savePath, d->dmp_save.data, d->dmp_save.size));
+
+	if (ok) {
+		for (uint32_t i = 0; i < d->dmp_save.size; i++) d->dmp_save.data[i] ^= 0x5A;
+		take_sample(&start);
+		ok = writeRam() == 0;
+		report(name, "save_write", &start, d->dmp_save.size, ok && files_equal(savePath, d->dmp_save.data, d->dmp_save.size));
+	}
+
+	take_sample(&start);
+	dumpRom();
+	report(name, "rom_dump", &start, d->dmp.size, d->dmp.size == p->romSize && !memcmp(d->dmp.data, rom, p->romSize));
+
+	// The cache works in the current directory, like it does under Thandler.
+	// CacheROM() names the file after the nogame name of the device, which Thandler reads again before every call.
+	mkdir(cacheDir, 0755);
+	if (chdir(cacheDir) == 0) {
+		char title[20];
+		strcpy(title, d->nogame.name);
+
+		take_sample(&start);
+		CacheROM();
+		report(name, "cache_miss", &start, d->dmp.size, d->dmp.size == p->romSize && !memcmp(d->dmp.data, rom, p->romSize));
+		cache_write_wait();
+
+		strcpy(d->nogame.name, title);
+		take_sample(&start);
+		CacheROM();
+		report(name, "cache_hit", &start, d->dmp.size, d->dmp.size == p->romSize && !memcmp(d->dmp.data, rom, p->romSize));
+		cache_write_wait();
+		chdir(workDir);
+	}
+
+out:
+	RS232_CloseComport(cport_nr);
+	kill(emu, SIGTERM);
+	waitpid(emu, NULL, 0);
+	free(rom);
+	return 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [options]\n\n"
+		"    --emu=<path>          gbxemu to run (default ./gbxemu)\n"
+		"    --profile=<name>      Only run profiles containing this name\n"
+		"    --baud=<n>            Emulated baud rate, 0 for no limit (default 0)\n"
+		"    --latency=<us>        Emulated time per command\n"
+		"    --drop=<n>            Cut every n-th block short\n"
+		"    --corrupt=<n>         Flip a bit in every n-th block\n"
+		"    --fast                Read the ROM with fast reads, where a stalled block is requested again\n"
+		"    -v   --verbose        Show the output of the dumping code and the emulator\n\n"
+		"profiles:", name);
+	for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) fprintf(stderr, " %s", profiles[i].name);
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+	static const struct option longOptions[] = {
+		{"emu", required_argument, NULL, 'e'},
+		{"profile", required_argument, NULL, 'p'},
+		{"baud", required_argument, NULL, 'b'},
+		{"latency", required_argument, NULL, 'L'},
+		{"drop", required_argument, NULL, 'd'},
+		{"corrupt", required_argument, NULL, 'c'},
+		{"fast", no_argument, NULL, 'f'},
+		{"verbose", no_argument, NULL, 'v'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	char emuPath[4096];
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "vh", longOptions, NULL)) != -1) {
+		switch (opt) {
+			case 'e': bench.emu = optarg; break;
+			case 'p': bench.profile = optarg; break;
+			case 'b': bench.baud = optarg; break;
+			case 'L': bench.latency = optarg; break;
+			case 'd': bench.drop = optarg; break;
+			case 'c': bench.corrupt = optarg; break;
+			case 'f': bench.fast = 1; break;
+			case 'v': bench.verbose = 1; break;
+			default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	// The work directory becomes the current directory, so the emulator needs an absolute path
+	if (realpath(bench.emu, emuPath) == NULL) {
+		fprintf(stderr, "%s not found, build it with make gbxemu\n", bench.emu);
+		return 1;
+	}
+	bench.emu = emuPath;
+
+	strcpy(workDir, "/tmp/gbxbench.XXXXXX");
+	if (mkdtemp(workDir) == NULL || chdir(workDir)) {
+		perror("Can't create a work directory");
+		return 1;
+	}
+
+	// Results go to the real stdout, the chatter of the dumping code doesn't
+	out = fdopen(dup(1), "w");
+	int quiet = bench.verbose ? dup(2) : open("/dev/null", O_WRONLY);
+	dup2(quiet, 1);
+	close(quiet);
+
+	int failed = 0;
+	for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+		if (bench.profile && !strstr(profiles[i].name, bench.profile)) continue;
+		failed |= run_profile(&profiles[i]);
+	}
+
+	char command[128];
+	snprintf(command, sizeof(command), "rm -rf %s", workDir);
+	system(command);
+	return failed;
+}
@@ -8,13 +8,53 @@
  */
 
 #include "gbxcart.h"
-
-unsigned int save_reserved_mem = 0;
-unsigned int game_reserved_mem = 0;
-char dumped_name[20];
-
-pthread_mutex_t mutex;
-pthread_cond_t cond;
+#include "cache.h"
+#include "dat.h"
+#include "trace.h"
+#include "stats.h"
+#include "probes.h"
+#include "jobs.h"
+#include "journal.h"
+#include "history.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+
+// What a device serves without a game, the name says why
+static const struct FileInfo noGame = {
+	.size = 17,
+	.name = "no game",
+	.data = "Filled with data"
+};
+
+struct FileInfo nosave = {
+	.size = 18,
+	.name = "no save function",
+	.data = "save data"
+};
+
+struct FileInfo ramOnlyFile = {0, "only reading ram"};
+
+#define DEVICES_MAX 32
+
+static pthread_mutex_t devicesMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct device *devices[DEVICES_MAX];
+static int deviceCount = 0;
+static struct fuse_session *session;		// set by startDevices(), a device added after that starts right away
+
+// The device of the calling thread, see useDevice(). Its cartridge thread is the only one that sets it
+static __thread struct device *dev;
+
+static __thread struct hash_stream romHash;
+static __thread int romNeedsHash = 0;
+static __thread char romCacheName[24];
+
+// ROM banks (16KB on GB, 64KB windows on GBA) that needed a retry while dumping, re-read when the DAT disagrees
+#define GB_BANK_SIZE 0x4000
+#define GBA_BANK_SIZE 0x10000
+static __thread uint8_t suspectBanks[512];
 
 static void allocate(char **ptr, unsigned int *prevSize, unsigned int size){
 	if (*prevSize < size) {
@@ -24,14 +64,205 @@ static void allocate(char **ptr, unsigned int *prevSize, unsigned int size){
 	}
 }
 
-int gba(){
+// Stop serving dmp and wait for the reads still using it, after that its data can go
+static void retireGame(){
+	pthread_mutex_lock(&dev->readMutex);
+	if (dev->game == &dev->dmp) dev->game = &dev->nogame;
+	while (dev->gameReads) pthread_cond_wait(&dev->readCond, &dev->readMutex);
+	pthread_mutex_unlock(&dev->readMutex);
+}
+
+struct FileInfo *gameRead(struct device *d) {
+	struct FileInfo *file;
+	pthread_mutex_lock(&d->readMutex);
+	d->gameReads++;
+	file = d->game;
+	pthread_mutex_unlock(&d->readMutex);
+	return file;
+}
+
+void gameReadDone(struct device *d) {
+	pthread_mutex_lock(&d->readMutex);
+	if (--d->gameReads == 0) pthread_cond_broadcast(&d->readCond);
+	pthread_mutex_unlock(&d->readMutex);
+}
+
+// Drop the mapping of a cached ROM, dmp.data has to be allocated again before it is written to
+static void unmapROM(){
+	if (dev->game_mapped_mem) {
+		retireGame();
+		munmap(dev->dmp.data, dev->game_mapped_mem);
+		dev->dmp.data = NULL;
+		dev->game_mapped_mem = 0;
+	}
+}
+
+// Map a cached ROM read-only instead of reading it into memory,
+// pages are loaded when fun_read touches them and are shared with the page cache
+static int mapROM(const char *filename){
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) return 1;
+	if (fstat(fd, &st) || st.st_size == 0) {
+		close(fd);
+		return 1;
+	}
+	char *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return 1;
+
+	cache_write_wait();
+	retireGame();
+	unmapROM();
+	if (dev->game_reserved_mem) {
+		free(dev->dmp.data);
+		dev->game_reserved_mem = 0;
+	}
+	dev->dmp.data = data;
+	dev->dmp.size = st.st_size;
+	dev->game_mapped_mem = st.st_size;
+	return 0;
+}
+
+static __thread int deviceOpen = 0;		// the GBxCart answered and the port is open
+
+int setupDevice(){
 	read_config();
-	
-	// Open COM port
-	if (com_test_port() == 0) {
-		read_one_letter();
+	if (options.sysfs_path) sysfs_root = options.sysfs_path;
+	if (options.trace_path && trace_open(options.trace_path)) return 1;
+	ledsEnabled = !options.noLeds;
+	return 0;
+}
+
+struct device *addDevice(const char *port) {
+	struct fuse_session *se;
+	struct device *d;
+	const char *base = port && strrchr(port, '/') ? strrchr(port, '/') + 1 : port;
+
+	pthread_mutex_lock(&devicesMutex);
+	if (deviceCount == DEVICES_MAX || (d = calloc(1, sizeof(*d))) == NULL) {
+		pthread_mutex_unlock(&devicesMutex);
+		fprintf(stderr, "Can't add a device for %s\n", port ? port : "the GBxCart");
+		return NULL;
+	}
+	d->index = deviceCount;
+	d->ino = options.multi ? (fuse_ino_t) (d->index + 1) << DEVICE_INO_SHIFT : 0;
+	d->slot = port || options.multi ? d->index : cport_nr;		// without a port the one from config.ini
+	if (port) snprintf(d->port, sizeof(d->port), "%s", port);
+	snprintf(d->name, sizeof(d->name), "%s", base ? base : "gbxcart");
+	for (int i = 0; i < deviceCount; i++) {
+		if (!strcmp(devices[i]->name, d->name)) snprintf(d->name, sizeof(d->name), "%.20s-%d", base ? base : "gbxcart", d->index);
+	}
+
+	d->nogame = noGame;
+	d->game = &d->nogame;
+	d->save = &nosave;
+	pthread_mutex_init(&d->eventMutex, NULL);
+	pthread_cond_init(&d->eventCond, NULL);
+	d->cartState = PROBE_CART_NONE;
+	pthread_mutex_init(&d->commitMutex, NULL);
+	pthread_cond_init(&d->commitCond, NULL);
+	pthread_mutex_init(&d->writeMutex, NULL);
+	pthread_mutex_init(&d->readMutex, NULL);
+	pthread_cond_init(&d->readCond, NULL);
+	d->jobs = jobs_new();
+	d->journal = journal_new();
+	d->history = history_new();
+	if (d->jobs == NULL || d->journal == NULL || d->history == NULL) {
+		pthread_mutex_unlock(&devicesMutex);
+		free(d->jobs);
+		free(d->journal);
+		free(d->history);
+		free(d);
+		fprintf(stderr, "Can't add a device for %s\n", port ? port : "the GBxCart");
+		return NULL;
+	}
+	stats_progress_init(&d->progress);
+
+	devices[d->index] = d;
+	__atomic_store_n(&deviceCount, d->index + 1, __ATOMIC_RELEASE);
+	se = session;
+	pthread_mutex_unlock(&devicesMutex);
+
+	if (se) {
+		startDevice(d);
+		fuse_lowlevel_notify_inval_inode(se, 1, 0, 0);		// a new folder in the root, if the kernel has it
+	}
+	return d;
+}
+
+struct device *getDevice(int index) {
+	if (index < 0 || index >= __atomic_load_n(&deviceCount, __ATOMIC_ACQUIRE)) return NULL;
+	return devices[index];
+}
+
+struct device *findDevice(const char *name) {
+	struct device *d;
+	for (int i = 0; (d = getDevice(i)) != NULL; i++) {
+		if (!strcmp(d->name, name) || !strcmp(d->port, name)) return d;
+	}
+	return NULL;
+}
+
+int scanDevices(void) {
+	struct RS232_usb ports[16];
+	int count = com_list_gbxcarts(ports, 16), added = 0;
+
+	for (int i = 0; i < count; i++) {
+		if (findDevice(ports[i].devname) == NULL && addDevice(ports[i].devname)) added++;
+	}
+	return count < 0 ? -1 : added;
+}
+
+void useDevice(struct device *d) {
+	dev = d;
+	cport_nr = d->slot;
+	port_fixed = d->port[0] != 0;
+	if (port_fixed) RS232_SetPortName(cport_nr, d->port);
+}
+
+int startDevice(struct device *d) {
+	int rc = pthread_create(&d->thread, NULL, options.image ? Timage : Thandler, d);
+	if (rc) {
+		fprintf(stderr, "pthread_create failed with %s\n", strerror(rc));
 		return 1;
 	}
+	pthread_detach(d->thread);
+	return 0;
+}
+
+int startDevices(struct fuse_session *se) {
+	struct device *d;
+	int failed = 0;
+
+	// The cache folder is the working directory of every cartridge thread
+	if (options.cache_path) {
+		if( access( options.cache_path, F_OK ) == 0 ) {
+			printf("%s exists.\n", options.cache_path);
+			chdir(options.cache_path);
+		} else {
+			options.cache_path = NULL;
+		}
+	}
+	pthread_mutex_lock(&devicesMutex);
+	session = se;
+	pthread_mutex_unlock(&devicesMutex);
+	for (int i = 0; (d = getDevice(i)) != NULL; i++) failed |= startDevice(d);
+	return failed;
+}
+
+void devicesChanged(int settle_ms) {
+	struct device *d;
+	if (options.multi && !options.port) scanDevices();
+	for (int i = 0; (d = getDevice(i)) != NULL; i++) jobs_push_later(d->jobs, JOB_DETECT, settle_ms);
+}
+
+// Find the GBxCart and get it going, returns 0 when it answered
+static int openDevice(){
+	static __thread int wrongFirmware = 0;
+
+	// Open COM port
+	if (com_test_port() == 0) return 1;
 
 	// Break out of any existing functions on ATmega
 	set_mode('0');
@@ -42,24 +273,51 @@ int gba(){
 	xmas_wake_up();
 	
 	if (request_value(READ_FIRMWARE_VERSION) == 0) {
-		printf("\nFirmware L1 may be installed. In order to use this applications you will need to downgrade to R30.\n");
-		read_one_letter();
+		if (!wrongFirmware) printf("\nFirmware L1 may be installed. In order to use this applications you will need to downgrade to R30.\n");
+		wrongFirmware = 1;
+		RS232_CloseComport(cport_nr);
 		return 1;
 	}
 
 	// GBx v1.4 - Power up the cart if not already powered up and flush buffer
 	gbx_cart_power_up();
 	RS232_flushRX(cport_nr);
-	
+	deviceOpen = 1;
+	return 0;
+}
+
+int gba(){
+	if (setupDevice()) return 1;
+	if (dev == NULL) {
+		struct device *d = addDevice(options.port);
+		if (d == NULL) return 1;
+		useDevice(d);
+	}
+	if (openDevice()) {
+		read_one_letter();
+		return 1;
+	}
 	return 0;
 }
 
-static int dumpRam() {
+// Bytes in the save of the inserted cartridge, every bank of it
+static uint32_t saveSize() {
+	if (cartridgeMode == GB_MODE) {
+		// ramEndAddress is the end of one bank in the 0xA000 window
+		return ramEndAddress > 0 ? ramBanks * (ramEndAddress - 0xA000 + 1) : 0;
+	}
+	return ramEndAddress > 0 ? ramBanks * ramEndAddress : eepromEndAddress;
+}
+
+// Read the save of the inserted cartridge into file, reserved is the size of its buffer
+static int readSave(struct FileInfo *file, unsigned int *reserved) {
+	uint32_t size = saveSize();
 	printf("\n--- Backup save from Cartridge to PC---\n");
+	PROBE1(save_start, cartridgeMode);
 	if (cartridgeMode == GB_MODE) {
 		// Does cartridge have RAM
 		if (ramEndAddress > 0 && headerCheckSumOk == 1) {
-			allocate(&dmp_save.data, &save_reserved_mem, ramEndAddress);
+			allocate(&file->data, reserved, size);
 			currAddr = 0x00000;
 
 			mbc2_fix();
@@ -85,7 +343,7 @@ static int dumpRam() {
 					while (ramAddress < ramEndAddress) {
 						for (uint8_t x = 0; x < 64; x++) {
 
-							char hexNum[7];
+							char hexNum[15];
 							sprintf(hexNum, "HA0x%x", ((ramAddress+x) >> 8));
 							RS232_cputs(cport_nr, hexNum);
 							RS232_SendByte(cport_nr, 0);
@@ -117,7 +375,8 @@ static int dumpRam() {
 						}
 
 						com_read_bytes(NULL, 64);
-						memcpy(dmp_save.data+currAddr, readBuffer, 64);
+						if (currAddr + 64 > size) break;
+						memcpy(file->data+currAddr, readBuffer, 64);
 						currAddr += 64;
 						ramAddress += 64;
 
@@ -127,6 +386,7 @@ static int dumpRam() {
 						}
 					}
 					com_read_stop(); // Stop reading RAM (as we will bank switch)
+					led_update(0);
 				}
 
 				RS232_cputs(cport_nr, "M1");
@@ -146,30 +406,23 @@ static int dumpRam() {
 					set_mode(READ_ROM_RAM); // Set rom/ram reading mode
 
 					while (ramAddress < ramEndAddress) {
-						uint8_t comReadBytes = com_read_bytes(NULL, 64);
-						if (comReadBytes == 64) {
-							memcpy(dmp_save.data+currAddr, readBuffer, comReadBytes);
-							currAddr += 64;
-							ramAddress += 64;
-
-							// Request 64 bytes more
-							if (ramAddress < ramEndAddress) {
-								com_read_cont();
+						if (com_read_bytes(NULL, 64) != 64) { // Didn't receive 64 bytes, usually this only happens for Apple MACs
+							if (com_read_block_again(ramAddress, READ_ROM_RAM, 64)) {
+								printf("RAM bank %u at 0x%x reads back inconsistently\n", bank, ramAddress);
 							}
 						}
-						else { // Didn't receive 64 bytes, usually this only happens for Apple MACs
-							com_read_stop();
-							delay_ms(500);
-
-							// Flush buffer
-							RS232_PollComport(cport_nr, readBuffer, 64);											
+						if (currAddr + 64 > size) break;
+						memcpy(file->data+currAddr, readBuffer, 64);
+						currAddr += 64;
+						ramAddress += 64;
 
-							// Start off where we left off
-							set_number(ramAddress, SET_START_ADDRESS);
-							set_mode(READ_ROM_RAM);				
+						// Request 64 bytes more
+						if (ramAddress < ramEndAddress) {
+							com_read_cont();
 						}
 					}
 					com_read_stop(); // Stop reading RAM (as we will bank switch)
+					led_update(0);
 				}
 			}
 
@@ -188,8 +441,9 @@ static int dumpRam() {
 		if (ramEndAddress > 0 || eepromEndAddress > 0) {
 			// SRAM/Flash
 			if (ramEndAddress > 0) {
-				allocate(&dmp_save.data, &save_reserved_mem, ramEndAddress);
+				allocate(&file->data, reserved, size);
 				xmas_setup((ramBanks * ramEndAddress) / 28);
+				uint32_t bankOffset = 0;
 
 				// Read RAM
 				for (uint8_t bank = 0; bank < ramBanks; bank++) {
@@ -208,31 +462,25 @@ static int dumpRam() {
 					set_mode(GBA_READ_SRAM);
 
 					while (currAddr < endAddr) {
-						uint8_t comReadBytes = com_read_bytes(NULL, 64);
-						if (comReadBytes == 64) {
-							memcpy(dmp_save.data+currAddr, readBuffer, comReadBytes);
-							currAddr += 64;
-
-							// Request 64 bytes more
-							if (currAddr < endAddr) {
-								com_read_cont();
+						if (com_read_bytes(NULL, 64) != 64) { // Didn't receive 64 bytes, usually this only happens for Apple MACs
+							if (com_read_block_again(currAddr, GBA_READ_SRAM, 64)) {
+								printf("Save bank %u at 0x%x reads back inconsistently\n", bank, currAddr);
 							}
 						}
-						else { // Didn't receive 64 bytes, usually this only happens for Apple MACs
-							com_read_stop();
-							delay_ms(500);
-
-							// Flush buffer
-							RS232_PollComport(cport_nr, readBuffer, 64);											
+						if (bankOffset + currAddr + 64 > size) break;
+						memcpy(file->data+bankOffset+currAddr, readBuffer, 64);
+						currAddr += 64;
 
-							// Start off where we left off
-							set_number(currAddr, SET_START_ADDRESS);
-							set_mode(GBA_READ_SRAM);				
+						// Request 64 bytes more
+						if (currAddr < endAddr) {
+							com_read_cont();
 						}
-						led_progress_percent(currAddr, (ramBanks * ramEndAddress) / 28);
+						led_progress_percent(bankOffset+currAddr, (ramBanks * ramEndAddress) / 28);
 					}
 
 					com_read_stop(); // End read (for bank if flash)
+					led_update(0);
+					bankOffset += ramEndAddress;
 
 					// Flash, switch back to bank 0
 					if (hasFlashSave >= FLASH_FOUND && bank == 1) {
@@ -243,11 +491,12 @@ static int dumpRam() {
 						gba_flash_write_address_byte(0x1000000, 0x0);
 					}
 				}
+				currAddr = bankOffset;
 			}
 
 			// EEPROM
 			else {
-				allocate(&dmp_save.data, &save_reserved_mem, eepromEndAddress);
+				allocate(&file->data, reserved, size);
 				xmas_setup(eepromEndAddress / 28);
 				set_number(eepromSize, GBA_SET_EEPROM_SIZE);
 
@@ -260,7 +509,8 @@ static int dumpRam() {
 				// Read EEPROM
 				while (currAddr < endAddr) {
 					com_read_bytes(NULL, 8);
-					memcpy(dmp_save.data+currAddr, readBuffer, 8);
+					if (currAddr + 8 > size) break;
+					memcpy(file->data+currAddr, readBuffer, 8);
 					currAddr += 8;
 
 					// Request 8 bytes more
@@ -276,14 +526,24 @@ static int dumpRam() {
 			return 1;
 		}
 	}
-	if (options.filename) strcpy(dmp_save.name, options.filename);
-	else strcpy(dmp_save.name, gameTitle);
-	strcat(dmp_save.name, ".sav");
-	dmp_save.size = currAddr;
+	if (options.filename) strcpy(file->name, options.filename);
+	else strcpy(file->name, gameTitle);
+	strcat(file->name, ".sav");
+	if (transferAborted) return 1;
+	file->size = currAddr;
+	stats_add(STAT_SAVE_DUMPS, 1);
+	hash_buffer(file->data, file->size, &file->hash);
+	PROBE1(save_done, file->size);
+	return 0;
+}
+
+int dumpRam() {
+	if (readSave(&dev->dmp_save, &dev->save_reserved_mem)) return 1;
+	memcpy(dev->cartSave, dev->dmp_save.hash.sha1, sizeof(dev->cartSave));
 	return 0;
 }
 
-static int writeRam() {
+int writeRam() {
 	printf("\n--- Restore save from PC to Cartridge ---\n");
 	if (cartridgeMode == GB_MODE) {
 		// Does cartridge have RAM
@@ -307,7 +567,7 @@ static int writeRam() {
 				set_number(0xA000, SET_START_ADDRESS); // Set start address again
 				
 				while (ramAddress < ramEndAddress) {
-					memcpy(&writeBuffer, dmp_save.data+readBytes, 64);
+					memcpy(&writeBuffer, dev->dmp_save.data+readBytes, 64);
 					com_write_bytes_from_file(WRITE_RAM, NULL, 64);
 					ramAddress += 64;
 					readBytes += 64;
@@ -318,11 +578,19 @@ static int writeRam() {
 					else if (ramEndAddress == 0xA7FF) led_progress_percent(readBytes / 4, 28);
 					else led_progress_percent(readBytes, (ramBanks * (ramEndAddress - 0xA000 + 1)) / 28);
 				}
+				led_update(0);
 			}
 			set_bank(0x4000, 0x00); // Stop rumble if it's present
 			set_bank(0x0000, 0x00); // Disable RAM
 			
+			if (transferAborted) {
+				printf("\nCartridge stopped answering, the save was not written completely\n");
+				return 1;
+			}
 			gbx_set_done_led();
+			hash_buffer(dev->dmp_save.data, dev->dmp_save.size, &dev->dmp_save.hash);	// the cart holds this data now
+			memcpy(dev->cartSave, dev->dmp_save.hash.sha1, sizeof(dev->cartSave));
+			stats_add(STAT_SAVE_WRITES, 1);
 			printf("\nFinished\n");
 			return 0;
 		}
@@ -364,7 +632,7 @@ static int writeRam() {
 					
 					// Write
 					while (currAddr < endAddr) {
-						memcpy(&writeBuffer, dmp_save.data+readBytes, 64);
+						memcpy(&writeBuffer, dev->dmp_save.data+readBytes, 64);
 						com_write_bytes_from_file(GBA_WRITE_SRAM, NULL, 64);
 						currAddr += 64;
 						readBytes += 64;
@@ -377,6 +645,7 @@ static int writeRam() {
 					if (bank == 1) {
 						gba_flash_write_address_byte(0x1000000, 0x0);
 					}
+					led_update(0);
 				}
 			}
 			
@@ -393,7 +662,7 @@ static int writeRam() {
 				// Write
 				uint32_t readBytes = 0;
 				while (currAddr < endAddr) {
-					memcpy(&writeBuffer, dmp_save.data+readBytes, 8);
+					memcpy(&writeBuffer, dev->dmp_save.data+readBytes, 8);
 					com_write_bytes_from_file(GBA_WRITE_EEPROM, NULL, 8);
 					currAddr += 8;
 					readBytes += 8;
@@ -418,7 +687,7 @@ static int writeRam() {
 					// Program flash in 128 bytes at a time
 					if (hasFlashSave == FLASH_FOUND_ATMEL) {
 						while (currAddr < endAddr) {
-							memcpy(&writeBuffer, dmp_save.data+readBytes, 128);
+							memcpy(&writeBuffer, dev->dmp_save.data+readBytes, 128);
 							com_write_bytes_from_file(GBA_FLASH_WRITE_ATMEL, NULL, 128);
 							currAddr += 128;
 							readBytes += 128;
@@ -455,7 +724,7 @@ static int writeRam() {
 								set_number(currAddr, SET_START_ADDRESS);
 								delay_ms(5); // Wait a little bit as hardware might not be ready
 							}
-							memcpy(&writeBuffer, dmp_save.data+readBytes, 64);
+							memcpy(&writeBuffer, dev->dmp_save.data+readBytes, 64);
 							com_write_bytes_from_file(GBA_FLASH_WRITE_BYTE, NULL, 64);
 							currAddr += 64;
 							readBytes += 64;
@@ -467,9 +736,17 @@ static int writeRam() {
 					if (bank == 1) {
 						set_number(0, GBA_FLASH_SET_BANK); // Set bank 0 again
 					}
+					led_update(0);
 				}
 			}
+			if (transferAborted) {
+				printf("\nCartridge stopped answering, the save was not written completely\n");
+				return 1;
+			}
 			gbx_set_done_led();
+			hash_buffer(dev->dmp_save.data, dev->dmp_save.size, &dev->dmp_save.hash);	// the cart holds this data now
+			memcpy(dev->cartSave, dev->dmp_save.hash.sha1, sizeof(dev->cartSave));
+			stats_add(STAT_SAVE_WRITES, 1);
 			printf("\nFinished\n");
 			return 0;
 		}
@@ -481,320 +758,1239 @@ static int writeRam() {
 	return 1;
 }
 
-static void dumpRom() {
-	printf("Reading ROM: %s\n", gameTitle);
-	if (cartridgeMode == GB_MODE) {
-		// Set start and end address
-		uint32_t ramAddr = 0x0000;
-		currAddr = 0x0000;
-		endAddr = 0x7FFF;
-		xmas_setup((romBanks * 16384) / 28);
-		romSize < 8 ? 
-		allocate(&dmp.data, &game_reserved_mem, 0x8000<<romSize): 
-		allocate(&dmp.data, &game_reserved_mem, 0x8000<<8);
-					
-		// Read ROM
-		uint16_t timedoutCounter = 0;
-		for (uint16_t bank = 1; bank < romBanks; bank++) {				
-			if (cartridgeType >= 5) { // MBC2 and above
-				if (bank >= 256) {
-					set_bank(0x3000, 1); // High bit
-				}
-				else {
-					set_bank(0x3000, 0); // High bit
-				}
-				set_bank(0x2100, bank & 0xFF);
+// Switch the ROM bank mapped at 0x4000-0x7FFF
+static void selectRomBank(uint16_t bank) {
+	if (cartridgeType >= 5) { // MBC2 and above
+		if (bank >= 256) {
+			set_bank(0x3000, 1); // High bit
+		}
+		else {
+			set_bank(0x3000, 0); // High bit
+		}
+		set_bank(0x2100, bank & 0xFF);
+	}
+	else if (cartridgeType >= 1) { // MBC1
+		if ((strncmp(gameTitle, "MOMOCOL", 7) == 0) || (strncmp(gameTitle, "BOMCOL", 6) == 0)) { // MBC1 Hudson
+			set_bank(0x4000, bank >> 4);
+			if (bank < 10) {
+				set_bank(0x2000, bank & 0x1F);
 			}
-			else if (cartridgeType >= 1) { // MBC1
-				if ((strncmp(gameTitle, "MOMOCOL", 7) == 0) || (strncmp(gameTitle, "BOMCOL", 6) == 0)) { // MBC1 Hudson
-					set_bank(0x4000, bank >> 4);
-					if (bank < 10) {
-						set_bank(0x2000, bank & 0x1F);
-					}
-					else {
-						set_bank(0x2000, 0x10 | (bank & 0x1F));
-					}
-				}
-				else { // Regular MBC1
-					set_bank(0x6000, 0); // Set ROM Mode 
-					set_bank(0x4000, bank >> 5); // Set bits 5 & 6 (01100000) of ROM bank
-					set_bank(0x2000, bank & 0x1F); // Set bits 0 & 4 (00011111) of ROM bank
-				}
+			else {
+				set_bank(0x2000, 0x10 | (bank & 0x1F));
 			}
+		}
+		else { // Regular MBC1
+			set_bank(0x6000, 0); // Set ROM Mode 
+			set_bank(0x4000, bank >> 5); // Set bits 5 & 6 (01100000) of ROM bank
+			set_bank(0x2000, bank & 0x1F); // Set bits 0 & 4 (00011111) of ROM bank
+		}
+	}
+}
 
-			if (bank > 1) { currAddr = 0x4000; }
+// Read len bytes of ROM 64 bytes at a time into dmp.data, starting at cartAddr in the cart's address space
+static void readRomBlocks(uint32_t cartAddr, uint32_t offset, uint32_t len) {
+	uint8_t mode = cartridgeMode == GB_MODE ? READ_ROM_RAM : GBA_READ_ROM;
+	uint8_t shift = cartridgeMode == GB_MODE ? 0 : 1; // GBA addresses 16 bit words
+	uint32_t done = 0;
+
+	set_number(cartAddr >> shift, SET_START_ADDRESS);
+	set_mode(mode);
+	while (done < len) {
+		if (com_read_bytes(NULL, 64) != 64) com_read_block_again((cartAddr + done) >> shift, mode, 64);
+		memcpy(dev->dmp.data+offset+done, readBuffer, 64);
+		done += 64;
+		if (done < len) com_read_cont();
+	}
+	com_read_stop();
+}
 
-			// Set start address and rom reading mode
-			set_number(currAddr, SET_START_ADDRESS);
-			if (fastReadEnabled == 1) {
-				set_mode(READ_ROM_4000H);
-			}
+// Read the banks that had trouble during the dump again, returns the number of banks read
+static int rereadSuspectBanks() {
+	int count = 0;
+	uint32_t bankSize = cartridgeMode == GB_MODE ? GB_BANK_SIZE : GBA_BANK_SIZE;
+	for (uint32_t bank = 0; bank < sizeof(suspectBanks) && bank * bankSize < dev->dmp.size; bank++) {
+		if (!suspectBanks[bank]) continue;
+		printf("Re-reading ROM bank %u\n", bank);
+		if (cartridgeMode == GB_MODE) {
+			if (bank == 0) readRomBlocks(0x0000, 0, GB_BANK_SIZE);
 			else {
-				set_mode(READ_ROM_RAM);
+				selectRomBank(bank);
+				readRomBlocks(0x4000, bank * GB_BANK_SIZE, GB_BANK_SIZE);
 			}
-			// Read data
-			uint8_t localbuffer[257];
-			while (currAddr < endAddr) {
-				if (fastReadEnabled == 1) {
-					uint8_t rxBytes = RS232_PollComport(cport_nr, localbuffer, 64);
-					if (rxBytes > 0) {
-						localbuffer[rxBytes] = 0;
-						memcpy(dmp.data+ramAddr, localbuffer, rxBytes);
-						ramAddr += rxBytes;
-						currAddr += rxBytes;
-						timedoutCounter = 0;
-					}
-					else {
-						timedoutCounter++;
-						if (timedoutCounter >= 10000) { // Timed out, restart transfer 1 bank before
-							timedoutCounter = 0;
-							bank--;
-							ramAddr -= (currAddr - 0x4000);
-							break;			
-						}
-					}
-					if (bank == 1 && fastReadEnabled == 1 && currAddr == 0x4000) { // Ask for another 32KB (only happens once)
-						set_mode(READ_ROM_4000H);
-					}
-				}
-				else {
-					uint8_t comReadBytes = com_read_bytes(NULL, 64);
-					if (comReadBytes == 64) {
-						memcpy(dmp.data+ramAddr, readBuffer, comReadBytes);
-						ramAddr += 64;
-						currAddr += 64;
+		}
+		else readRomBlocks(bank * GBA_BANK_SIZE, bank * GBA_BANK_SIZE, GBA_BANK_SIZE);
+		suspectBanks[bank] = 0;
+		count++;
+	}
+	return count;
+}
 
-						// Request 64 bytes more
-						if (currAddr < endAddr) {
-							com_read_cont();
-						}
-					}
-					else { // Didn't receive 64 bytes, usually this only happens for Apple MACs
-						com_read_stop();
-						delay_ms(500);
-						printf("Retrying\n");
+// The GB header holds a checksum over the whole ROM, a mismatch means the dump is bad
+static int gbGlobalChecksumOk() {
+	uint16_t sum = 0;
+	if (dev->dmp.size < 0x150) return 0;
+	for (uint32_t x = 0; x < dev->dmp.size; x++) {
+		if (x != 0x14E && x != 0x14F) sum += (uint8_t) dev->dmp.data[x];
+	}
+	return sum == (((uint8_t) dev->dmp.data[0x14E] << 8) | (uint8_t) dev->dmp.data[0x14F]);
+}
+
+// Look the ROM up in the DAT by its hashes
+static int lookupROM(const struct hashes *hash) {
+	const struct dat_entry *match;
+	const char *serial = cartridgeMode == GBA_MODE && dev->dmp.size > 0xB0 ? dev->dmp.data + 0xAC : NULL;
+	int status = dat_verify(hash, dev->dmp.size, serial, &match);
+	if (status == DAT_UNKNOWN && cartridgeMode == GB_MODE && !gbGlobalChecksumOk()) status = DAT_BAD;
+	if (match) printf("DAT match: %s\n", dat_name(match));
+	return status;
+}
+
+// Check a fresh dump against the DAT, re-read the banks that needed retries once if it looks bad.
+// Without a DAT the GB global checksum is all there is to go on.
+static void verifyROM() {
+	if (dat_loaded()) dev->dmp.hash.verify = lookupROM(&dev->dmp.hash);
+	else if (cartridgeMode == GB_MODE && !gbGlobalChecksumOk()) dev->dmp.hash.verify = DAT_BAD;
+	if (dev->dmp.hash.verify == DAT_BAD && rereadSuspectBanks()) {
+		hash_buffer(dev->dmp.data, dev->dmp.size, &dev->dmp.hash);
+		if (dat_loaded()) dev->dmp.hash.verify = lookupROM(&dev->dmp.hash);
+		else if (gbGlobalChecksumOk()) dev->dmp.hash.verify = DAT_UNKNOWN;
+	}
+	printf("ROM %s\n", dat_status_name(dev->dmp.hash.verify));
+}
+
+// The ROM dump in progress. It is read one bank (GB) or 64KB window (GBA) at a time so the cartridge thread
+// can do more urgent work in between, see Thandler()
+static __thread struct {
+	int active;
+	uint32_t size;		// of the whole ROM
+	uint32_t done;		// banks are read in order, everything below this is in dmp.data
+	int resume;			// the cart was used for something else since the last bank, set the address again
+	int retries;		// of the current bank after the link gave up on it
+	uint8_t header[64];	// start of the header when the dump started, to tell a pulled cart from padding
+	uint64_t lastProbe;	// us
+} romDump;
+
+// Read the 64 bytes that hold the start of the header (the GB logo or the GBA entry point and logo), returns the bytes read
+static uint16_t readHeaderStart(uint8_t *buffer) {
+	uint8_t mode = cartridgeMode == GB_MODE ? READ_ROM_RAM : GBA_READ_ROM;
+	uint16_t len;
+
+	com_read_stop();
+	com_flush_rx();
+	set_number(cartridgeMode == GB_MODE ? 0x0100 : 0x0000, SET_START_ADDRESS);
+	set_mode(mode);
+	len = com_read_bytes(NULL, 64);
+	com_read_stop();
+	memcpy(buffer, readBuffer, 64);
+	romDump.resume = 1;
+	return len;
+}
+
+// A pulled cartridge reads as open bus, 0xFF on GB and the low bits of the address on GBA
+static int looksLikeOpenBus(uint32_t offset, uint32_t len) {
+	for (uint32_t x = offset; x < offset + len; x++) {
+		uint8_t open = cartridgeMode == GB_MODE ? 0xFF : (x & 1 ? x >> 9 : x >> 1);
+		if ((uint8_t) dev->dmp.data[x] != open) return 0;
+	}
+	return len > 0;
+}
 
-						// Flush buffer
-						RS232_PollComport(cport_nr, readBuffer, 64);											
+// Is the cartridge the dump started with still there? Asked when the link gave up or a bank came back as open bus,
+// which ROM padding does too, so for those the header is read at most once a second
+static int cartStillThere(uint32_t offset, uint32_t len) {
+	uint8_t header[64];
+	uint64_t now = stats_time();
+	if (!transferAborted && (!looksLikeOpenBus(offset, len) || now - romDump.lastProbe < 1000000)) return 1;
+
+	romDump.lastProbe = now;
+	transferAborted = 0;
+	if (readHeaderStart(header) == 64 && memcmp(header, romDump.header, 64) == 0) return 1;
+	printf("\nCartridge removed while reading ROM\n");
+	transferAborted = 1;
+	return 0;
+}
 
-						// Start off where we left off
+// Stop a dump that won't be finished, nothing of it is published
+static void abandonDump() {
+	if (!romDump.active) return;
+	hash_stream_cancel(&romHash);
+	stats_progress(&dev->progress, 0, 0);
+	romDump.active = 0;
+}
+
+static void dumpRomStart() {
+	printf("Reading ROM: %s\n", gameTitle);
+	PROBE1(dump_start, cartridgeMode);
+	if (dev->dmp.data) cache_write_wait();		// the previous image may still be on its way to the cache
+	unmapROM();
+	memset(suspectBanks, 0, sizeof(suspectBanks));
+	if (cartridgeMode == GB_MODE) {
+		romDump.size = romBanks * 16384;
+		xmas_setup(romDump.size / 28);
+		romSize < 8 ? 
+		allocate(&dev->dmp.data, &dev->game_reserved_mem, 0x8000<<romSize): 
+		allocate(&dev->dmp.data, &dev->game_reserved_mem, 0x8000<<8);
+	}
+	else {
+		romDump.size = romEndAddr;
+		xmas_setup(romDump.size / 28);
+		allocate(&dev->dmp.data, &dev->game_reserved_mem, romEndAddr);
+	}
+	hash_stream_start(&romHash, dev->dmp.data);
+	stats_progress(&dev->progress, 0, romDump.size);
+	romDump.done = 0;
+	romDump.retries = 0;
+	romDump.lastProbe = 0;
+	readHeaderStart(romDump.header);
+	romDump.active = 1;
+}
+
+// Read one GB ROM bank, the first time banks 0 and 1 together
+static void dumpRomBankGB() {
+	uint16_t bank = romDump.done == 0 ? 1 : romDump.done / GB_BANK_SIZE;
+	uint32_t ramAddr = romDump.done;
+	uint16_t timedoutCounter = 0;
+
+	selectRomBank(bank);
+	currAddr = bank > 1 ? 0x4000 : 0x0000;
+	endAddr = 0x7FFF;
+	uint32_t streamEnd = currAddr + 0x4000; // Where the cart stops sending, a fast read is 16KB
+
+	// Set start address and rom reading mode
+	set_number(currAddr, SET_START_ADDRESS);
+	if (fastReadEnabled == 1) {
+		set_mode(READ_ROM_4000H);
+	}
+	else {
+		set_mode(READ_ROM_RAM);
+	}
+	// Read data
+	uint8_t localbuffer[257];
+	while (currAddr <= endAddr) {
+		if (fastReadEnabled == 1) {
+			uint8_t rxBytes = RS232_PollComport(cport_nr, localbuffer, endAddr + 1 - currAddr < 64 ? endAddr + 1 - currAddr : 64);
+			if (rxBytes > 0) {
+				localbuffer[rxBytes] = 0;
+				memcpy(dev->dmp.data+ramAddr, localbuffer, rxBytes);
+				ramAddr += rxBytes;
+				currAddr += rxBytes;
+				timedoutCounter = 0;
+			}
+			else {
+				timedoutCounter++;
+				if (timedoutCounter >= 10000) { // Timed out, read the block it stalled in again and go on from the next
+					timedoutCounter = 0;
+					suspectBanks[ramAddr / GB_BANK_SIZE] = 1;
+					ramAddr -= currAddr % 64;
+					currAddr -= currAddr % 64;
+					if (com_read_block_again(currAddr, READ_ROM_RAM, 64)) { // Reads back differently every time, dumpRomRange() starts the bank over
+						transferAborted = 1;
+						break;
+					}
+					memcpy(dev->dmp.data+ramAddr, readBuffer, 64);
+					ramAddr += 64;
+					currAddr += 64;
+					com_read_stop();
+					if (currAddr <= endAddr) {
 						set_number(currAddr, SET_START_ADDRESS);
-						set_mode(READ_ROM_RAM);				
+						set_mode(READ_ROM_4000H);
+						streamEnd = currAddr + 0x4000;
 					}
 				}
-				led_progress_percent(ramAddr, (romBanks * 16384) / 28);
 			}
-			com_read_stop(); // Stop reading ROM (as we will bank switch)
+			if (currAddr == streamEnd && currAddr <= endAddr) { // Ask for another 16KB, the cart carries on from here
+				set_mode(READ_ROM_4000H);
+				streamEnd += 0x4000;
+			}
+		}
+		else {
+			if (com_read_bytes(NULL, 64) != 64) { // Didn't receive 64 bytes, usually this only happens for Apple MACs
+				printf("Retrying 0x%x\n", currAddr);
+				suspectBanks[ramAddr / GB_BANK_SIZE] = 1;
+				com_read_block_again(currAddr, READ_ROM_RAM, 64);
+			}
+			memcpy(dev->dmp.data+ramAddr, readBuffer, 64);
+			ramAddr += 64;
+			currAddr += 64;
+
+			// Request 64 bytes more
+			if (currAddr < endAddr) {
+				com_read_cont();
+			}
 		}
-		currAddr = ramAddr;
+		led_progress_percent(ramAddr, romDump.size / 28);
 	}
-	else { // GBA mode
-		// Set start and end address
-		
-		currAddr = 0x00000;
-		endAddr = romEndAddr;
-		set_number(currAddr, SET_START_ADDRESS);
-		xmas_setup(endAddr / 28);
-		allocate(&dmp.data, &game_reserved_mem, romEndAddr);
-
-		// Fast reading
-		if (fastReadEnabled == 1) {
-			uint16_t timedoutCounter = 0;
-			set_mode(GBA_READ_ROM_8000H);
-
-			uint8_t buffer[65];
-			while (currAddr < endAddr) {
-				uint8_t rxBytes = RS232_PollComport(cport_nr, buffer, 64);
-				if (rxBytes > 0) {
-					buffer[rxBytes] = 0;
-					memcpy(dmp.data+currAddr, buffer, rxBytes);
-					currAddr += rxBytes;
+	com_read_stop(); // Stop reading ROM (as we will bank switch)
+	if (streamEnd > endAddr + 1) com_flush_rx(); // A restarted fast read runs past the end of the bank
+	romDump.done = ramAddr;
+}
+
+// Read one 64KB window of a GBA ROM. The cart carries on from where the last window ended unless something else
+// was done in between
+static void dumpRomWindowGBA() {
+	uint32_t windowEnd = romDump.done + GBA_BANK_SIZE < romDump.size ? romDump.done + GBA_BANK_SIZE : romDump.size;
+	currAddr = romDump.done;
+	endAddr = romDump.size;
+	if (romDump.resume) set_number(currAddr / 2, SET_START_ADDRESS);
+	romDump.resume = 0;
+
+	// Fast reading
+	if (fastReadEnabled == 1) {
+		uint16_t timedoutCounter = 0;
+		uint32_t streamEnd = currAddr + 0x10000; // Where the cart stops sending, a fast read is 64KB
+		set_mode(GBA_READ_ROM_8000H);
+
+		uint8_t buffer[65];
+		while (currAddr < windowEnd) {
+			uint8_t rxBytes = RS232_PollComport(cport_nr, buffer, windowEnd - currAddr < 64 ? windowEnd - currAddr : 64);
+			if (rxBytes > 0) {
+				buffer[rxBytes] = 0;
+				memcpy(dev->dmp.data+currAddr, buffer, rxBytes);
+				currAddr += rxBytes;
+				timedoutCounter = 0;
+			}
+			else {
+				timedoutCounter++;
+				if (timedoutCounter >= 10000) { // Timed out, read the block it stalled in again and go on from the next
 					timedoutCounter = 0;
-				}
-				else {
-					timedoutCounter++;
-					if (timedoutCounter >= 10000) {
-						timedoutCounter = 0;
-						RS232_PollComport(cport_nr, readBuffer, 256); // Flush
-
-						if (currAddr >= 0x20000) {
-							uint32_t hexCalc = ((currAddr / 0x10000) - 1);
-							uint32_t calculateRewind = 0x10000 * hexCalc;
-							currAddr = calculateRewind;
-							set_number(currAddr / 2, SET_START_ADDRESS);
-						}
-						else {
-							currAddr = 0;
-							set_mode('0');
-							delay_ms(5);
-							set_number(currAddr, SET_START_ADDRESS);
-							delay_ms(5);
-						}
+					suspectBanks[currAddr / GBA_BANK_SIZE] = 1;
+					currAddr -= currAddr % 64;
+					if (com_read_block_again(currAddr / 2, GBA_READ_ROM, 64)) { // Reads back differently every time, dumpRomRange() starts the bank over
+						transferAborted = 1;
+						break;
 					}
+					memcpy(dev->dmp.data+currAddr, readBuffer, 64);
+					currAddr += 64;
+					com_read_stop();
+					if (currAddr < windowEnd) {
+						set_number(currAddr / 2, SET_START_ADDRESS);
+						set_mode(GBA_READ_ROM_8000H);
+					}
+					streamEnd = currAddr + 0x10000;
 				}
-
-				if (currAddr % 0x10000 == 0 && currAddr != endAddr) {
-					set_mode(GBA_READ_ROM_8000H);
-				}
-				led_progress_percent(currAddr, endAddr / 28);
 			}
-			com_read_stop();
+			led_progress_percent(currAddr, endAddr / 28);
 		}
-		else {
-			uint16_t readLength = 64;
-			set_mode(GBA_READ_ROM);
-			// Read data
-			while (currAddr < endAddr) {
-				uint8_t comReadBytes = com_read_bytes(NULL, readLength);
-				
-				if (comReadBytes == readLength) {
-					memcpy(dmp.data+currAddr, readBuffer, readLength);
-					currAddr += readLength;
-					// Request 64 bytes more
-					if (currAddr < endAddr) {
-						com_read_cont();
-					}
-				}
-				else { // Didn't receive 64 bytes
-					com_read_stop();
-					delay_ms(500);
+		com_read_stop();
+		if (streamEnd != windowEnd) { // A restarted fast read runs past the window, the next one starts over
+			com_flush_rx();
+			romDump.resume = 1;
+		}
+		romDump.done = currAddr;
+		return;
+	}
+	else {
+		uint16_t readLength = 64;
+		set_mode(GBA_READ_ROM);
+		// Read data
+		while (currAddr < windowEnd) {
+			if (com_read_bytes(NULL, readLength) != readLength) { // Didn't receive 64 bytes
+				suspectBanks[currAddr / GBA_BANK_SIZE] = 1;
+				com_read_block_again(currAddr / 2, GBA_READ_ROM, readLength);
+			}
+			memcpy(dev->dmp.data+currAddr, readBuffer, readLength);
+			currAddr += readLength;
+			// Request 64 bytes more
+			if (currAddr < windowEnd) {
+				com_read_cont();
+			}
+			led_progress_percent(currAddr, endAddr / 28);
+		}
+	}
+	com_read_stop();
+	romDump.done = currAddr;
+}
 
-					// Flush buffer
-					RS232_PollComport(cport_nr, readBuffer, readLength);											
+// Read the next bank of the ROM dump started by dumpRomStart(), returns 1 when the cartridge is gone
+static int dumpRomRange() {
+	uint32_t start = romDump.done;
+	int aborted;
+
+	if (cartridgeMode == GB_MODE) dumpRomBankGB();
+	else dumpRomWindowGBA();
+
+	aborted = transferAborted;
+	if (!cartStillThere(start, romDump.done - start)) return 1;
+	if (aborted) { // Still the same cart, the link just gave up on this bank. Read it again
+		romDump.done = start;
+		romDump.resume = 1;
+		if (++romDump.retries > 2) {
+			printf("\nROM bank at 0x%x can't be read, giving up\n", start);
+			transferAborted = 1;
+			return 1;
+		}
+		return 0;
+	}
+	romDump.retries = 0;
+	hash_stream_feed(&romHash, romDump.done); // Everything before this bank is final
+	stats_progress(&dev->progress, romDump.done, romDump.size);
+	led_update(0);
+	return 0;
+}
 
-					set_number(currAddr / 2, SET_START_ADDRESS);
-					set_mode(GBA_READ_ROM);				
-				}
-				led_progress_percent(currAddr, endAddr / 28);
-			}
-			com_read_stop();
+static void dumpRomFinish() {
+	hash_stream_finish(&romHash, romDump.done, &dev->dmp.hash);
+	dev->dmp.size = romDump.done;
+	currAddr = romDump.done;
+	stats_progress(&dev->progress, dev->dmp.size, dev->dmp.size);
+	stats_add(STAT_ROM_DUMPS, 1);
+	PROBE2(dump_done, dev->dmp.size, dev->dmp.hash.crc32);
+	romDump.active = 0;
+}
+
+void dumpRom() {
+	dumpRomStart();
+	while (romDump.done < romDump.size) {
+		if (dumpRomRange()) {
+			abandonDump();
+			transferAborted = 0;
+			gbx_set_error_led();
+			return;
 		}
 	}
-	
-	dmp.size = currAddr;
+	dumpRomFinish();
+	verifyROM();
 	gbx_set_done_led();
-	strcpy(dumped_name, gameTitle);
+	strcpy(dev->dumped_name, gameTitle);
 }
 
-static void CacheROM(){
+// Map the ROM from the cache folder, returns 1 when it isn't there and has to be dumped into romCacheName
+static int mapCachedROM(){
 	char cwd[200];
    	if (getcwd(cwd, sizeof(cwd)) != NULL) {
     	printf("Current working dir: %s\n", cwd);
 	}
 	char filename[20];
-	strcpy(filename, nogame.name);
+	strcpy(filename, dev->nogame.name);
 	cartridgeMode == GB_MODE? strcat(filename, ".gb") : strcat(filename, ".gba");
-	if( access( filename, R_OK ) == 0 ) {
-		printf("%s exists, reading it.\n", filename);
-		FILE *fp = fopen(filename, "r");
-		fseek(fp, 0, SEEK_END);
-		unsigned int size = ftell(fp);
-		fseek(fp, 0, SEEK_SET);
-
-		allocate(&dmp.data, &game_reserved_mem, size);
-		fread(dmp.data, 1, size, fp);
-		dmp.size = size;
-		strcpy(dumped_name, nogame.name);
-		fclose(fp);
-	} else {
-		printf("%s does not exist, ceating it.\n", filename);
-		strcpy(nogame.name, "reading...");
-		game = &nogame;
+	strcpy(romCacheName, filename);
+	dev->game = &dev->nogame;		// dmp.data is about to be replaced
+	if( access( filename, R_OK ) == 0 && !mapROM(filename) ) {
+		printf("%s exists, mapping it.\n", filename);
+		stats_add(STAT_CACHE_HITS, 1);
+		strcpy(dev->dumped_name, dev->nogame.name);
+		dev->dmp.hash.valid = 0;
+		romNeedsHash = cache_index_lookup(filename, dev->dmp.size, &dev->dmp.hash);
+		if (!romNeedsHash && dat_loaded()) dev->dmp.hash.verify = lookupROM(&dev->dmp.hash);
+		return 0;
+	}
+	printf("%s does not exist, ceating it.\n", filename);
+	stats_add(STAT_CACHE_MISSES, 1);
+	return 1;
+}
+
+void CacheROM(){
+	if (mapCachedROM()) {
+		strcpy(dev->nogame.name, "reading...");
+		dev->game = &dev->nogame;
 		dumpRom();
-		FILE *fp = fopen(filename, "w+");
-		fwrite(dmp.data, 1, dmp.size, fp);
-		fclose(fp);
+		cache_write_async(romCacheName, dev->dmp.data, dev->dmp.size);
+		cache_index_store(romCacheName, dev->dmp.size, &dev->dmp.hash);
 	}
 }
 
-static void updateTitle(){
+// Cached ROM without an index entry, hash it once it is published and remember the result
+static void hashCachedROM(){
+	struct hashes hash;
+	hash_buffer(dev->dmp.data, dev->dmp.size, &hash);
+	if (dat_loaded()) hash.verify = lookupROM(&hash);
+	cache_index_store(romCacheName, dev->dmp.size, &hash);
+	dev->dmp.hash = hash;
+	romNeedsHash = 0;
+}
+
+static __thread int forcedMode = 0;				// set with JOB_MODE, 0 looks for both kinds of cartridges
+
+void updateTitle(){
 
 	set_mode(VOLTAGE_3_3V);
 	
-	if (read_gba_header()) {
-		strcpy(nogame.name, gameTitle);
+	if (forcedMode != GB_MODE && read_gba_header()) {
+		strcpy(dev->nogame.name, gameTitle);
 		if (gbxcartPcbVersion == GBXMAS) xmas_set_leds(0x9AAA6AA);
 		return;
 	}
-	if (read_gb_header()) {
-		strcpy(nogame.name, gameTitle);
+	if (forcedMode != GBA_MODE && read_gb_header()) {
+		strcpy(dev->nogame.name, gameTitle);
 		if (gbxcartPcbVersion == GBXMAS) xmas_set_leds(0x6555955);	
 		set_mode(VOLTAGE_5V);
 		return;
 	}
-	strcpy(nogame.name, "no game");
+	strcpy(dev->nogame.name, "no game");
 }
 
-void *Thandler(void *ptr) {
-	struct fuse_session *se = (struct fuse_session*) ptr;
+static void (*eventListener)(struct device *d, unsigned int event);
+
+// Count a change of the cartridge state as an event and tell the listener, an idle cart is detected again
+// every 5s so most calls don't change anything
+static void cart_state(int state) {
+	unsigned int event;
+	if (state == dev->cartState) return;
+	PROBE2(cart_state, state, dev->nogame.name);
+
+	pthread_mutex_lock(&dev->eventMutex);
+	dev->cartState = state;
+	event = ++dev->cartEvent;
+	pthread_cond_broadcast(&dev->eventCond);
+	pthread_mutex_unlock(&dev->eventMutex);
+	if (eventListener) eventListener(dev, event);
+}
+
+void setCartEventListener(void (*listener)(struct device *d, unsigned int event)) {
+	eventListener = listener;
+}
+
+unsigned int cartWaitEvent(struct device *d, unsigned int seen, int timeout_ms) {
 	struct timespec t;
-	
-    if (options.ramOnly) game = &ramOnlyFile;
-	if (options.cache_path) {
-		if( access( options.cache_path, F_OK ) == 0 ) {
-			printf("%s exists.\n", options.cache_path);
-			chdir(options.cache_path);
+	unsigned int event;
+
+	clock_gettime(CLOCK_REALTIME, &t);
+	t.tv_sec += timeout_ms / 1000;
+	t.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (t.tv_nsec >= 1000000000) {
+		t.tv_nsec -= 1000000000;
+		t.tv_sec++;
+	}
+	pthread_mutex_lock(&d->eventMutex);
+	while (d->cartEvent == seen && !pthread_cond_timedwait(&d->eventCond, &d->eventMutex, &t));
+	event = d->cartEvent;
+	pthread_mutex_unlock(&d->eventMutex);
+	return event;
+}
+
+unsigned int cartStatus(struct device *d, char *buf, size_t size) {
+	static const char *states[] = {"none", "reading", "ready", "writing"};
+	unsigned int event;
+	int state;
+
+	pthread_mutex_lock(&d->eventMutex);
+	event = d->cartEvent;
+	state = d->cartState;
+	pthread_mutex_unlock(&d->eventMutex);
+	snprintf(buf, size, "event %u\nstate %s\nrom %s\nsave %s\n", event, states[state], d->game->name, d->save->name);
+	return event;
+}
+
+// Serve the dumped or mapped ROM under its name
+static void publishROM(struct fuse_session *se) {
+	if (options.filename) strcpy(dev->dmp.name, options.filename);
+	else strcpy(dev->dmp.name, dev->dumped_name);
+	cartridgeMode == GB_MODE? strcat(dev->dmp.name, ".gb") : strcat(dev->dmp.name, ".gba");
+	dev->game = &dev->dmp;
+	notify_inode(GAME_INO);
+	if (romNeedsHash) hashCachedROM();
+	cart_state(PROBE_CART_READY);
+}
+
+// Every write to the save counts up writeSeq. A commit writes everything up to the count it saw when it
+// started, writes that land while it runs are left for the next one. writeMutex is held while a write goes
+// into the journal and the save, so both see the writes in the same order
+
+static int committing(void) {
+	return !options.readonly && !options.image;		// without a cart thread writes just stay in memory
+}
+
+static void saveWritten(struct device *d) {
+	struct timespec now;
+	int late;
+	if (!committing()) return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&d->commitMutex);
+	if (d->writeSeq == d->attemptedSeq) d->burstStart = now;
+	d->writeSeq++;
+	late = (now.tv_sec - d->burstStart.tv_sec) * 1000 + (now.tv_nsec - d->burstStart.tv_nsec) / 1000000 >= SAVE_MAX_DELAY_MS;
+	pthread_mutex_unlock(&d->commitMutex);
+
+	if (late) jobs_push(d->jobs, JOB_COMMIT_SAVE, 0);
+	else jobs_push_later(d->jobs, JOB_COMMIT_SAVE, SAVE_QUIET_MS);
+}
+
+int saveWrite(struct device *d, const char *buf, uint32_t size, uint32_t off) {
+	pthread_mutex_lock(&d->writeMutex);
+	if (d->journaling && journal_append(d->journal, off, buf, size)) {
+		pthread_mutex_unlock(&d->writeMutex);
+		return EIO;
+	}
+	memcpy(d->dmp_save.data + off, buf, size);
+	d->dmp_save.hash.valid = 0;		// hashed again once it is written to the cart
+	saveWritten(d);
+	pthread_mutex_unlock(&d->writeMutex);
+	return 0;
+}
+
+void saveCommit(struct device *d) {
+	int dirty;
+	pthread_mutex_lock(&d->commitMutex);
+	dirty = d->writeSeq != d->attemptedSeq;
+	pthread_mutex_unlock(&d->commitMutex);
+	if (dirty && committing()) jobs_push(d->jobs, JOB_COMMIT_SAVE, 0);
+}
+
+int saveSync(struct device *d) {
+	unsigned int target;
+	int err;
+
+	pthread_mutex_lock(&d->commitMutex);
+	target = d->writeSeq;
+	if (committing() && (int) (target - d->attemptedSeq) > 0) {
+		jobs_push(d->jobs, JOB_COMMIT_SAVE, 0);
+		while ((int) (target - d->attemptedSeq) > 0)
+			pthread_cond_wait(&d->commitCond, &d->commitMutex);
+	}
+	err = committing() && (int) (target - d->committedSeq) > 0 ? EIO : 0;
+	pthread_mutex_unlock(&d->commitMutex);
+	return err;
+}
+
+// A saveSyncAsync() that waits for the commit of everything up to target
+struct save_sync {
+	unsigned int target;
+	int err;
+	void (*done)(void *arg, int err);
+	void *arg;
+	struct save_sync *next;
+};
+
+void saveSyncAsync(struct device *d, void (*done)(void *arg, int err), void *arg) {
+	struct save_sync *sync;
+
+	pthread_mutex_lock(&d->commitMutex);
+	if (committing() && (int) (d->writeSeq - d->attemptedSeq) > 0 && (sync = malloc(sizeof(*sync))) != NULL) {
+		sync->target = d->writeSeq;
+		sync->done = done;
+		sync->arg = arg;
+		sync->next = d->syncs;
+		d->syncs = sync;
+		pthread_mutex_unlock(&d->commitMutex);
+		jobs_push(d->jobs, JOB_COMMIT_SAVE, 0);
+		return;
+	}
+	pthread_mutex_unlock(&d->commitMutex);
+	done(arg, saveSync(d));		// nothing to wait for, or no memory to wait without blocking
+}
+
+// Answer the saveSyncAsync() calls the last commit got far enough for, with commitMutex held. They are
+// moved to ready and called once it is unlocked
+static void syncsDone(struct save_sync **ready) {
+	struct save_sync **p = &dev->syncs;
+	while (*p) {
+		struct save_sync *sync = *p;
+		if ((int) (sync->target - dev->attemptedSeq) > 0) {
+			p = &sync->next;
+			continue;
+		}
+		*p = sync->next;
+		sync->err = (int) (sync->target - dev->committedSeq) > 0 ? EIO : 0;
+		sync->next = *ready;
+		*ready = sync;
+	}
+}
+
+static void callSyncs(struct save_sync *ready) {
+	while (ready) {
+		struct save_sync *next = ready->next;
+		ready->done(ready->arg, ready->err);
+		free(ready);
+		ready = next;
+	}
+}
+
+// A commit up to seq is over, ok says whether it reached the cart. Wakes saveSync() and saveSyncAsync()
+static void commitDone(unsigned int seq, int ok) {
+	struct save_sync *ready = NULL;
+	pthread_mutex_lock(&dev->commitMutex);
+	dev->attemptedSeq = seq;
+	if (ok) dev->committedSeq = seq;
+	pthread_cond_broadcast(&dev->commitCond);
+	syncsDone(&ready);
+	pthread_mutex_unlock(&dev->commitMutex);
+	callSyncs(ready);
+
+	pthread_mutex_lock(&dev->writeMutex);
+	if (ok && seq == dev->writeSeq) {		// newer writes still need their records
+		if (dev->journaling) journal_clear(dev->journal, dev->dmp_save.data);
+		history_store(dev->history, dev->dmp_save.data, dev->dmp_save.size);
+	}
+	pthread_mutex_unlock(&dev->writeMutex);
+}
+
+// The writes so far won't reach the cart, it was pulled or swapped. fresh means a new save was just read and
+// there is nothing to report to saveSync() or saveSyncAsync() anymore
+static void dropWrites(int fresh) {
+	struct save_sync *ready = NULL;
+	pthread_mutex_lock(&dev->commitMutex);
+	dev->attemptedSeq = dev->writeSeq;
+	if (fresh) dev->committedSeq = dev->writeSeq;
+	pthread_cond_broadcast(&dev->commitCond);
+	syncsDone(&ready);
+	pthread_mutex_unlock(&dev->commitMutex);
+	callSyncs(ready);
+}
+
+// Journal the writes to a newly read save in the cache folder. What an earlier run acknowledged but never got
+// onto this cartridge is applied to the save and committed
+static void openJournal(uint32_t fingerprint) {
+	int replayed;
+	if (!committing()) return;
+
+	pthread_mutex_lock(&dev->writeMutex);
+	replayed = journal_open(dev->journal, dev->nogame.name, fingerprint, dev->dmp_save.data, dev->dmp_save.size);
+	dev->journaling = replayed >= 0;
+	if (replayed > 0) {
+		printf("Replaying %d save writes from the journal\n", replayed);
+		dev->dmp_save.hash.valid = 0;
+		saveWritten(dev);
+	}
+	pthread_mutex_unlock(&dev->writeMutex);
+	if (replayed > 0) saveCommit(dev);
+}
+
+// With a cache folder a newly read save goes into the history of its cartridge and its writes are journaled
+static void keepSave(void) {
+	uint8_t header[64];
+	uint32_t fingerprint;
+
+	if (!options.cache_path || readHeaderStart(header) != 64) return;
+	fingerprint = hash_crc32(hash_crc32(0, header, 64), &cartridgeMode, sizeof(cartridgeMode));
+	history_select(dev->history, dev->nogame.name, fingerprint);
+	history_store(dev->history, dev->dmp_save.data, dev->dmp_save.size);
+	openJournal(fingerprint);
+}
+
+// The save is going away. Its journal is kept for the next time the cartridge shows up
+static void dropSave(void) {
+	pthread_mutex_lock(&dev->writeMutex);
+	dev->journaling = 0;
+	journal_close(dev->journal);
+	history_select(dev->history, NULL, 0);
+	pthread_mutex_unlock(&dev->writeMutex);
+}
+
+static __thread char cancelledTitle[20];			// its ROM dump was cancelled, leave it alone until it is swapped or asked for
+
+// Writes that failed while the GBxCart was away are tried again now that it is back
+static void retryWrites(void) {
+	int dirty;
+	pthread_mutex_lock(&dev->commitMutex);
+	dev->attemptedSeq = dev->committedSeq;
+	dirty = dev->writeSeq != dev->committedSeq;
+	pthread_mutex_unlock(&dev->commitMutex);
+	if (dirty) jobs_push(dev->jobs, JOB_COMMIT_SAVE, 0);
+}
+
+// No GBxCart. Unless lostDevice() kept a cartridge serve an empty tree until one answers. Jobs that come in
+// meanwhile have nothing to work on, a commit fails so fsync() returns EIO
+static void waitForDevice(struct fuse_session *se) {
+	struct job job;
+	if (deviceOpen) return;
+
+	if (dev->game != &dev->dmp && dev->save != &dev->dmp_save) {
+		strcpy(dev->nogame.name, "no device");
+		if (!options.ramOnly) dev->game = &dev->nogame;
+		dev->save = &nosave;
+		cart_state(PROBE_CART_NONE);
+		// Not notify_inode(), before the first lookup the kernel doesn't know the inodes
+		fuse_lowlevel_notify_inval_inode(se, dev->ino + GAME_INO, 0, 0);
+		fuse_lowlevel_notify_inval_inode(se, dev->ino + SAVE_INO, 0, 0);
+	}
+
+	printf("Waiting for a GBxCart\n");
+	while (!fuse_session_exited(se) && openDevice()) {
+		if (jobs_take(dev->jobs, &job, 2000)) continue;
+		if (job.type == JOB_COMMIT_SAVE) dropWrites(0);
+		jobs_done(dev->jobs, &job, 1);
+	}
+	if (deviceOpen) printf("GBxCart found\n");
+	transferAborted = 0;					// set by the timeouts that noticed the old one was gone
+	if (dev->save == &dev->dmp_save && committing()) retryWrites();
+	jobs_push(dev->jobs, JOB_DETECT, 0);				// the same cartridge carries on, another one is read as usual
+}
+
+// The GBxCart stopped answering, close the port. Thandler waits for it to come back. A cartridge that was
+// read completely stays served, a USB reset usually brings the same one back. Anything else is forgotten
+static void lostDevice() {
+	int keep = !romDump.active && strcmp(dev->dumped_name, "--invalid--") &&
+		(dev->game == &dev->dmp || (options.ramOnly && dev->save == &dev->dmp_save));
+
+	if (!deviceOpen) return;		// detectCart() got here first
+	printf("GBxCart lost\n");
+	jobs_cancel(dev->jobs);
+	cancelledTitle[0] = 0;
+	dropWrites(0);		// a queued commit is gone, fsync() gets EIO. A kept save has them retried on reconnect
+	dev->saveUnverified = keep && dev->save == &dev->dmp_save;
+	if (!keep) {
+		abandonDump();
+		dropSave();
+		dev->save = &nosave;
+		if (!options.ramOnly) dev->game = &dev->nogame;
+		strcpy(dev->dumped_name, "--invalid--");
+	}
+	RS232_CloseComport(cport_nr);
+	deviceOpen = 0;
+}
+
+
+// Whether the cartridge in the slot holds the save that was last read from or written to the one kept through
+// a lost GBxCart. Another copy of the game has the same title, its save is read into a buffer of its own
+static int keptSaveMatches(void) {
+	struct FileInfo check;
+	unsigned int reserved = 0;
+	int same;
+
+	memset(&check, 0, sizeof(check));
+	same = !readSave(&check, &reserved) && check.size == dev->dmp_save.size &&
+		!memcmp(check.hash.sha1, dev->cartSave, sizeof(dev->cartSave));
+	if (reserved) free(check.data);
+	return same;
+}
+
+// JOB_DETECT: see what is in the slot, a new game gets its save dumped and the ROM dump queued
+static void detectCart(struct fuse_session *se) {
+	updateTitle();
+	cartridgeMode = request_value(CART_MODE);
+	if (cartridgeMode != GB_MODE && cartridgeMode != GBA_MODE) {		// no answer, the GBxCart itself is gone
+		lostDevice();
+		return;
+	}
+	if (cancelledTitle[0]) {
+		if (!strcmp(cancelledTitle, dev->nogame.name)) {
+			strcpy(dev->nogame.name, "cancelled");
+			return;
+		}
+		cancelledTitle[0] = 0;
+	}
+	if (dev->saveUnverified && !strcmp(dev->dumped_name, dev->nogame.name)) {
+		int same = keptSaveMatches();
+		if (transferAborted) return;		// gone again, checked once it is back
+		dev->saveUnverified = 0;
+		if (!same) {	// the writes were for the other copy, read this one like any new cartridge
+			printf("The save of this %s isn't the one that was kept, its writes are dropped\n", dev->nogame.name);
+			strcpy(dev->dumped_name, "--invalid--");
+		}
+	}
+
+	if (strcmp(dev->dumped_name, dev->nogame.name)) {		// difference between dumped_name and nogame.name?
+		jobs_cancel(dev->jobs);		// whatever is still queued was meant for the cartridge that was there before
+		abandonDump();
+		dropWrites(0);
+		dropSave();
+		dev->save = &nosave;
+		if (strcmp(dev->nogame.name, "no game")) {	// did it read a game game?					
+			cart_state(PROBE_CART_READING);
+			if (!dumpRam()){
+				dev->save = &dev->dmp_save;
+				dropWrites(1);
+				keepSave();
+                notify_inode(SAVE_INO);
+			}
+			if (transferAborted) return;
+
+            if (!options.ramOnly){
+				if (!options.cache_path || mapCachedROM()) {
+					strcpy(dev->nogame.name, "reading...");	
+					dev->game = &dev->nogame;						
+					notify_inode(GAME_INO);
+					dumpRomStart();
+					jobs_push(dev->jobs, JOB_DUMP_RANGE, 0);
+					return;
+				}
+				publishROM(se);
+            }
+            else {
+                strcpy(dev->dumped_name, gameTitle);
+                cart_state(PROBE_CART_READY);
+            }
+            
 		} else {
-			options.cache_path = NULL;
+            cart_state(PROBE_CART_NONE);
+            if(!options.ramOnly) dev->game = &dev->nogame;	//it didnt read a game, set it to no game.
+            if(options.reread) strcpy(dev->dumped_name, "--invalid--");
 		}
+	} else if (dev->game == &dev->nogame) {
+		dev->save = &dev->dmp_save;
+        notify_inode(SAVE_INO);
+        if(!options.ramOnly) publishROM(se);
+        else cart_state(PROBE_CART_READY);
+	}
+}
+
+// JOB_VERIFY: the last bank is in, check the dump, hand it to the cache and serve it
+static void finishROM(struct fuse_session *se) {
+	verifyROM();
+	if (transferAborted) return;
+	gbx_set_done_led();
+	strcpy(dev->dumped_name, gameTitle);
+	if (options.cache_path) {
+		cache_write_async(romCacheName, dev->dmp.data, dev->dmp.size);
+		cache_index_store(romCacheName, dev->dmp.size, &dev->dmp.hash);
+	}
+	publishROM(se);
+}
+
+// JOB_COMMIT_SAVE: write the save back. While a dump is running the cart can't have changed, otherwise check first
+static void commitSave(struct fuse_session *se, const struct job *job) {
+	unsigned int seq;
+	int failed;
+
+	pthread_mutex_lock(&dev->commitMutex);
+	seq = dev->writeSeq;
+	pthread_mutex_unlock(&dev->commitMutex);
+	if (seq == dev->attemptedSeq) return;		// a commit before this one already took the writes with it
+
+	if (!romDump.active) {
+		detectCart(se);
+		if (job->generation != jobs_generation(dev->jobs) || dev->save != &dev->dmp_save) {
+			commitDone(seq, 0);
+			return;
+		}
+	}
+	cart_state(PROBE_CART_WRITING);
+	failed = writeRam();
+	cart_state(romDump.active ? PROBE_CART_READING : PROBE_CART_READY);
+	commitDone(seq, !failed);
+}
+
+// JOB_CANCEL: stop the ROM dump, the save stays served. Returns 1 if there was none
+static int cancelDump(struct fuse_session *se) {
+	if (!romDump.active) return 1;
+	abandonDump();
+	strcpy(cancelledTitle, gameTitle);
+	strcpy(dev->nogame.name, "cancelled");
+	notify_inode(GAME_INO);
+	cart_state(dev->save == &dev->dmp_save ? PROBE_CART_READY : PROBE_CART_NONE);
+	printf("ROM dump of %s cancelled\n", gameTitle);
+	return 0;
+}
+
+// JOB_REREAD: read everything again as if the cart was just inserted, or only the save. Returns 1 if there
+// is nothing to read and 2 while there are writes to the save that aren't on the cart yet, they would be lost
+static int rereadCart(struct fuse_session *se, uint32_t what) {
+	pthread_mutex_lock(&dev->commitMutex);
+	int dirty = dev->writeSeq != dev->attemptedSeq;
+	pthread_mutex_unlock(&dev->commitMutex);
+	if (dirty) return 2;
+
+	if (what == REREAD_SAVE) {
+		if (dev->save != &dev->dmp_save) return 1;
+		dev->save = &nosave;
+		notify_inode(SAVE_INO);
+		dropSave();
+		if (dumpRam()) return 1;
+		dev->save = &dev->dmp_save;
+		dropWrites(1);
+		keepSave();
+		notify_inode(SAVE_INO);
+		return transferAborted;
 	}
+	cancelledTitle[0] = 0;
+	strcpy(dev->dumped_name, "--invalid--");
+	detectCart(se);
+	return !strcmp(dev->nogame.name, "no game");
+}
+
+// JOB_CHECK: hash the served ROM again and look it up, returns the DAT status or -1 when no ROM is served
+static int checkROM(void) {
+	struct hashes hash;
+	if (dev->game != &dev->dmp) return -1;
+	hash_buffer(dev->dmp.data, dev->dmp.size, &hash);
+	if (dat_loaded()) hash.verify = lookupROM(&hash);
+	else hash.verify = cartridgeMode == GB_MODE && !gbGlobalChecksumOk() ? DAT_BAD : DAT_UNKNOWN;
+	dev->dmp.hash = hash;
+	printf("ROM %s\n", dat_status_name(hash.verify));
+	return hash.verify;
+}
 
+// The cartridge went away in the middle of a transfer. Drop what was queued for it, get the link quiet again
+// and let detection flip the mount back to no game
+static void lostCart(struct fuse_session *se) {
+	jobs_cancel(dev->jobs);
+	abandonDump();
+	dropWrites(0);							// the save is read again on reinsert and the journal replayed
+	dropSave();
+	transferAborted = 0;
+	com_read_stop();
+	com_flush_rx();
+	gbx_set_error_led();
+	strcpy(dev->dumped_name, "--invalid--");		// a save write may have been cut short, read it all again on reinsert
+	detectCart(se);
+	notify_inode(GAME_INO);
+	notify_inode(SAVE_INO);
+}
+
+void *Thandler(void *ptr) {
+	struct fuse_session *se = session;
+	struct job job;
+	
+	useDevice(ptr);
+    if (options.ramOnly) dev->game = &ramOnlyFile;
+
+	jobs_push(dev->jobs, JOB_DETECT, 0);
 	while(!fuse_session_exited(se)){
-		updateTitle();
-		cartridgeMode = request_value(CART_MODE);
-
-		if (strcmp(dumped_name, nogame.name)) {		// difference between dumped_name and nogame.name?
-			save = &nosave;
-			if (strcmp(nogame.name, "no game")) {	// did it read a game game?					
-				if (!dumpRam()){
-					save = &dmp_save;
-                    notify_inode(SAVE_INO);
+		int result = 0;
+		waitForDevice(se);
+		if (jobs_take(dev->jobs, &job, 5000)) {		// nothing to do for 5s, look at the slot again
+			job.type = JOB_DETECT;
+			job.generation = jobs_generation(dev->jobs);
+			job.waiter = NULL;
+		}
+		PROBE2(job_start, job.type, job.offset);
+
+		switch (job.type) {
+			case JOB_COMMIT_SAVE:
+				commitSave(se, &job);
+				break;
+			case JOB_CANCEL:
+				result = cancelDump(se);
+				break;
+			case JOB_DETECT:
+				detectCart(se);
+				break;
+			case JOB_REREAD:
+				result = rereadCart(se, job.offset);
+				break;
+			case JOB_MODE: {
+				int previous = forcedMode;
+				forcedMode = job.offset;
+				result = rereadCart(se, REREAD_ALL);
+				if (result == 2) forcedMode = previous;
+				break;
+			}
+			case JOB_CHECK:
+				result = checkROM();
+				break;
+			case JOB_DUMP_RANGE:
+				if (!romDump.active) break;		// cancelled
+				if (dumpRomRange()) break;
+				if (romDump.done < romDump.size) jobs_push(dev->jobs, JOB_DUMP_RANGE, romDump.done);
+				else {
+					dumpRomFinish();
+					jobs_push(dev->jobs, JOB_VERIFY, 0);
 				}
+				break;
+			case JOB_VERIFY:
+				finishROM(se);
+				break;
+		}
+		if (job.type != JOB_DUMP_RANGE) romDump.resume = 1;		// the next bank can't rely on where the cart left off
+		if (transferAborted) {
+			if (RS232_IsHungUp(cport_nr)) lostDevice();		// not the cartridge, the whole GBxCart went away
+			else lostCart(se);
+			result = -1;
+		}
+		jobs_done(dev->jobs, &job, result);
+	}
 
-                if (!options.ramOnly){
-					if (options.cache_path) CacheROM();
-					else {
-						strcpy(nogame.name, "reading...");	
-						game = &nogame;						
-						notify_inode(GAME_INO);
-						dumpRom();
-					}
-					if (options.filename) strcpy(dmp.name, options.filename);
-					else strcpy(dmp.name, dumped_name);
-					cartridgeMode == GB_MODE? strcat(dmp.name, ".gb") : strcat(dmp.name, ".gba");
-                    game = &dmp;
-                    notify_inode(GAME_INO);
-                }
-                else {
-                    strcpy(dumped_name, gameTitle);
-                }
-                
-			} else {
-                if(!options.ramOnly) game = &nogame;	//it didnt read a game, set it to no game.
-                if(options.reread) strcpy(dumped_name, "--invalid--");
+	jobs_cancel(dev->jobs);
+	dropSave();
+	cache_write_wait();
+	retireGame();
+	if (dev->save_reserved_mem) free(dev->dmp_save.data);
+	if (dev->game_reserved_mem) free(dev->dmp.data);
+	unmapROM();
+	pthread_exit(NULL);
+}
+
+// Read a whole file into one of the dump buffers
+static int load_file(const char *path, struct FileInfo *file, unsigned int *reserved) {
+	struct stat st;
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) return 1;
+	if (fstat(fileno(fp), &st) || st.st_size == 0) {
+		fclose(fp);
+		return 1;
+	}
+	allocate(&file->data, reserved, st.st_size);
+	file->size = fread(file->data, 1, st.st_size, fp);
+	fclose(fp);
+	if (file->size != st.st_size) return 1;
+
+	const char *base = strrchr(path, '/');
+	snprintf(file->name, sizeof(file->name), "%s", base ? base + 1 : path);
+	hash_buffer(file->data, file->size, &file->hash);
+	return 0;
+}
+
+int loadImage(const char *path) {
+	char savePath[4096];
+
+	if (load_file(path, &dev->dmp, &dev->game_reserved_mem)) {
+		fprintf(stderr, "Can't load image %s\n", path);
+		return 1;
+	}
+	dev->game = &dev->dmp;
+
+	snprintf(savePath, sizeof(savePath), "%s", path);
+	char *ext = strrchr(savePath, '.');
+	if (ext && !strchr(ext, '/')) *ext = 0;
+	strncat(savePath, ".sav", sizeof(savePath) - strlen(savePath) - 1);
+	if (!load_file(savePath, &dev->dmp_save, &dev->save_reserved_mem)) dev->save = &dev->dmp_save;
+
+	printf("Image %s, %u bytes, save %u bytes\n", dev->dmp.name, dev->dmp.size, dev->save == &dev->dmp_save ? dev->dmp_save.size : 0);
+	return 0;
+}
+
+void *Timage(void *ptr) {
+	struct fuse_session *se = session;
+	struct timespec t = {1, 0};
+	sigset_t set;
+	int inserted = 1;
+
+	useDevice(ptr);
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	cart_state(PROBE_CART_READY);
+	while(!fuse_session_exited(se)){
+		if (sigtimedwait(&set, NULL, &t) != SIGUSR1) continue;
+
+		inserted = !inserted;
+		dev->game = inserted ? &dev->dmp : &dev->nogame;
+		dev->save = inserted && dev->dmp_save.size ? &dev->dmp_save : &nosave;
+		cart_state(inserted ? PROBE_CART_READY : PROBE_CART_NONE);
+		// Not notify_inode(), the kernel doesn't know the inodes until they are looked up
+		fuse_lowlevel_notify_inval_inode(se, dev->ino + GAME_INO, 0, 0);
+		fuse_lowlevel_notify_inval_inode(se, dev->ino + SAVE_INO, 0, 0);
+	}
+
+	retireGame();
+	if (dev->save_reserved_mem) free(dev->dmp_save.data);
+	if (dev->game_reserved_mem) free(dev->dmp.data);
+	pthread_exit(NULL);
+}
+
+#define ARCHIVE_POLL_MS 1000		// how often the slot is looked at, a hotplug event wakes it earlier
+
+static volatile sig_atomic_t archiveStopped = 0;
+
+static void stopArchive(int sig) {
+	(void) sig;
+	archiveStopped = 1;
+}
+
+// Name of the dump in the archive without the extension: the DAT name when it verified, otherwise the
+// title and CRC32 so two different dumps of a title don't overwrite each other
+static void archiveName(char *name, size_t size) {
+	const struct dat_entry *match = NULL;
+	const char *serial = cartridgeMode == GBA_MODE && dev->dmp.size > 0xB0 ? dev->dmp.data + 0xAC : NULL;
+	char *ext;
+
+	if (dev->dmp.hash.verify == DAT_VERIFIED) dat_verify(&dev->dmp.hash, dev->dmp.size, serial, &match);
+	if (match) {
+		snprintf(name, size, "%s", dat_name(match));
+		if ((ext = strrchr(name, '.')) != NULL) *ext = 0;
+	}
+	else snprintf(name, size, "%s (%08x)", gameTitle, dev->dmp.hash.crc32);
+	for (char *p = name; *p; p++) {
+		if (*p == '/') *p = '_';
+	}
+}
+
+// Give a dump buffer to the cache writer, the next cartridge is read into a new one while it goes to disk.
+// An image that is already in the archive is the same dump, its name says so
+static void archiveFile(const char *filename, char **data, unsigned int *reserved, unsigned int size) {
+	if (access(filename, F_OK)) cache_write_owned(filename, *data, size);
+	else free(*data);
+	*data = NULL;
+	*reserved = 0;
+}
+
+// Dump the detected cartridge into the archive, returns 1 if it couldn't be read completely
+static int archiveCart(FILE *manifest) {
+	char base[200], romName[256], saveName[256] = "-", rom[3][41], when[32];
+	uint64_t start = stats_time();
+	time_t now = time(NULL);
+	int hasSave;
+
+	hasSave = !dumpRam();
+	if (transferAborted) return 1;
+	dumpRomStart();
+	while (romDump.done < romDump.size) {
+		if (archiveStopped || dumpRomRange()) {
+			abandonDump();
+			gbx_set_error_led();
+			return 1;
+		}
+	}
+	dumpRomFinish();
+	verifyROM();
+	if (transferAborted) return 1;
+	gbx_set_done_led();
+
+	archiveName(base, sizeof(base));
+	snprintf(romName, sizeof(romName), "%s%s", base, cartridgeMode == GB_MODE ? ".gb" : ".gba");
+	if (hasSave) snprintf(saveName, sizeof(saveName), "%s [%08x].sav", base, dev->dmp_save.hash.crc32);
+
+	// One tab separated line per cartridge: time, ROM file, size, crc32, md5, sha1, DAT status, save file,
+	// save size, save crc32 and how long it took
+	strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+	sprintf(rom[0], "%08x", dev->dmp.hash.crc32);
+	hash_to_hex(dev->dmp.hash.md5, 16, rom[1]);
+	hash_to_hex(dev->dmp.hash.sha1, 20, rom[2]);
+	fprintf(manifest, "%s\t%s\t%u\t%s\t%s\t%s\t%s\t%s\t%u\t%08x\t%.1f\n", when, romName, dev->dmp.size, rom[0], rom[1], rom[2],
+		dat_status_name(dev->dmp.hash.verify), saveName, hasSave ? dev->dmp_save.size : 0, hasSave ? dev->dmp_save.hash.crc32 : 0,
+		(stats_time() - start) / 1e6);
+	fflush(manifest);
+
+	archiveFile(romName, &dev->dmp.data, &dev->game_reserved_mem, dev->dmp.size);
+	if (hasSave) archiveFile(saveName, &dev->dmp_save.data, &dev->save_reserved_mem, dev->dmp_save.size);
+	printf("Archived %s\n", romName);
+	return 0;
+}
+
+int archiveCarts(const char *path) {
+	struct sigaction action;
+	struct device *d = addDevice(options.port);
+	struct job job;
+	FILE *manifest;
+
+	if (d == NULL) return 1;
+	if (chdir(path)) {
+		perror(path);
+		return 1;
+	}
+	manifest = fopen("manifest.tsv", "a");
+	if (manifest == NULL) {
+		perror("manifest.tsv");
+		return 1;
+	}
+	useDevice(d);
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stopArchive;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	printf("Archiving to %s\n", path);
+	while (!archiveStopped) {
+		int wait = ARCHIVE_POLL_MS;
+		if (!deviceOpen && openDevice())
+			wait = 2000;			// no GBxCart, try again like waitForDevice() does
+		else {
+			updateTitle();
+			cartridgeMode = request_value(CART_MODE);
+			if (cartridgeMode != GB_MODE && cartridgeMode != GBA_MODE) {
+				lostDevice();
+				wait = 2000;
+			}
+			else if (!strcmp(dev->nogame.name, "no game")) dev->dumped_name[0] = 0;		// the same game can come again
+			else if (strcmp(dev->dumped_name, dev->nogame.name)) {
+				strcpy(dev->dumped_name, dev->nogame.name);		// a failed one is tried again on reinsert
+				if (archiveCart(manifest)) printf("%s not archived, insert it again to retry\n", dev->nogame.name);
+			}
+			if (transferAborted) {
+				if (RS232_IsHungUp(cport_nr)) lostDevice();		// the whole GBxCart went away
+				else {
+					com_read_stop();
+					com_flush_rx();
+				}
+				transferAborted = 0;
 			}
-		} else if (game == &nogame) {
-			save = &dmp_save;
-            notify_inode(SAVE_INO);
-            if(!options.ramOnly) {
-				if (options.filename) strcpy(dmp.name, options.filename);
-				else strcpy(dmp.name, dumped_name);
-				cartridgeMode == GB_MODE? strcat(dmp.name, ".gb") : strcat(dmp.name, ".gba");
-                game = &dmp;
-                notify_inode(GAME_INO);
-            }
-		} else if (condition && !options.readonly){
-			printf("I should write now\n");
-			writeRam();
-			condition = 0;
 		}
-		time(&t.tv_sec);
-		t.tv_sec += 5;
-		if (pthread_cond_timedwait(&cond, &mutex, &t) == 0)
-		puts("Signal from fun_write()");
+		if (!jobs_take(dev->jobs, &job, wait)) jobs_done(dev->jobs, &job, 0);
 	}
 
-	if (save_reserved_mem) free(dmp_save.data);
-	if (game_reserved_mem) free(dmp.data);
-	pthread_exit(NULL);
-}
\ No newline at end of file
+	printf("Waiting for the last files to be written\n");
+	cache_write_wait();
+	fclose(manifest);
+	if (deviceOpen) RS232_CloseComport(cport_nr);
+	return 0;
+}
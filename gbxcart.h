@@ -4,14 +4,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
 #include <pthread.h>
 #include "setup.h"
+#include "hash.h"
+#include "stats.h"
 #include <dirent.h> 
 #include <time.h>
 
 #define GAME_INO 2
 #define SAVE_INO 3
-#define notify_inode(inode) assert(fuse_lowlevel_notify_inval_inode(se, inode, 0, 0) == 0)
+#define STATS_DIR_INO 4		// /.gbx
+#define STATS_INO 5			// /.gbx/stats
+#define EVENTS_INO 6		// /.gbx/events
+#define HISTORY_DIR_INO 7	// /history
+#define HISTORY_INO 0x10000	// /history/<n>-..., plus the version number
+#define DEVICE_INO_SHIFT 24		// with --multi the tree above is /<device>/..., its inodes are (index + 1) << 24 plus these
+// A folder the kernel hasn't looked up yet has nothing cached to drop, that is what ENOENT says
+#define notify_inode(inode) do { int notified = fuse_lowlevel_notify_inval_inode(se, dev->ino + (inode), 0, 0); \
+	assert(notified == 0 || notified == -ENOENT); } while (0)
 
 extern struct options {
 	int ramOnly;
@@ -19,31 +30,173 @@ extern struct options {
 	int readonly;
 	const char *filename;
 	const char *cache_path;
+	const char *dat_path;
+	const char *port;
+	const char *image;
+	const char *trace_path;
+	const char *control_path;
+	const char *sysfs_path;
+	const char *archive_path;
+	int library;
+	int multi;
+	int singlethread;
+	int noLeds;
 } options;
 
-extern unsigned int save_reserved_mem;
-extern unsigned int game_reserved_mem;
-
 struct FileInfo {
 	unsigned int size;
 	char name[20];
 	char *data;
+	struct hashes hash;
 };
 
-extern struct FileInfo dmp;
-extern struct FileInfo dmp_save;
 extern struct FileInfo ramOnlyFile;
-
-extern struct FileInfo nogame;
 extern struct FileInfo nosave;
 
-extern struct FileInfo *save;
-extern struct FileInfo *game;
+struct jobs;
+struct journal;
+struct history;
+struct save_sync;
+
+// One GBxCart and the cartridge in it. Its cartridge thread does all the work on it, the FUSE threads only
+// look at what is served and go through the functions below for the rest
+struct device {
+	int index;					// in the order the devices were added
+	fuse_ino_t ino;				// added to the inodes of its files, 0 when it is served at the root
+	char name[32];				// of its folder with --multi, the name of the port
+	char port[100];				// empty to look for the GBxCart
+	int slot;					// port number in the rs232 layer
+
+	struct FileInfo *game;		// what is served, swapped by the cartridge thread
+	struct FileInfo *save;
+	struct FileInfo dmp;
+	struct FileInfo dmp_save;
+	struct FileInfo nogame;		// served without a game, its name says why
+	pthread_mutex_t readMutex;	// reads of game in flight, see gameRead()
+	pthread_cond_t readCond;
+	int gameReads;
+	unsigned int save_reserved_mem;
+	unsigned int game_reserved_mem;
+	unsigned int game_mapped_mem;
+	char dumped_name[20];
+
+	// Events, see cartStatus()
+	pthread_mutex_t eventMutex;
+	pthread_cond_t eventCond;
+	unsigned int cartEvent;
+	int cartState;
+
+	// Writes to the save and their commits, see saveWrite()
+	pthread_mutex_t commitMutex;
+	pthread_cond_t commitCond;
+	unsigned int writeSeq;
+	unsigned int committedSeq;		// on the cartridge
+	unsigned int attemptedSeq;		// the last commit, successful or not, got this far
+	struct timespec burstStart;		// first write since the last commit
+	pthread_mutex_t writeMutex;		// held while a write goes into the journal and the save
+	int journaling;					// writes to the current save go through the journal first
+	struct save_sync *syncs;		// waiting for a commit, see saveSyncAsync()
+	uint8_t cartSave[20];			// SHA1 of the save as last read from or written to the cartridge
+	int saveUnverified;				// kept through a lost GBxCart, the cartridge may be another copy now
+
+	struct jobs *jobs;
+	struct journal *journal;
+	struct history *history;
+	struct stats_progress progress;
+	pthread_t thread;
+};
+
+// A device for the GBxCart at port, or the one that is found when port is NULL. With a session running its
+// cartridge thread starts right away. Returns NULL when there are too many
+struct device *addDevice(const char *port);
 
-extern int condition;
-extern pthread_mutex_t mutex;
-extern pthread_cond_t cond;
+// Devices are never removed, index runs from 0 until this returns NULL
+struct device *getDevice(int index);
 
+// The device with this name or port, NULL if there is none
+struct device *findDevice(const char *name);
+
+// --multi: add a device for every GBxCart in sysfs that doesn't have one yet, returns how many or -1 without sysfs
+int scanDevices(void);
+
+// Work on d from the calling thread. The cartridge functions below use the device of the thread they run on
+void useDevice(struct device *d);
+
+// Start the cartridge thread of d, Thandler() or Timage() with an image. Returns 0 on success
+int startDevice(struct device *d);
+
+// Change to the cache folder and start the cartridge thread of every device, returns 0 if all of them started
+int startDevices(struct fuse_session *se);
+
+// A serial device came or went. Look for new ones with --multi and have every device check on its own
+// GBxCart after settle_ms
+void devicesChanged(int settle_ms);
+
+// Settings for the link that don't need the GBxCart yet, returns 1 if the trace file can't be opened
+int setupDevice();
+
+// setupDevice() and find the GBxCart right away, returns 1 if there is none. Thandler() waits for it instead.
+// Without a device for the calling thread one is added for options.port
 int gba();
 
-void *Thandler(void *ptr);
\ No newline at end of file
+// Read the header of the inserted cartridge, its nogame.name is set to the title
+void updateTitle();
+
+// Dump the save into dmp_save, returns 1 if the cartridge has none
+int dumpRam();
+
+// Write dmp_save back to the cartridge, returns 0 on success
+int writeRam();
+
+// Dump the ROM into dmp
+void dumpRom();
+
+// Map the ROM from the cache in the current directory, dumping and storing it first if it isn't there
+void CacheROM();
+
+// Load a ROM file (and the .sav next to it) as if it had been dumped, returns 0 on success
+int loadImage(const char *path);
+
+// The cartridge thread of the device ptr
+void *Thandler(void *ptr);
+
+// Stand-in for Thandler with an image, every SIGUSR1 removes or reinserts the cartridge
+void *Timage(void *ptr);
+
+// --archive: no mount, dump every cartridge inserted into the folder at path and log it in its manifest.tsv.
+// Runs on the calling thread until SIGINT or SIGTERM, returns 1 if the folder can't be used
+int archiveCarts(const char *path);
+
+// The save is written back once writes to it have been quiet for SAVE_QUIET_MS, or SAVE_MAX_DELAY_MS after
+// the first one of a burst that doesn't stop
+#define SAVE_QUIET_MS 500
+#define SAVE_MAX_DELAY_MS 5000
+
+// The ROM that is served now, for a FUSE read. Its data stays mapped until gameReadDone(), even if the
+// cartridge thread swaps it meanwhile
+struct FileInfo *gameRead(struct device *d);
+void gameReadDone(struct device *d);
+
+// Change size bytes of the save at off and schedule writing it back. With a cache folder the write is
+// journaled there first. Returns 0 once it is safe, or EIO if the journal couldn't store it
+int saveWrite(struct device *d, const char *buf, uint32_t size, uint32_t off);
+
+// Write the changes back now instead of waiting for the writes to go quiet
+void saveCommit(struct device *d);
+
+// Wait until every change made so far is on the cartridge, returns 0 or EIO if the cartridge went away
+int saveSync(struct device *d);
+
+// Like saveSync() without waiting: done is called with arg and the result once the changes are on the
+// cartridge. Right away when there is nothing to wait for, otherwise on the cartridge thread
+void saveSyncAsync(struct device *d, void (*done)(void *arg, int err), void *arg);
+
+// Write the cartridge state (none, reading, ready or writing) and the file names as text, returns the number
+// of the last event (buf may be NULL with size 0). Every insert, removal, finished dump and finished save write is one event
+unsigned int cartStatus(struct device *d, char *buf, size_t size);
+
+// Wait up to timeout_ms for an event after seen, returns the number of the last one
+unsigned int cartWaitEvent(struct device *d, unsigned int seen, int timeout_ms);
+
+// Called on the cartridge thread of the device with the number of every new event
+void setCartEventListener(void (*listener)(struct device *d, unsigned int event));
\ No newline at end of file
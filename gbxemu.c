@@ -0,0 +1,672 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ GBxCart emulator. Speaks the GBxCart RW command protocol on a pseudo-terminal, backed by a ROM image and
+ optionally a save image, so gbxfuse can run without hardware: gbxfuse --port=<pty> ...
+ The save image is mapped shared, writes from the PC end up in the file.
+ With --replay it plays the GBxCart side of a trace recorded with gbxfuse --trace instead.
+ SIGUSR1 pulls the cartridge out and puts it back in, while it is out reads return open bus.
+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "setup.h"
+#include "trace.h"
+
+#define SAVE_SRAM 1
+#define SAVE_FLASH 2
+#define SAVE_EEPROM 3
+
+static struct {
+	int fd;				// pty master
+	uint8_t mode;		// GB_MODE or GBA_MODE
+	uint8_t *rom;
+	uint32_t romSize;
+	uint8_t *save;
+	uint32_t saveSize;
+	uint8_t saveType;
+
+	// Link emulation and fault injection
+	long baud;
+	long latency;		// us per command
+	long dropEvery;
+	long corruptEvery;
+	int verbose;
+
+	// Replay
+	const char *replay;
+	int replayFast;		// answer right away instead of with the recorded delays
+
+	// Cartridge state
+	uint32_t address;
+	uint16_t bankAddress;
+	int bankHalf;		// 'B' comes as an address first and then the value
+	uint8_t reg2000, reg3000, reg4000, reg6000;
+	uint8_t flashBank, sramBank;
+	uint8_t eepromSize;
+
+	// Stats
+	unsigned long commands, blocks, bytesOut, drops, corrupts;
+} emu;
+
+static uint8_t inBuffer[4096];
+static int inCount, inPos;
+static struct timespec wireFree;		// when the last byte sent has left the emulated UART
+static volatile sig_atomic_t quit;
+static volatile sig_atomic_t removed;
+
+static void on_signal(int sig) {
+	quit = 1;
+}
+
+static void on_remove(int sig) {
+	removed = !removed;
+}
+
+static void add_ns(struct timespec *t, long ns) {
+	t->tv_nsec += ns;
+	while (t->tv_nsec >= 1000000000) {
+		t->tv_nsec -= 1000000000;
+		t->tv_sec++;
+	}
+}
+
+static void sleep_us(long us) {
+	struct timespec ts = {us / 1000000, (us % 1000000) * 1000};
+	if (us > 0) nanosleep(&ts, NULL);
+}
+
+// Next byte from the PC, blocks until one arrives. Returns -1 when we should quit
+static int next_byte(void) {
+	while (inPos == inCount) {
+		if (quit) return -1;
+		int n = read(emu.fd, inBuffer, sizeof(inBuffer));
+		if (n < 0 && errno != EINTR && errno != EAGAIN) return -1;
+		if (n <= 0) continue;
+		inCount = n;
+		inPos = 0;
+	}
+	return inBuffer[inPos++];
+}
+
+// Check for a byte without waiting
+static int peek_byte(void) {
+	if (inPos < inCount) return inBuffer[inPos];
+	struct pollfd p = {emu.fd, POLLIN, 0};
+	if (poll(&p, 1, 0) <= 0) return -1;
+	int n = read(emu.fd, inBuffer, sizeof(inBuffer));
+	if (n <= 0) return -1;
+	inCount = n;
+	inPos = 0;
+	return inBuffer[0];
+}
+
+// Send bytes, paced to the emulated baud rate (10 bits per byte)
+static void send_bytes(const uint8_t *data, int len) {
+	if (emu.baud > 0) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec > wireFree.tv_sec || (now.tv_sec == wireFree.tv_sec && now.tv_nsec > wireFree.tv_nsec)) wireFree = now;
+		add_ns(&wireFree, (long) (10000000000LL * len / emu.baud));
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wireFree, NULL);
+	}
+	emu.bytesOut += len;
+	while (len > 0) {
+		int n = write(emu.fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				sleep_us(100);
+				continue;
+			}
+			return;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+static void send_byte(uint8_t byte) {
+	send_bytes(&byte, 1);
+}
+
+// Read a number terminated by a null byte, hex unless told otherwise
+static uint32_t read_number(int base) {
+	char text[20];
+	int n = 0, c;
+	while ((c = next_byte()) > 0) {
+		if (n < (int) sizeof(text) - 1) text[n++] = c;
+	}
+	text[n] = 0;
+	return strtoul(text, NULL, base);
+}
+
+static void read_payload(uint8_t *buffer, int len) {
+	for (int i = 0; i < len; i++) {
+		int c = next_byte();
+		buffer[i] = c < 0 ? 0 : c;
+	}
+}
+
+
+// ****** Gameboy ******
+
+static uint32_t gb_rom_bank(void) {
+	uint8_t type = emu.rom[0x147];
+	uint32_t bank;
+
+	if (type == 0) return 1;
+	else if (type <= 3) { // MBC1
+		bank = emu.reg2000 & 0x1F;
+		if (bank == 0) bank = 1;
+		if (!(emu.reg6000 & 1)) bank |= (emu.reg4000 & 3) << 5;
+	}
+	else if (type == 5 || type == 6) { // MBC2
+		bank = emu.reg2000 & 0x0F;
+		if (bank == 0) bank = 1;
+	}
+	else if (type >= 0x0F && type <= 0x13) { // MBC3
+		bank = emu.reg2000 & 0x7F;
+		if (bank == 0) bank = 1;
+	}
+	else if (type >= 0x19 && type <= 0x1E) { // MBC5
+		bank = emu.reg2000 | ((emu.reg3000 & 1) << 8);
+	}
+	else { // Camera and the rest
+		bank = emu.reg2000;
+	}
+	return bank % (emu.romSize / 0x4000 ? emu.romSize / 0x4000 : 1);
+}
+
+static uint8_t *gb_ram(uint16_t address) {
+	if (emu.saveSize == 0) return NULL;
+	uint32_t offset = (emu.reg4000 & 0x0F) * 0x2000 + (address - 0xA000);
+	return &emu.save[offset % emu.saveSize];
+}
+
+static uint8_t gb_read(uint16_t address) {
+	if (emu.mode != GB_MODE || removed) return 0xFF;
+	if (address < 0x4000) return emu.rom[address % emu.romSize];
+	if (address < 0x8000) return emu.rom[(gb_rom_bank() * 0x4000 + (address - 0x4000)) % emu.romSize];
+	if (address >= 0xA000 && address < 0xC000) {
+		uint8_t *ram = gb_ram(address);
+		return ram ? *ram : 0xFF;
+	}
+	return 0xFF;
+}
+
+// Writes to the MBC registers
+static void gb_write_register(uint16_t address, uint8_t value) {
+	uint8_t type = emu.rom[0x147];
+	if (address < 0x2000) return; // RAM enable
+	else if (address < 0x4000) {
+		if (type >= 0x19 && type <= 0x1E && address >= 0x3000) emu.reg3000 = value;
+		else emu.reg2000 = value;
+	}
+	else if (address < 0x6000) emu.reg4000 = value;
+	else if (address < 0x8000) emu.reg6000 = value;
+}
+
+
+// ****** GBA ******
+
+static uint8_t gba_rom_read(uint32_t byteAddress) {
+	if (removed) return byteAddress & 1 ? byteAddress >> 9 : byteAddress >> 1;	// the address stays on the bus
+	if (emu.mode != GBA_MODE || byteAddress >= emu.romSize) return 0x00;
+	return emu.rom[byteAddress];
+}
+
+static uint8_t *gba_save(uint32_t address) {
+	if (emu.saveSize == 0 || emu.saveType == SAVE_EEPROM) return NULL;
+	uint32_t bank = emu.saveType == SAVE_FLASH ? emu.flashBank : emu.sramBank;
+	return &emu.save[(bank * 0x10000 + (address & 0xFFFF)) % emu.saveSize];
+}
+
+static uint8_t gba_save_read(uint32_t address) {
+	uint8_t *p = gba_save(address);
+	return p && !removed ? *p : 0xFF;
+}
+
+static void flash_id(uint8_t id[2]) {
+	id[0] = id[1] = 0xFF;
+	if (emu.saveType != SAVE_FLASH) return;
+	if (emu.saveSize > 0x10000) { // Macronix MX29L010
+		id[0] = 0xC2;
+		id[1] = 0x09;
+	}
+	else { // SST 39VF512
+		id[0] = 0xBF;
+		id[1] = 0xD4;
+	}
+}
+
+static void eeprom_read_block(uint8_t *block) {
+	// A 4Kbit EEPROM accessed like a 64Kbit one keeps sending the first 8 bytes
+	uint32_t offset = emu.saveSize == 0x200 && emu.eepromSize == EEPROM_64KBIT ? 0 : emu.address * 8;
+	for (int i = 0; i < 8; i++) {
+		block[i] = emu.saveType == SAVE_EEPROM ? emu.save[(offset + i) % emu.saveSize] : 0xFF;
+	}
+	emu.address++;
+}
+
+
+// ****** Block reads ******
+
+// Fill one block for a read mode and advance the address
+static void fill_block(char mode, uint8_t *block, int len) {
+	for (int i = 0; i < len; i++) {
+		switch (mode) {
+			case READ_ROM_RAM: case READ_ROM_4000H: block[i] = gb_read(emu.address + i); break;
+			case GBA_READ_ROM: case GBA_READ_ROM_8000H: case GBA_READ_ROM_256BYTE: block[i] = gba_rom_read(emu.address * 2 + i); break;
+			case GBA_READ_SRAM: block[i] = gba_save_read(emu.address + i); break;
+			case FAST_READ_CHECK: block[i] = 0; break;
+		}
+	}
+	if (mode == GBA_READ_ROM || mode == GBA_READ_ROM_8000H || mode == GBA_READ_ROM_256BYTE) emu.address += len / 2;
+	else emu.address += len;
+}
+
+// Send a block, with the faults that were asked for
+static void send_block(const uint8_t *block, int len) {
+	uint8_t copy[256];
+	emu.blocks++;
+	if (emu.dropEvery && emu.blocks % emu.dropEvery == 0) {
+		emu.drops++;
+		send_bytes(block, len / 2); // The rest never arrives
+		return;
+	}
+	if (emu.corruptEvery && emu.blocks % emu.corruptEvery == 0) {
+		emu.corrupts++;
+		memcpy(copy, block, len);
+		copy[emu.blocks % len] ^= 0x10;
+		block = copy;
+	}
+	send_bytes(block, len);
+}
+
+// Stream blocks, a '1' asks for the next one and anything else ends the read
+static void stream_blocks(char mode, int len) {
+	uint8_t block[256];
+	for (;;) {
+		if (mode == GBA_READ_EEPROM) eeprom_read_block(block);
+		else fill_block(mode, block, len);
+		send_block(block, len);
+
+		int c = next_byte();
+		if (c != '1') {
+			if (c > 0 && c != '0') inPos--; // Not ours, leave it for the command loop
+			return;
+		}
+		sleep_us(emu.latency);
+	}
+}
+
+// Fast reads send everything in one go, a '0' from the PC stops them early
+static void stream_fast(char mode, uint32_t total) {
+	uint8_t block[64];
+	for (uint32_t sent = 0; sent < total; sent += 64) {
+		if (peek_byte() == '0') {
+			next_byte();
+			return;
+		}
+		fill_block(mode, block, 64);
+		send_block(block, 64);
+	}
+}
+
+
+// ****** Command loop ******
+
+static void ack(void) {
+	sleep_us(emu.latency);
+	send_byte('1');
+}
+
+static void command(int c) {
+	uint8_t payload[256];
+	uint32_t value;
+
+	emu.commands++;
+	sleep_us(emu.latency);
+	if (emu.verbose) fprintf(stderr, "cmd %c (0x%02x) address 0x%x\n", c >= 0x20 && c < 0x7F ? c : '.', c, emu.address);
+
+	switch (c) {
+		// Queries
+		case CART_MODE: send_byte(emu.mode); break;
+		case READ_FIRMWARE_VERSION: send_byte(30); break;
+		case READ_PCB_VERSION: send_byte(PCB_1_4); break;
+		case QUERY_CART_PWR: send_byte(1); break;
+
+		// Addresses and banks
+		case SET_START_ADDRESS: emu.address = read_number(16); break;
+		case SET_BANK:
+			if (!emu.bankHalf) emu.bankAddress = read_number(16);
+			else gb_write_register(emu.bankAddress, read_number(10));
+			emu.bankHalf = !emu.bankHalf;
+			break;
+		case GBA_SET_EEPROM_SIZE: emu.eepromSize = read_number(16); break;
+		case GBA_FLASH_SET_BANK: emu.flashBank = read_number(16); break;
+
+		// Reads
+		case READ_ROM_RAM: case GBA_READ_ROM: case GBA_READ_SRAM: stream_blocks(c, 64); break;
+		case GBA_READ_ROM_256BYTE: stream_blocks(c, 256); break;
+		case GBA_READ_EEPROM: stream_blocks(c, 8); break;
+		case READ_ROM_4000H: stream_fast(c, 0x4000); break;
+		case GBA_READ_ROM_8000H: stream_fast(c, 0x10000); break;
+		case FAST_READ_CHECK: stream_fast(c, 0x8000); break;
+
+		// Save writes
+		case WRITE_RAM:
+			read_payload(payload, 64);
+			for (int i = 0; i < 64; i++) {
+				uint8_t *ram = gb_ram(emu.address + i);
+				if (ram) *ram = payload[i];
+			}
+			emu.address += 64;
+			ack();
+			break;
+		case GBA_WRITE_SRAM: case GBA_WRITE_ONE_BYTE_SRAM: {
+			int len = c == GBA_WRITE_SRAM ? 64 : 1;
+			read_payload(payload, len);
+			for (int i = 0; i < len && emu.saveType == SAVE_SRAM; i++) *gba_save(emu.address + i) = payload[i];
+			if (len == 64) emu.address += 64;
+			ack();
+			break;
+		}
+		case GBA_WRITE_EEPROM:
+			read_payload(payload, 8);
+			if (emu.saveType == SAVE_EEPROM) {
+				for (int i = 0; i < 8; i++) emu.save[(emu.address * 8 + i) % emu.saveSize] = payload[i];
+			}
+			emu.address++;
+			ack();
+			break;
+
+		// Flash saves
+		case GBA_FLASH_READ_ID: flash_id(payload); send_bytes(payload, 2); break;
+		case GBA_FLASH_4K_SECTOR_ERASE:
+			value = read_number(16);
+			if (emu.saveType == SAVE_FLASH) {
+				for (uint32_t i = 0; i < 0x1000; i++) *gba_save(value * 0x1000 + i) = 0xFF;
+			}
+			ack();
+			break;
+		case GBA_FLASH_WRITE_BYTE: case GBA_FLASH_WRITE_ATMEL: {
+			int len = c == GBA_FLASH_WRITE_BYTE ? 64 : 128;
+			read_payload(payload, len);
+			for (int i = 0; i < len && emu.saveType == SAVE_FLASH; i++) {
+				uint8_t *p = gba_save(emu.address + i);
+				*p = c == GBA_FLASH_WRITE_BYTE ? *p & payload[i] : payload[i]; // Flash only clears bits
+			}
+			emu.address += len;
+			ack();
+			break;
+		}
+
+		// Flash carts, the address and the value come as two numbers
+		case GBA_FLASH_CART_WRITE_BYTE:
+			value = read_number(16);
+			if (next_byte() != GBA_FLASH_CART_WRITE_BYTE) break;
+			if (value == 0x1000000 / 2) emu.sramBank = read_number(16); // 1Mbit SRAM bank
+			else read_number(16);
+			ack();
+			break;
+		case GB_FLASH_WRITE_BYTE:
+			read_number(16);
+			read_number(16);
+			ack();
+			break;
+		case GB_FLASH_WRITE_64BYTE: case GBA_FLASH_WRITE_64BYTE_SWAPPED_D0D1: case GBA_FLASH_WRITE_INTEL_64BYTE:
+			read_payload(payload, 64);
+			ack();
+			break;
+		case GB_FLASH_WRITE_256BYTE: case GBA_FLASH_WRITE_256BYTE_SWAPPED_D0D1: case GBA_FLASH_WRITE_256BYTE:
+			read_payload(payload, 256);
+			ack();
+			break;
+		case GB_FLASH_WRITE_BUFFERED_32BYTE:
+			read_payload(payload, 32);
+			ack();
+			break;
+
+		// Pin level commands, LED and power control
+		case SET_INPUT: case SET_OUTPUT: case SET_OUTPUT_LOW: case SET_OUTPUT_HIGH: case XMAS_LEDS: case GB_FLASH_PROGRAM_METHOD:
+			read_number(16);
+			break;
+		case READ_INPUT: next_byte(); send_byte(0); break;
+		case RESET_COMMON_LINES: case GB_FLASH_WE_PIN: next_byte(); break;
+		default: break; // '0', '1', voltage, LEDs, power, cart mode
+	}
+}
+
+static int load_file(const char *path, uint8_t **data, uint32_t *size, int writable) {
+	struct stat st;
+	int fd = open(path, writable ? O_RDWR : O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) || st.st_size == 0) {
+		fprintf(stderr, "Can't open %s\n", path);
+		if (fd >= 0) close(fd);
+		return 1;
+	}
+	*data = mmap(NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (*data == MAP_FAILED) return 1;
+	*size = st.st_size;
+	return 0;
+}
+
+// ****** Trace replay ******
+
+// Wait for the bytes the PC sent in the trace and answer with what the GBxCart sent, after the same delay
+// as when it was recorded. Returns 1 when the PC doesn't send what it sent back then.
+static int replay(uint8_t *trace, uint32_t size) {
+	struct trace_event e;
+	struct timespec last, due, now;
+	uint32_t pos, start = 8;
+	unsigned long events = 0, bytesIn = 0;
+	long maxLate = 0;
+	int diverged = 0;
+
+	if (size < 8 || memcmp(trace, TRACE_MAGIC, 8)) {
+		fprintf(stderr, "%s is not a trace\n", emu.replay);
+		return 1;
+	}
+
+	// Start at the last time the port was opened before the GBxCart answered, earlier opens were ports
+	// or baud rates that were tried and gave up
+	for (pos = 8; pos + sizeof(e) <= size; pos += sizeof(e) + e.length) {
+		memcpy(&e, trace + pos, sizeof(e));
+		if (e.type == TRACE_OPEN) start = pos;
+		if (e.type == TRACE_RX) break;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	for (pos = start; pos + sizeof(e) <= size && !quit; pos += sizeof(e) + e.length) {
+		memcpy(&e, trace + pos, sizeof(e));
+		const uint8_t *payload = trace + pos + sizeof(e);
+		if (pos + sizeof(e) + e.length > size) break;		// the recording was cut off
+
+		if (e.type == TRACE_LOST) {
+			uint32_t lost;
+			memcpy(&lost, payload, sizeof(lost));
+			fprintf(stderr, "%u events weren't recorded after event %lu, can't replay further\n", lost, events);
+			break;
+		}
+		else if (e.type == TRACE_OPEN) {
+			if (emu.verbose) fprintf(stderr, "[%lu] port %.*s opened\n", events, e.length, payload);
+		}
+		else if (e.type == TRACE_TX) {
+			for (int i = 0; i < e.length && !diverged; i++) {
+				int c = next_byte();
+				if (c < 0) break;
+				if (c != payload[i]) {
+					fprintf(stderr, "Event %lu, byte %d: the trace has 0x%02x, got 0x%02x\n", events, i, payload[i], c);
+					diverged = 1;
+				}
+				bytesIn++;
+			}
+			if (diverged || quit) break;
+			if (emu.verbose) fprintf(stderr, "[%lu] < %.*s\n", events, e.length, payload);
+		}
+		else if (e.type == TRACE_RX) {
+			due = last;
+			add_ns(&due, e.delta * 1000L);
+			if (!emu.replayFast) {
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				long late = (now.tv_sec - due.tv_sec) * 1000000 + (now.tv_nsec - due.tv_nsec) / 1000;
+				if (late > maxLate) maxLate = late;
+			}
+			send_bytes(payload, e.length);
+			if (emu.verbose) fprintf(stderr, "[%lu] > %u bytes after %uus\n", events, e.length, e.delta);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &last);
+		events++;
+	}
+
+	fprintf(stderr, "Replayed %lu events, %lu bytes in, %lu bytes out, answers up to %ldus late%s\n",
+		events, bytesIn, emu.bytesOut, maxLate, pos + sizeof(e) > size ? ", end of trace" : "");
+	return diverged;
+}
+
+static int load_cartridge(char *files[], int count, const char *mode, const char *saveType) {
+	const char *romPath = files[0];
+	if (load_file(romPath, &emu.rom, &emu.romSize, 0)) return 1;
+	if (count > 1 && load_file(files[1], &emu.save, &emu.saveSize, 1)) return 1;
+
+	const char *ext = strrchr(romPath, '.');
+	emu.mode = (mode ? !strcmp(mode, "gba") : ext && !strcasecmp(ext, ".gba")) ? GBA_MODE : GB_MODE;
+	if (emu.mode == GB_MODE && emu.romSize < 0x150) {
+		fprintf(stderr, "%s is too small for a GB ROM\n", romPath);
+		return 1;
+	}
+
+	if (saveType) emu.saveType = !strcmp(saveType, "flash") ? SAVE_FLASH : !strcmp(saveType, "eeprom") ? SAVE_EEPROM : SAVE_SRAM;
+	else if (emu.mode == GBA_MODE && (emu.saveSize == 0x200 || emu.saveSize == 0x2000)) emu.saveType = SAVE_EEPROM;
+	else if (emu.mode == GBA_MODE && emu.saveSize >= 0x10000) emu.saveType = SAVE_FLASH;
+	else emu.saveType = SAVE_SRAM;
+	return 0;
+}
+
+static void usage(const char *name) {
+	printf("usage: %s [options] <rom> [save]\n"
+		"       %s [options] --replay=<trace>\n\n"
+		"    --mode=gb|gba         Cartridge type (default from the ROM file extension)\n"
+		"    --save-type=<..>      sram, flash or eeprom (default from the save size)\n"
+		"    --link=<path>         Symlink to the pty\n"
+		"    --baud=<n>            Emulated baud rate, 0 for no limit (default 1000000)\n"
+		"    --latency=<us>        Time the device takes per command\n"
+		"    --drop=<n>            Cut every n-th block short\n"
+		"    --corrupt=<n>         Flip a bit in every n-th block\n"
+		"    --replay=<trace>      Answer like the GBxCart in a gbxfuse --trace recording\n"
+		"    --fast                Replay without the recorded delays\n"
+		"    -v   --verbose        Print every command\n", name, name);
+}
+
+int main(int argc, char *argv[]) {
+	static const struct option longOptions[] = {
+		{"mode", required_argument, NULL, 'm'},
+		{"save-type", required_argument, NULL, 't'},
+		{"link", required_argument, NULL, 'l'},
+		{"baud", required_argument, NULL, 'b'},
+		{"latency", required_argument, NULL, 'L'},
+		{"drop", required_argument, NULL, 'd'},
+		{"corrupt", required_argument, NULL, 'c'},
+		{"replay", required_argument, NULL, 'r'},
+		{"fast", no_argument, NULL, 'f'},
+		{"verbose", no_argument, NULL, 'v'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	const char *mode = NULL, *saveType = NULL, *link = NULL;
+	int opt;
+
+	emu.baud = 1000000;
+	while ((opt = getopt_long(argc, argv, "vh", longOptions, NULL)) != -1) {
+		switch (opt) {
+			case 'm': mode = optarg; break;
+			case 't': saveType = optarg; break;
+			case 'l': link = optarg; break;
+			case 'b': emu.baud = atol(optarg); break;
+			case 'L': emu.latency = atol(optarg); break;
+			case 'd': emu.dropEvery = atol(optarg); break;
+			case 'c': emu.corruptEvery = atol(optarg); break;
+			case 'r': emu.replay = optarg; break;
+			case 'f': emu.replayFast = 1; break;
+			case 'v': emu.verbose = 1; break;
+			default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+		}
+	}
+	uint8_t *trace = NULL;
+	uint32_t traceSize = 0;
+	if (emu.replay) {
+		if (load_file(emu.replay, &trace, &traceSize, 0)) return 1;
+		emu.baud = 0;		// the recorded delays already include the time on the wire
+	}
+	else if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	else if (load_cartridge(argv + optind, argc - optind, mode, saveType)) return 1;
+
+	// Pseudo-terminal, the slave end stays open so the master keeps working between clients
+	emu.fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (emu.fd < 0 || grantpt(emu.fd) || unlockpt(emu.fd)) {
+		perror("Can't create a pty");
+		return 1;
+	}
+	const char *slaveName = ptsname(emu.fd);
+	int slave = open(slaveName, O_RDWR | O_NOCTTY);
+	struct termios tio;
+	if (slave < 0 || tcgetattr(slave, &tio)) {
+		perror("Can't open the pty");
+		return 1;
+	}
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	if (link) {
+		unlink(link);
+		if (symlink(slaveName, link)) perror("Can't create the link");
+	}
+	printf("%s\n", slaveName);
+	fflush(stdout);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = on_remove;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	int c, ret = 0;
+	if (trace) {
+		ret = replay(trace, traceSize);
+		while (!ret && next_byte() >= 0);		// keep the pty open until we are told to stop
+	}
+	else while ((c = next_byte()) >= 0) command(c);
+
+	if (emu.save) msync(emu.save, emu.saveSize, MS_SYNC);
+	if (link) unlink(link);
+	if (!trace) fprintf(stderr, "%lu commands, %lu blocks, %lu bytes sent, %lu dropped, %lu corrupted\n",
+		emu.commands, emu.blocks, emu.bytesOut, emu.drops, emu.corrupts);
+	close(slave);
+	close(emu.fd);
+	return ret;
+}
@@ -0,0 +1,417 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ CRC32 (IEEE), MD5 and SHA-1 of dumped images. The CRC32 uses the ARMv8 CRC instructions
+ when the compiler targets them and slicing-by-8 otherwise, SHA-1 uses the x86 SHA extensions
+ when the CPU has them.
+
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "hash.h"
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_SHA_NI 1
+#endif
+
+#define HASH_CHUNK 0x10000
+
+// ****** CRC32 ******
+
+#if !defined(__ARM_FEATURE_CRC32)
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init_table(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		crc_table[0][i] = c;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int t = 1; t < 8; t++) {
+			crc_table[t][i] = (crc_table[t-1][i] >> 8) ^ crc_table[0][crc_table[t-1][i] & 0xFF];
+		}
+	}
+}
+#endif
+
+// Update a CRC32, crc starts out as 0xFFFFFFFF and is inverted when done
+static uint32_t crc32_update(uint32_t crc, const uint8_t *p, uint32_t len) {
+#if defined(__ARM_FEATURE_CRC32)
+	while (len && ((uintptr_t) p & 7)) { crc = __crc32b(crc, *p++); len--; }
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc = __crc32d(crc, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--) crc = __crc32b(crc, *p++);
+#else
+	pthread_once(&crc_once, crc32_init_table);
+	while (len >= 8) {
+		uint32_t lo = crc ^ ((uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24);
+		uint32_t hi = (uint32_t) p[4] | (uint32_t) p[5] << 8 | (uint32_t) p[6] << 16 | (uint32_t) p[7] << 24;
+		crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+			  crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+			  crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+			  crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len--) crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+#endif
+	return crc;
+}
+
+
+// ****** MD5 ******
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static const uint32_t md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const uint8_t md5_r[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void md5_block(uint32_t state[4], const uint8_t *p) {
+	uint32_t m[16];
+	for (int i = 0; i < 16; i++) {
+		m[i] = (uint32_t) p[i*4] | (uint32_t) p[i*4+1] << 8 | (uint32_t) p[i*4+2] << 16 | (uint32_t) p[i*4+3] << 24;
+	}
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	for (int i = 0; i < 64; i++) {
+		uint32_t f, g;
+		if (i < 16) { f = (b & c) | (~b & d); g = i; }
+		else if (i < 32) { f = (d & b) | (~d & c); g = (5 * i + 1) & 15; }
+		else if (i < 48) { f = b ^ c ^ d; g = (3 * i + 5) & 15; }
+		else { f = c ^ (b | ~d); g = (7 * i) & 15; }
+		uint32_t tmp = d;
+		d = c;
+		c = b;
+		b = b + ROTL(a + f + md5_k[i] + m[g], md5_r[i]);
+		a = tmp;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+
+static void md5_init(struct md5_ctx *ctx) {
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+	ctx->length = 0;
+}
+
+static void md5_update(struct md5_ctx *ctx, const uint8_t *p, uint32_t len) {
+	uint32_t fill = ctx->length & 63;
+	ctx->length += len;
+	if (fill) {
+		uint32_t n = 64 - fill < len ? 64 - fill : len;
+		memcpy(ctx->buffer + fill, p, n);
+		p += n;
+		len -= n;
+		if (fill + n < 64) return;
+		md5_block(ctx->state, ctx->buffer);
+	}
+	for (; len >= 64; p += 64, len -= 64) md5_block(ctx->state, p);
+	memcpy(ctx->buffer, p, len);
+}
+
+static void md5_final(struct md5_ctx *ctx, uint8_t out[16]) {
+	uint64_t bits = ctx->length * 8;
+	uint8_t pad[72] = {0x80};
+	uint32_t padLen = (ctx->length & 63) < 56 ? 56 - (ctx->length & 63) : 120 - (ctx->length & 63);
+	for (int i = 0; i < 8; i++) pad[padLen + i] = bits >> (8 * i);
+	md5_update(ctx, pad, padLen + 8);
+	for (int i = 0; i < 16; i++) out[i] = ctx->state[i / 4] >> (8 * (i % 4));
+}
+
+
+// ****** SHA-1 ******
+
+static void sha1_blocks_sw(uint32_t state[5], const uint8_t *p, uint32_t blocks) {
+	while (blocks--) {
+		uint32_t w[80];
+		for (int i = 0; i < 16; i++) {
+			w[i] = (uint32_t) p[i*4] << 24 | (uint32_t) p[i*4+1] << 16 | (uint32_t) p[i*4+2] << 8 | (uint32_t) p[i*4+3];
+		}
+		for (int i = 16; i < 80; i++) w[i] = ROTL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+		for (int i = 0; i < 80; i++) {
+			uint32_t f, k;
+			if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+			else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+			else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+			else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+			uint32_t tmp = ROTL(a, 5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = ROTL(b, 30);
+			b = a;
+			a = tmp;
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		p += 64;
+	}
+}
+
+#ifdef HAVE_SHA_NI
+// Four rounds, message schedule for the following groups is prepared at the same time
+#define SHA1_NI_GROUP(k, f, Ein, Eout) \
+	Ein = _mm_sha1nexte_epu32(Ein, M[(k) % 4]); \
+	Eout = ABCD; \
+	M[((k) + 1) % 4] = _mm_sha1msg2_epu32(M[((k) + 1) % 4], M[(k) % 4]); \
+	ABCD = _mm_sha1rnds4_epu32(ABCD, Ein, f); \
+	M[((k) + 3) % 4] = _mm_sha1msg1_epu32(M[((k) + 3) % 4], M[(k) % 4]); \
+	M[((k) + 2) % 4] = _mm_xor_si128(M[((k) + 2) % 4], M[(k) % 4]);
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_ni(uint32_t state[5], const uint8_t *p, uint32_t blocks) {
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i ABCD = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1B);
+	__m128i E0 = _mm_set_epi32(state[4], 0, 0, 0);
+	__m128i E1, M[4];
+
+	while (blocks--) {
+		__m128i ABCD_SAVE = ABCD;
+		__m128i E0_SAVE = E0;
+		for (int i = 0; i < 4; i++) M[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + 16 * i)), mask);
+
+		E0 = _mm_add_epi32(E0, M[0]);
+		E1 = ABCD;
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+
+		E1 = _mm_sha1nexte_epu32(E1, M[1]);
+		E0 = ABCD;
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+		M[0] = _mm_sha1msg1_epu32(M[0], M[1]);
+
+		E0 = _mm_sha1nexte_epu32(E0, M[2]);
+		E1 = ABCD;
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+		M[1] = _mm_sha1msg1_epu32(M[1], M[2]);
+		M[0] = _mm_xor_si128(M[0], M[2]);
+
+		SHA1_NI_GROUP(3, 0, E1, E0)
+		SHA1_NI_GROUP(4, 0, E0, E1)
+		SHA1_NI_GROUP(5, 1, E1, E0)
+		SHA1_NI_GROUP(6, 1, E0, E1)
+		SHA1_NI_GROUP(7, 1, E1, E0)
+		SHA1_NI_GROUP(8, 1, E0, E1)
+		SHA1_NI_GROUP(9, 1, E1, E0)
+		SHA1_NI_GROUP(10, 2, E0, E1)
+		SHA1_NI_GROUP(11, 2, E1, E0)
+		SHA1_NI_GROUP(12, 2, E0, E1)
+		SHA1_NI_GROUP(13, 2, E1, E0)
+		SHA1_NI_GROUP(14, 2, E0, E1)
+		SHA1_NI_GROUP(15, 3, E1, E0)
+		SHA1_NI_GROUP(16, 3, E0, E1)
+		SHA1_NI_GROUP(17, 3, E1, E0)
+		SHA1_NI_GROUP(18, 3, E0, E1)
+		SHA1_NI_GROUP(19, 3, E1, E0)
+
+		E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+		ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+		p += 64;
+	}
+
+	_mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(ABCD, 0x1B));
+	state[4] = _mm_extract_epi32(E0, 3);
+}
+
+static int sha_ni_supported(void) {
+	static int supported = -1;
+	if (supported < 0) {
+		unsigned int eax, ebx, ecx, edx;
+		supported = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1 << 29));
+	}
+	return supported;
+}
+#endif
+
+static void sha1_blocks(uint32_t state[5], const uint8_t *p, uint32_t blocks) {
+#ifdef HAVE_SHA_NI
+	if (sha_ni_supported()) {
+		sha1_blocks_ni(state, p, blocks);
+		return;
+	}
+#endif
+	sha1_blocks_sw(state, p, blocks);
+}
+
+static void sha1_init(struct sha1_ctx *ctx) {
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xEFCDAB89;
+	ctx->state[2] = 0x98BADCFE;
+	ctx->state[3] = 0x10325476;
+	ctx->state[4] = 0xC3D2E1F0;
+	ctx->length = 0;
+}
+
+static void sha1_update(struct sha1_ctx *ctx, const uint8_t *p, uint32_t len) {
+	uint32_t fill = ctx->length & 63;
+	ctx->length += len;
+	if (fill) {
+		uint32_t n = 64 - fill < len ? 64 - fill : len;
+		memcpy(ctx->buffer + fill, p, n);
+		p += n;
+		len -= n;
+		if (fill + n < 64) return;
+		sha1_blocks(ctx->state, ctx->buffer, 1);
+	}
+	sha1_blocks(ctx->state, p, len / 64);
+	p += len & ~63u;
+	memcpy(ctx->buffer, p, len & 63);
+}
+
+static void sha1_final(struct sha1_ctx *ctx, uint8_t out[20]) {
+	uint64_t bits = ctx->length * 8;
+	uint8_t pad[72] = {0x80};
+	uint32_t padLen = (ctx->length & 63) < 56 ? 56 - (ctx->length & 63) : 120 - (ctx->length & 63);
+	for (int i = 0; i < 8; i++) pad[padLen + i] = bits >> (56 - 8 * i);
+	sha1_update(ctx, pad, padLen + 8);
+	for (int i = 0; i < 20; i++) out[i] = ctx->state[i / 4] >> (24 - 8 * (i % 4));
+}
+
+
+// ****** Streaming ******
+
+static void hash_chunk(struct hash_stream *hs, const uint8_t *p, uint32_t len) {
+	hs->crc = crc32_update(hs->crc, p, len);
+	md5_update(&hs->md5, p, len);
+	sha1_update(&hs->sha1, p, len);
+}
+
+static void *hash_worker(void *ptr) {
+	struct hash_stream *hs = (struct hash_stream *) ptr;
+
+	pthread_mutex_lock(&hs->mutex);
+	while (1) {
+		while (hs->hashed >= hs->fed && !hs->finished) pthread_cond_wait(&hs->cond, &hs->mutex);
+		if (hs->hashed >= hs->fed) break;
+
+		uint32_t start = hs->hashed;
+		uint32_t len = hs->fed - start;
+		if (len > HASH_CHUNK) len = HASH_CHUNK;
+		pthread_mutex_unlock(&hs->mutex);
+
+		hash_chunk(hs, hs->data + start, len);
+
+		pthread_mutex_lock(&hs->mutex);
+		hs->hashed = start + len;
+	}
+	pthread_mutex_unlock(&hs->mutex);
+	return NULL;
+}
+
+void hash_stream_start(struct hash_stream *hs, const void *data) {
+	pthread_mutex_init(&hs->mutex, NULL);
+	pthread_cond_init(&hs->cond, NULL);
+	hs->data = (const uint8_t *) data;
+	hs->fed = 0;
+	hs->hashed = 0;
+	hs->finished = 0;
+	hs->crc = 0xFFFFFFFF;
+	md5_init(&hs->md5);
+	sha1_init(&hs->sha1);
+	hs->running = pthread_create(&hs->thread, NULL, hash_worker, hs) == 0;
+}
+
+void hash_stream_feed(struct hash_stream *hs, uint32_t end) {
+	if (!hs->running) return;
+	pthread_mutex_lock(&hs->mutex);
+	if (end > hs->fed) {
+		hs->fed = end;
+		pthread_cond_signal(&hs->cond);
+	}
+	pthread_mutex_unlock(&hs->mutex);
+}
+
+void hash_stream_finish(struct hash_stream *hs, uint32_t size, struct hashes *out) {
+	if (hs->running) {
+		pthread_mutex_lock(&hs->mutex);
+		if (size > hs->fed) hs->fed = size;
+		hs->finished = 1;
+		pthread_cond_signal(&hs->cond);
+		pthread_mutex_unlock(&hs->mutex);
+		pthread_join(hs->thread, NULL);
+		hs->running = 0;
+	}
+	else hash_chunk(hs, hs->data + hs->hashed, size - hs->hashed);		// no worker, hash here
+
+	out->crc32 = hs->crc ^ 0xFFFFFFFF;
+	md5_final(&hs->md5, out->md5);
+	sha1_final(&hs->sha1, out->sha1);
+	out->verify = 0;
+	out->valid = 1;
+	pthread_mutex_destroy(&hs->mutex);
+	pthread_cond_destroy(&hs->cond);
+}
+
+void hash_stream_cancel(struct hash_stream *hs) {
+	if (hs->running) {
+		pthread_mutex_lock(&hs->mutex);
+		hs->fed = hs->hashed;
+		hs->finished = 1;
+		pthread_cond_signal(&hs->cond);
+		pthread_mutex_unlock(&hs->mutex);
+		pthread_join(hs->thread, NULL);
+		hs->running = 0;
+	}
+	pthread_mutex_destroy(&hs->mutex);
+	pthread_cond_destroy(&hs->cond);
+}
+
+void hash_buffer(const void *data, uint32_t size, struct hashes *out) {
+	struct hash_stream hs;
+	hs.running = 0;
+	hs.data = (const uint8_t *) data;
+	hs.hashed = 0;
+	hs.crc = 0xFFFFFFFF;
+	md5_init(&hs.md5);
+	sha1_init(&hs.sha1);
+	pthread_mutex_init(&hs.mutex, NULL);
+	pthread_cond_init(&hs.cond, NULL);
+	hash_stream_finish(&hs, size, out);
+}
+
+uint32_t hash_crc32(uint32_t crc, const void *data, uint32_t len) {
+	return ~crc32_update(~crc, data, len);
+}
+
+void hash_to_hex(const uint8_t *bytes, int len, char *str) {
+	for (int i = 0; i < len; i++) sprintf(str + 2 * i, "%02x", bytes[i]);
+	str[2 * len] = 0;
+}
@@ -0,0 +1,70 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+struct hashes {
+	int valid;
+	uint32_t crc32;
+	uint8_t md5[16];
+	uint8_t sha1[20];
+	int verify;		// result of the DAT lookup, see dat.h
+};
+
+struct md5_ctx {
+	uint32_t state[4];
+	uint64_t length;
+	uint8_t buffer[64];
+};
+
+struct sha1_ctx {
+	uint32_t state[5];
+	uint64_t length;
+	uint8_t buffer[64];
+};
+
+// Hashes a dump while it is being read, the dump loop tells the worker how far the image is final
+struct hash_stream {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	const uint8_t *data;
+	uint32_t fed;		// bytes [0, fed) will not change anymore
+	uint32_t hashed;	// bytes [0, hashed) went through the hashes
+	int finished;
+	int running;
+	uint32_t crc;
+	struct md5_ctx md5;
+	struct sha1_ctx sha1;
+};
+
+// Hash a complete buffer on the calling thread
+void hash_buffer(const void *data, uint32_t size, struct hashes *out);
+
+// Start hashing the image at data, nothing is hashed until it is fed
+void hash_stream_start(struct hash_stream *hs, const void *data);
+
+// Bytes [0, end) of the image are final and can be hashed, feeding backwards is ignored
+void hash_stream_feed(struct hash_stream *hs, uint32_t end);
+
+// Hash the rest of the image up to size and wait for the result
+void hash_stream_finish(struct hash_stream *hs, uint32_t size, struct hashes *out);
+
+// Drop a stream without a result, used when a dump is abandoned
+void hash_stream_cancel(struct hash_stream *hs);
+
+// CRC32 of data continued from crc, start with 0
+uint32_t hash_crc32(uint32_t crc, const void *data, uint32_t len);
+
+// Lower case hex string of len bytes, str needs room for 2*len+1 characters
+void hash_to_hex(const uint8_t *bytes, int len, char *str);
+
+#endif
@@ -0,0 +1,250 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ Save history in the cache folder. A save is cut into HISTORY_CHUNK_SIZE chunks and every chunk is
+ stored once, as history/chunks/<sha1>. A version is a file history/<title>-<fingerprint>/<n> that
+ lists the SHA1 of each of its chunks, so a save that changed a few bytes costs one new chunk and the
+ list. Reading a version back only copies chunks, the cartridge isn't touched.
+
+ The fingerprint comes from the cartridge header, there is nothing that tells two copies of a game
+ apart. Their saves end up in the same list of versions.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "history.h"
+#include "hash.h"
+
+#define HISTORY_DIR "history"
+#define CHUNK_DIR HISTORY_DIR "/chunks"
+#define HISTORY_MAGIC "GBXHIS1"
+
+struct version_header {
+	char magic[8];
+	uint32_t size;			// of the save
+	uint32_t chunks;
+	int64_t time;
+};
+
+struct version {
+	uint32_t size;
+	time_t time;
+};
+
+struct history {
+	pthread_mutex_t mutex;
+	char cartDir[64];			// empty when no cartridge is selected
+	struct version *versions;
+	int count;
+};
+
+struct history *history_new(void) {
+	struct history *h = calloc(1, sizeof(*h));
+	if (h == NULL) return NULL;
+	pthread_mutex_init(&h->mutex, NULL);
+	return h;
+}
+
+// Only the last chunk can be shorter
+static uint32_t chunk_length(uint32_t size, uint32_t chunk) {
+	uint32_t left = size - chunk * HISTORY_CHUNK_SIZE;
+	return left < HISTORY_CHUNK_SIZE ? left : HISTORY_CHUNK_SIZE;
+}
+
+// Write data to path through a temp file, so a crash never leaves half of it behind. The temp file is
+// named after the thread, two devices may store the same chunk at once
+static int write_file(const char *path, const void *data1, size_t len1, const void *data2, size_t len2) {
+	char tmpname[128];
+	snprintf(tmpname, sizeof(tmpname), "%s.%lx.tmp", path, (unsigned long) pthread_self());
+
+	FILE *fp = fopen(tmpname, "wb");
+	if (fp == NULL) return 1;
+	int failed = fwrite(data1, 1, len1, fp) != len1 || fwrite(data2, 1, len2, fp) != len2;
+	if (fclose(fp) || failed || rename(tmpname, path)) {
+		unlink(tmpname);
+		return 1;
+	}
+	return 0;
+}
+
+// Read the header and the chunk list of a version, the list is NULL when only the header is wanted
+static int read_version(struct history *h, int version, struct version_header *header, uint8_t **list) {
+	char path[96];
+	snprintf(path, sizeof(path), "%s/%d", h->cartDir, version);
+
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) return 1;
+	int failed = fread(header, sizeof(*header), 1, fp) != 1 || memcmp(header->magic, HISTORY_MAGIC, 8) ||
+		header->chunks != (header->size + HISTORY_CHUNK_SIZE - 1) / HISTORY_CHUNK_SIZE;
+	if (!failed && list) {
+		*list = malloc(header->chunks * 20);
+		failed = *list == NULL || fread(*list, 20, header->chunks, fp) != header->chunks;
+		if (failed) free(*list);
+	}
+	fclose(fp);
+	return failed;
+}
+
+void history_select(struct history *h, const char *title, uint32_t fingerprint) {
+	struct version_header header;
+
+	pthread_mutex_lock(&h->mutex);
+	free(h->versions);
+	h->versions = NULL;
+	h->count = 0;
+	h->cartDir[0] = 0;
+	if (title) {
+		mkdir(HISTORY_DIR, 0755);
+		mkdir(CHUNK_DIR, 0755);
+		snprintf(h->cartDir, sizeof(h->cartDir), HISTORY_DIR "/%s-%08x", title, fingerprint);
+		mkdir(h->cartDir, 0755);
+		while (!read_version(h, h->count + 1, &header, NULL)) {
+			struct version *more = realloc(h->versions, (h->count + 1) * sizeof(*h->versions));
+			if (more == NULL) break;
+			h->versions = more;
+			h->versions[h->count].size = header.size;
+			h->versions[h->count].time = header.time;
+			h->count++;
+		}
+	}
+	pthread_mutex_unlock(&h->mutex);
+}
+
+int history_folder(struct history *h, char *name, size_t size) {
+	int ret = 1;
+	pthread_mutex_lock(&h->mutex);
+	if (h->cartDir[0]) {
+		snprintf(name, size, "%s", h->cartDir + strlen(HISTORY_DIR "/"));
+		ret = 0;
+	}
+	pthread_mutex_unlock(&h->mutex);
+	return ret;
+}
+
+void history_store(struct history *h, const char *save, uint32_t size) {
+	struct version_header header = {HISTORY_MAGIC, size, (size + HISTORY_CHUNK_SIZE - 1) / HISTORY_CHUNK_SIZE, time(NULL)};
+	uint8_t *list, *newest = NULL;
+	struct version_header last;
+	char path[96], hex[41];
+	int stored = 0;
+
+	pthread_mutex_lock(&h->mutex);
+	if (h->cartDir[0] == 0 || size == 0 || (list = malloc(header.chunks * 20)) == NULL) {
+		pthread_mutex_unlock(&h->mutex);
+		return;
+	}
+	for (uint32_t i = 0; i < header.chunks; i++) {
+		struct hashes hash;
+		uint32_t len = chunk_length(size, i);
+		hash_buffer(save + i * HISTORY_CHUNK_SIZE, len, &hash);
+		memcpy(list + i * 20, hash.sha1, 20);
+	}
+
+	if (h->count && !read_version(h, h->count, &last, &newest) && last.size == size && !memcmp(newest, list, header.chunks * 20)) {
+		free(newest);
+		free(list);
+		pthread_mutex_unlock(&h->mutex);
+		return;
+	}
+	free(newest);
+
+	for (uint32_t i = 0; i < header.chunks; i++) {
+		uint32_t len = chunk_length(size, i);
+		hash_to_hex(list + i * 20, 20, hex);
+		snprintf(path, sizeof(path), CHUNK_DIR "/%s", hex);
+		if (access(path, F_OK) == 0) continue;		// the same data is already stored
+		if (write_file(path, save + i * HISTORY_CHUNK_SIZE, len, NULL, 0)) {
+			// A version that lists a missing chunk could never be read back
+			fprintf(stderr, "Storing save version %d failed\n", h->count + 1);
+			free(list);
+			pthread_mutex_unlock(&h->mutex);
+			return;
+		}
+		stored++;
+	}
+
+	struct version *more = realloc(h->versions, (h->count + 1) * sizeof(*h->versions));
+	snprintf(path, sizeof(path), "%s/%d", h->cartDir, h->count + 1);
+	if (more && !write_file(path, &header, sizeof(header), list, header.chunks * 20)) {
+		h->versions = more;
+		h->versions[h->count].size = size;
+		h->versions[h->count].time = header.time;
+		h->count++;
+		printf("Save version %d stored, %d new chunks\n", h->count, stored);
+	}
+	else {
+		if (more) h->versions = more;
+		fprintf(stderr, "Storing save version %d failed\n", h->count + 1);
+	}
+	free(list);
+	pthread_mutex_unlock(&h->mutex);
+}
+
+int history_versions(struct history *h) {
+	pthread_mutex_lock(&h->mutex);
+	int n = h->count;
+	pthread_mutex_unlock(&h->mutex);
+	return n;
+}
+
+int history_name(struct history *h, int version, char *name, size_t size) {
+	uint32_t bytes;
+	time_t time;
+	struct tm tm;
+
+	if (history_stat(h, version, &bytes, &time)) return 1;
+	localtime_r(&time, &tm);
+	snprintf(name, size, "%d-%04d%02d%02d-%02d%02d%02d.sav", version, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+		tm.tm_hour, tm.tm_min, tm.tm_sec);
+	return 0;
+}
+
+int history_stat(struct history *h, int version, uint32_t *size, time_t *time) {
+	int ret = 1;
+	pthread_mutex_lock(&h->mutex);
+	if (version >= 1 && version <= h->count) {
+		*size = h->versions[version - 1].size;
+		*time = h->versions[version - 1].time;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&h->mutex);
+	return ret;
+}
+
+int history_read(struct history *h, int version, char **data) {
+	struct version_header header;
+	uint8_t *list;
+	char path[96], hex[41];
+	int ret = -1;
+
+	pthread_mutex_lock(&h->mutex);
+	if (version < 1 || version > h->count || read_version(h, version, &header, &list)) {
+		pthread_mutex_unlock(&h->mutex);
+		return -1;
+	}
+	*data = malloc(header.size);
+	for (uint32_t i = 0; *data && i < header.chunks; i++) {
+		uint32_t len = chunk_length(header.size, i);
+		hash_to_hex(list + i * 20, 20, hex);
+		snprintf(path, sizeof(path), CHUNK_DIR "/%s", hex);
+		FILE *fp = fopen(path, "rb");
+		int failed = fp == NULL || fread(*data + i * HISTORY_CHUNK_SIZE, 1, len, fp) != len;
+		if (fp) fclose(fp);
+		if (failed) {
+			free(*data);
+			*data = NULL;
+		}
+	}
+	if (*data) ret = header.size;
+	free(list);
+	pthread_mutex_unlock(&h->mutex);
+	return ret;
+}
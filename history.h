@@ -0,0 +1,43 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <time.h>
+#include <stddef.h>
+
+#define HISTORY_CHUNK_SIZE 1024
+
+struct history;
+
+// No cartridge selected yet, every device has one
+struct history *history_new(void);
+
+// Work on the versions of the cartridge called title with this fingerprint from now on, NULL for none
+void history_select(struct history *h, const char *title, uint32_t fingerprint);
+
+// Name of the folder of the selected cartridge in history/, returns 1 if none is selected
+int history_folder(struct history *h, char *name, size_t size);
+
+// Store save as the newest version of the selected cartridge, unless it is the same as the newest one
+void history_store(struct history *h, const char *save, uint32_t size);
+
+// Number of versions of the selected cartridge, they are numbered from 1 up
+int history_versions(struct history *h);
+
+// Name of a version in the mount, <version>-<date>-<time>.sav. Returns 1 if there is no such version
+int history_name(struct history *h, int version, char *name, size_t size);
+
+// Size and time a version was stored, returns 1 if there is no such version
+int history_stat(struct history *h, int version, uint32_t *size, time_t *time);
+
+// Put a version together from its chunks into a new buffer, returns its size or -1
+int history_read(struct history *h, int version, char **data);
+
+#endif
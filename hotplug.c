@@ -0,0 +1,100 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ Watches /dev with inotify so the cartridge threads hear about a GBxCart being plugged in or pulled right
+ away, instead of on their next 2s retry or 5s check. Every tty that shows up, changes permissions or goes
+ away calls devicesChanged(), which queues a JOB_DETECT for every device: while one has no GBxCart that
+ makes waitForDevice() look again, with one open it makes detectCart() find out whether it still answers.
+ A burst of events, udev creating the node and then fixing its owner, ends in one job. With --multi a
+ GBxCart that wasn't there before gets a device of its own.
+
+ With --port the folder of that path is watched too and only its name counts, so a udev symlink or the
+ link gbxemu makes is followed as well.
+
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <libgen.h>
+#include <pthread.h>
+#include "hotplug.h"
+
+#define HOTPLUG_SETTLE_MS 200		// udev sets up the node after it appears
+
+#ifdef __linux__
+
+#include <unistd.h>
+#include <sys/inotify.h>
+
+static int watcher = -1;
+static char portName[256];			// only this name in the watched folders counts, or every tty* when empty
+static void (*changed)(int settle_ms);
+
+static int interesting(const char *name) {
+	if (portName[0]) return !strcmp(name, portName);
+	return !strncmp(name, "tty", 3);
+}
+
+static void *hotplug_thread(void *ptr) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	(void) ptr;
+
+	for (;;) {
+		ssize_t len = read(watcher, buf, sizeof(buf));
+		int found = 0;
+		if (len <= 0) break;
+		for (char *p = buf; p < buf + len; ) {
+			struct inotify_event *event = (struct inotify_event *) p;
+			if (event->len && interesting(event->name)) found = 1;
+			p += sizeof(*event) + event->len;
+		}
+		if (found) changed(HOTPLUG_SETTLE_MS);
+	}
+	return NULL;
+}
+
+int hotplug_start(const char *port, void (*callback)(int settle_ms)) {
+	const uint32_t mask = IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM;
+	pthread_t thread;
+
+	watcher = inotify_init1(IN_CLOEXEC);
+	if (watcher < 0) {
+		perror("inotify");
+		return 1;
+	}
+	changed = callback;
+	if (port) {
+		char name[256], dir[256];
+		snprintf(name, sizeof(name), "%s", port);
+		snprintf(dir, sizeof(dir), "%s", port);
+		snprintf(portName, sizeof(portName), "%s", basename(name));
+		if (inotify_add_watch(watcher, dirname(dir), mask) < 0) perror(dir);
+	}
+	if (inotify_add_watch(watcher, "/dev", mask) < 0 && !port) {
+		perror("/dev");
+		close(watcher);
+		watcher = -1;
+		return 1;
+	}
+	if (pthread_create(&thread, NULL, hotplug_thread, NULL)) {
+		fprintf(stderr, "Hotplug watch not started\n");
+		close(watcher);
+		watcher = -1;
+		return 1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+#else
+
+// No inotify, the cartridge threads find their GBxCart by trying every 2s
+int hotplug_start(const char *port, void (*callback)(int settle_ms)) {
+	(void) port;
+	(void) callback;
+	return 1;
+}
+
+#endif
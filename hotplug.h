@@ -0,0 +1,15 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ */
+
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+// Call callback whenever a serial device is added to or removed from /dev, or port when one is given, with how
+// long udev may still need for it. After daemonizing, like control_start(). Returns 0 when the watch is running
+int hotplug_start(const char *port, void (*callback)(int settle_ms));
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ Every GBxCart is one serial link, so one thread per device does all the cartridge work and a queue of
+ its own decides what it does next. A ROM dump is queued one bank at a time, which lets a save commit
+ that arrives in the middle of it go ahead at the next bank instead of waiting for the whole ROM.
+
+ A deferred job isn't in a queue yet, only its due time is kept. jobs_take() queues it once that has
+ passed and sleeps no longer than until the earliest one.
+
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "jobs.h"
+
+struct jobs {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_cond_t done_cond;
+	struct job *queue_head[JOB_TYPES];
+	struct job *queue_tail[JOB_TYPES];
+	unsigned int generation;
+	struct timespec due[JOB_TYPES];		// deferred jobs, tv_sec 0 when there is none
+};
+
+struct job_waiter {
+	int done;
+	int result;
+};
+
+struct jobs *jobs_new(void) {
+	struct jobs *q = calloc(1, sizeof(*q));
+	if (q == NULL) return NULL;
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	pthread_cond_init(&q->done_cond, NULL);
+	return q;
+}
+
+static int before(const struct timespec *a, const struct timespec *b) {
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void add_ms(struct timespec *t, int ms) {
+	t->tv_sec += ms / 1000;
+	t->tv_nsec += (ms % 1000) * 1000000L;
+	if (t->tv_nsec >= 1000000000) {
+		t->tv_nsec -= 1000000000;
+		t->tv_sec++;
+	}
+}
+
+// Called with the queue's mutex held. A job somebody waits for is always queued, the others only once
+static int queue_job(struct jobs *q, int type, uint32_t offset, struct job_waiter *waiter) {
+	q->due[type].tv_sec = 0;
+	if (!waiter && (type == JOB_COMMIT_SAVE || type == JOB_DETECT) && q->queue_head[type] != NULL) return 0;
+	struct job *job = malloc(sizeof(*job));
+	if (job == NULL) return 1;
+	job->type = type;
+	job->offset = offset;
+	job->generation = q->generation;
+	job->waiter = waiter;
+	job->next = NULL;
+
+	if (q->queue_tail[type]) q->queue_tail[type]->next = job;
+	else q->queue_head[type] = job;
+	q->queue_tail[type] = job;
+	pthread_cond_signal(&q->cond);
+	return 0;
+}
+
+void jobs_push(struct jobs *q, int type, uint32_t offset) {
+	pthread_mutex_lock(&q->mutex);
+	queue_job(q, type, offset, NULL);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+int jobs_run(struct jobs *q, int type, uint32_t offset) {
+	struct job_waiter waiter = {0, -1};
+	pthread_mutex_lock(&q->mutex);
+	if (queue_job(q, type, offset, &waiter)) waiter.done = 1;
+	while (!waiter.done) pthread_cond_wait(&q->done_cond, &q->mutex);
+	pthread_mutex_unlock(&q->mutex);
+	return waiter.result;
+}
+
+void jobs_done(struct jobs *q, const struct job *job, int result) {
+	if (job->waiter == NULL) return;
+	pthread_mutex_lock(&q->mutex);
+	job->waiter->result = result;
+	job->waiter->done = 1;
+	pthread_cond_broadcast(&q->done_cond);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+void jobs_push_later(struct jobs *q, int type, int delay_ms) {
+	pthread_mutex_lock(&q->mutex);
+	if (q->queue_head[type] == NULL) {
+		clock_gettime(CLOCK_REALTIME, &q->due[type]);
+		add_ms(&q->due[type], delay_ms);
+		pthread_cond_signal(&q->cond);	// the worker may be sleeping past the new time
+	}
+	pthread_mutex_unlock(&q->mutex);
+}
+
+// Queue the deferred jobs that are due at now and lower wake to the earliest one that isn't
+static void queue_due(struct jobs *q, const struct timespec *now, struct timespec *wake) {
+	for (int type = 0; type < JOB_TYPES; type++) {
+		if (q->due[type].tv_sec == 0) continue;
+		if (before(now, &q->due[type])) {
+			if (before(&q->due[type], wake)) *wake = q->due[type];
+			continue;
+		}
+		struct job *job = malloc(sizeof(*job));
+		if (job == NULL) continue;			// try again on the next wakeup
+		q->due[type].tv_sec = 0;
+		job->type = type;
+		job->offset = 0;
+		job->generation = q->generation;
+		job->waiter = NULL;
+		job->next = NULL;
+		q->queue_head[type] = q->queue_tail[type] = job;
+	}
+}
+
+// The first job of the most urgent queue, NULL when all are empty
+static struct job *first(struct jobs *q) {
+	for (int type = 0; type < JOB_TYPES; type++) {
+		if (q->queue_head[type]) return q->queue_head[type];
+	}
+	return NULL;
+}
+
+int jobs_take(struct jobs *q, struct job *job, int timeout_ms) {
+	struct timespec t, now, wake;
+	struct job *next;
+
+	clock_gettime(CLOCK_REALTIME, &t);
+	add_ms(&t, timeout_ms);
+
+	pthread_mutex_lock(&q->mutex);
+	for (;;) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		wake = t;
+		queue_due(q, &now, &wake);
+		if ((next = first(q)) != NULL) break;
+		if (!before(&now, &t)) {
+			pthread_mutex_unlock(&q->mutex);
+			return 1;
+		}
+		pthread_cond_timedwait(&q->cond, &q->mutex, &wake);
+	}
+	q->queue_head[next->type] = next->next;
+	if (q->queue_head[next->type] == NULL) q->queue_tail[next->type] = NULL;
+	pthread_mutex_unlock(&q->mutex);
+
+	*job = *next;
+	job->next = NULL;
+	free(next);
+	return 0;
+}
+
+void jobs_cancel(struct jobs *q) {
+	pthread_mutex_lock(&q->mutex);
+	for (int type = 0; type < JOB_TYPES; type++) {
+		while (q->queue_head[type]) {
+			struct job *job = q->queue_head[type];
+			q->queue_head[type] = job->next;
+			if (job->waiter) job->waiter->done = 1;		// result stays -1
+			free(job);
+		}
+		q->queue_tail[type] = NULL;
+		q->due[type].tv_sec = 0;
+	}
+	q->generation++;
+	pthread_cond_broadcast(&q->done_cond);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+unsigned int jobs_generation(struct jobs *q) {
+	pthread_mutex_lock(&q->mutex);
+	unsigned int current = q->generation;
+	pthread_mutex_unlock(&q->mutex);
+	return current;
+}
@@ -0,0 +1,64 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ */
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdint.h>
+
+// Work for the cartridge thread. The type is also the priority, the lowest one waiting runs first
+// and jobs of the same type run in the order they were queued
+#define JOB_COMMIT_SAVE 0	// write the save back to the cart
+#define JOB_CANCEL 1		// stop the ROM dump in progress
+#define JOB_DETECT 2		// read the header and see what is in the slot
+#define JOB_REREAD 3		// read the cart again, offset is REREAD_ALL or REREAD_SAVE
+#define JOB_MODE 4			// only look for cartridges of one mode, offset is GB_MODE, GBA_MODE or 0 for both
+#define JOB_CHECK 5			// hash the served ROM again and check it against the DAT
+#define JOB_VERIFY 6		// check a finished ROM dump and publish it
+#define JOB_DUMP_RANGE 7	// read the next bank of the ROM, offset is where it starts
+#define JOB_TYPES 8
+
+#define REREAD_ALL 0		// as if the cart was just inserted
+#define REREAD_SAVE 1
+
+struct job_waiter;
+struct jobs;
+
+struct job {
+	int type;
+	uint32_t offset;
+	unsigned int generation;	// cartridge the job was queued for, see jobs_cancel()
+	struct job_waiter *waiter;	// set by jobs_run()
+	struct job *next;
+};
+
+// An empty queue, every device has one
+struct jobs *jobs_new(void);
+
+// Queue a job for the current cartridge. Commit and detect jobs that are already waiting aren't queued twice
+void jobs_push(struct jobs *q, int type, uint32_t offset);
+
+// Queue a commit or detect job delay_ms from now. Calling it again before then moves the time back,
+// so a burst of calls ends in one job. An immediate jobs_push() of the type makes it run right away
+void jobs_push_later(struct jobs *q, int type, int delay_ms);
+
+// Take the most urgent job into job, waiting up to timeout_ms for one. Returns 1 on timeout
+int jobs_take(struct jobs *q, struct job *job, int timeout_ms);
+
+// Queue a job and wait until the cartridge thread has run it. Returns the result it passed to jobs_done(),
+// or -1 if the job was dropped by jobs_cancel()
+int jobs_run(struct jobs *q, int type, uint32_t offset);
+
+// The cartridge thread is done with job, wake jobs_run() if it is waiting for it
+void jobs_done(struct jobs *q, const struct job *job, int result);
+
+// Drop everything that is waiting, jobs queued from now on belong to the next cartridge
+void jobs_cancel(struct jobs *q);
+
+unsigned int jobs_generation(struct jobs *q);
+
+#endif
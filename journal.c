@@ -0,0 +1,205 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ Every cartridge has its own journal in the cache folder, <title>-<fingerprint>.journal: a header and
+ then one record per write to the save. A write is only acknowledged once its record is synced, so the
+ slow commit to the cartridge can happen later without losing anything if the daemon dies first. Each
+ record has a CRC over itself and the first one that doesn't match, usually the one a crash cut short,
+ ends the replay. The file goes back to just the header once a commit has put everything on the cart.
+
+ Every copy of a game has the same title and fingerprint, so the header also has the SHA1 of the save the
+ records apply to, taken when the journal is opened and again whenever it is cleared. Writes are only
+ replayed onto a save that matches it. A journal with writes for another copy is moved aside to
+<title>-<fingerprint>.journal.stale, replacing an older one, and this save gets a new journal.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "journal.h"
+#include "hash.h"
+
+#define JOURNAL_MAGIC "GBXJRN2"
+
+struct journal_header {
+	char magic[8];
+	uint32_t fingerprint;
+	uint32_t size;			// of the save
+	uint8_t base[20];		// SHA1 of the save the records apply to
+};
+
+struct journal_record {
+	uint32_t offset;
+	uint32_t length;
+	uint32_t crc;			// of offset, length and the data
+	uint32_t pad;
+};
+
+struct journal {
+	pthread_mutex_t mutex;
+	int fd;
+	off_t end;			// of the last good record
+	uint32_t saveSize;
+};
+
+struct journal *journal_new(void) {
+	struct journal *j = calloc(1, sizeof(*j));
+	if (j == NULL) return NULL;
+	pthread_mutex_init(&j->mutex, NULL);
+	j->fd = -1;
+	return j;
+}
+
+// Make the header say the records apply to save
+static int write_header(struct journal *j, uint32_t fingerprint, const char *save) {
+	struct journal_header header;
+	struct hashes hash;
+
+	hash_buffer(save, j->saveSize, &hash);
+	memcpy(header.magic, JOURNAL_MAGIC, 8);
+	header.fingerprint = fingerprint;
+	header.size = j->saveSize;
+	memcpy(header.base, hash.sha1, sizeof(header.base));
+	return pwrite(j->fd, &header, sizeof(header), 0) != sizeof(header);
+}
+
+static uint32_t record_crc(const struct journal_record *record, const void *data) {
+	uint32_t crc = hash_crc32(0, record, 8);
+	return hash_crc32(crc, data, record->length);
+}
+
+// Apply the records to save, returns how many there were. end is left behind the last good one
+static int replay(struct journal *j, char *save) {
+	struct journal_record record;
+	int count = 0;
+
+	j->end = sizeof(struct journal_header);
+	while (pread(j->fd, &record, sizeof(record), j->end) == sizeof(record)) {
+		if (record.length == 0 || record.offset > j->saveSize || record.length > j->saveSize - record.offset) break;
+		char *data = malloc(record.length);
+		if (data == NULL) break;
+		if (pread(j->fd, data, record.length, j->end + sizeof(record)) != (ssize_t) record.length || record_crc(&record, data) != record.crc) {
+			free(data);
+			break;
+		}
+		memcpy(save + record.offset, data, record.length);
+		free(data);
+		j->end += sizeof(record) + record.length;
+		count++;
+	}
+	return count;
+}
+
+// Whether save already has every record in it, the commit got there but the daemon died before the clear
+static int already_applied(struct journal *j, const char *save) {
+	char *copy = malloc(j->saveSize);
+	int applied;
+	if (copy == NULL) return 0;
+	memcpy(copy, save, j->saveSize);
+	replay(j, copy);
+	applied = !memcmp(copy, save, j->saveSize);
+	free(copy);
+	return applied;
+}
+
+int journal_open(struct journal *j, const char *title, uint32_t fingerprint, char *save, uint32_t size) {
+	struct journal_header header;
+	struct hashes hash;
+	char filename[48];
+	int count = 0;
+
+	journal_close(j);
+	snprintf(filename, sizeof(filename), "%s-%08x.journal", title, fingerprint);
+	pthread_mutex_lock(&j->mutex);
+	j->fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if (j->fd < 0) {
+		perror(filename);
+		pthread_mutex_unlock(&j->mutex);
+		return -1;
+	}
+	j->saveSize = size;
+	hash_buffer(save, size, &hash);
+
+	if (pread(j->fd, &header, sizeof(header), 0) == sizeof(header) && !memcmp(header.magic, JOURNAL_MAGIC, 8) &&
+			header.fingerprint == fingerprint && header.size == size && !memcmp(header.base, hash.sha1, sizeof(header.base)))
+		count = replay(j, save);
+	else {
+		int dir;
+		if (lseek(j->fd, 0, SEEK_END) > (off_t) sizeof(header) && !memcmp(header.magic, JOURNAL_MAGIC, 8) &&
+				header.fingerprint == fingerprint && header.size == size && !already_applied(j, save)) {
+			// Writes to another copy of this game, or to a save that changed since. They are not this one's,
+			// keep them where they can be looked at and journal this save in a new file
+			char stale[56];
+			snprintf(stale, sizeof(stale), "%s.stale", filename);
+			close(j->fd);
+			j->fd = -1;
+			if (rename(filename, stale)) perror(stale);
+			else {
+				fprintf(stderr, "Journal %s holds writes for another save, moved to %s\n", filename, stale);
+				j->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+			}
+		}
+		j->end = sizeof(header);
+		if (j->fd < 0 || write_header(j, fingerprint, save)) count = -1;
+		// The journal may be new, make its name durable too
+		else if ((dir = open(".", O_RDONLY)) >= 0) {
+			if (fsync(dir)) count = -1;
+			close(dir);
+		}
+	}
+	// Whatever follows the last good record is garbage from a crash
+	if (count < 0 || ftruncate(j->fd, j->end) || fdatasync(j->fd)) {
+		fprintf(stderr, "Journal %s can't be used, save writes only reach the cartridge\n", filename);
+		if (j->fd >= 0) close(j->fd);
+		j->fd = -1;
+		count = -1;
+	}
+	pthread_mutex_unlock(&j->mutex);
+	return count;
+}
+
+int journal_append(struct journal *j, uint32_t offset, const void *data, uint32_t length) {
+	struct journal_record record = {offset, length, 0, 0};
+	struct iovec iov[2] = {{&record, sizeof(record)}, {(void *) data, length}};
+	int ret = 1;
+
+	record.crc = record_crc(&record, data);
+	pthread_mutex_lock(&j->mutex);
+	if (j->fd >= 0) {
+		if (pwritev(j->fd, iov, 2, j->end) == (ssize_t) (sizeof(record) + length) && !fdatasync(j->fd)) {
+			j->end += sizeof(record) + length;
+			ret = 0;
+		}
+		else if (ftruncate(j->fd, j->end))		// the write was refused, it must not come back on replay
+			perror("journal");
+	}
+	pthread_mutex_unlock(&j->mutex);
+	return ret;
+}
+
+void journal_clear(struct journal *j, const char *save) {
+	struct journal_header header;
+
+	pthread_mutex_lock(&j->mutex);
+	if (j->fd >= 0) {
+		j->end = sizeof(header);
+		if (pread(j->fd, &header, sizeof(header), 0) != sizeof(header) || write_header(j, header.fingerprint, save) ||
+				ftruncate(j->fd, j->end) || fdatasync(j->fd))
+			perror("journal");
+	}
+	pthread_mutex_unlock(&j->mutex);
+}
+
+void journal_close(struct journal *j) {
+	pthread_mutex_lock(&j->mutex);
+	if (j->fd >= 0) close(j->fd);
+	j->fd = -1;
+	pthread_mutex_unlock(&j->mutex);
+}
@@ -0,0 +1,32 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+struct journal;
+
+// A journal that isn't open yet, every device has one
+struct journal *journal_new(void);
+
+// Open the journal of the cartridge called title with this fingerprint and apply the writes it still holds
+// to save, which is size bytes, if they were made to this save. A journal of another save is renamed to
+// .journal.stale and a new one started. Returns the number of writes replayed, or -1 if there is no usable journal
+int journal_open(struct journal *j, const char *title, uint32_t fingerprint, char *save, uint32_t size);
+
+// Append a write to the save and sync it, returns 0 once it is safe on disk
+int journal_append(struct journal *j, uint32_t offset, const void *data, uint32_t length);
+
+// Everything in the journal is on the cartridge now, start it over from save
+void journal_clear(struct journal *j, const char *save);
+
+// Stop journaling. The file stays, it is replayed the next time the cartridge is inserted
+void journal_close(struct journal *j);
+
+#endif
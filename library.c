@@ -0,0 +1,157 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ Everything the cache folder holds, by cartridge. A cartridge with a save has a history folder named
+ <title>-<fingerprint> and becomes an entry under that name, with the cached ROM of the same title if
+ there is one. A cached ROM without any history becomes an entry named after its title. Nothing here
+ talks to a GBxCart, so the library can be browsed without one.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <pthread.h>
+#include "library.h"
+
+#define LIBRARY_MAX 4096
+
+struct library_entry {
+	char name[64];
+	char rom[48];				// empty until the ROM is in the cache
+	struct history *history;	// NULL without a history folder
+};
+
+static pthread_mutex_t libraryMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct library_entry *entries[LIBRARY_MAX];
+static int entryCount = 0;
+
+static struct library_entry *find_entry(const char *name) {
+	for (int i = 0; i < entryCount; i++) {
+		if (!strcmp(entries[i]->name, name)) return entries[i];
+	}
+	return NULL;
+}
+
+static struct library_entry *add_entry(const char *name) {
+	struct library_entry *entry;
+	if (entryCount == LIBRARY_MAX || (entry = calloc(1, sizeof(*entry))) == NULL) return NULL;
+	snprintf(entry->name, sizeof(entry->name), "%s", name);
+	entries[entryCount++] = entry;
+	return entry;
+}
+
+// Split <title>-<fingerprint>, returns 1 if name isn't a history folder
+static int parse_folder(const char *name, char *title, size_t size, uint32_t *fingerprint) {
+	const char *dash = strrchr(name, '-');
+	char *end;
+	if (dash == NULL || strlen(dash + 1) != 8) return 1;
+	*fingerprint = strtoul(dash + 1, &end, 16);
+	if (*end) return 1;
+	snprintf(title, size, "%.*s", (int) (dash - name), name);
+	return 0;
+}
+
+// Title of a cached ROM file, returns 1 for anything else in the cache folder
+static int rom_title(const char *file, char *title, size_t size) {
+	const char *ext = strrchr(file, '.');
+	if (ext == NULL || (strcmp(ext, ".gb") && strcmp(ext, ".gba"))) return 1;
+	snprintf(title, size, "%.*s", (int) (ext - file), file);
+	return 0;
+}
+
+int library_scan(void) {
+	char title[64];
+	uint32_t fingerprint;
+	struct dirent *de;
+	DIR *dir;
+	int count;
+
+	pthread_mutex_lock(&libraryMutex);
+	if ((dir = opendir("history")) != NULL) {
+		while ((de = readdir(dir)) != NULL) {
+			struct library_entry *entry;
+			if (strlen(de->d_name) >= sizeof(entry->name) || parse_folder(de->d_name, title, sizeof(title), &fingerprint) ||
+				find_entry(de->d_name)) continue;
+			if ((entry = add_entry(de->d_name)) != NULL) entry->history = history_new();
+		}
+		closedir(dir);
+	}
+	// ROMs go with every history of their title, or get an entry of their own. Names too long for an entry
+	// aren't from gbxfuse, it names them after the 16 character title
+	if ((dir = opendir(".")) != NULL) {
+		while ((de = readdir(dir)) != NULL) {
+			struct library_entry *own;
+			size_t len = strlen(de->d_name) + 1;
+			int matched = 0;
+			if (len > sizeof(own->rom) || rom_title(de->d_name, title, sizeof(title))) continue;
+			for (int i = 0; i < entryCount; i++) {
+				char cart[64];
+				if (parse_folder(entries[i]->name, cart, sizeof(cart), &fingerprint) || strcmp(cart, title)) continue;
+				memcpy(entries[i]->rom, de->d_name, len);
+				matched = 1;
+			}
+			if (!matched && ((own = find_entry(title)) != NULL || (own = add_entry(title)) != NULL))
+				memcpy(own->rom, de->d_name, len);
+		}
+		closedir(dir);
+	}
+	count = entryCount;
+	pthread_mutex_unlock(&libraryMutex);
+	return count;
+}
+
+int library_name(int entry, char *name, size_t size) {
+	int ret = 1;
+	pthread_mutex_lock(&libraryMutex);
+	if (entry >= 0 && entry < entryCount) {
+		snprintf(name, size, "%s", entries[entry]->name);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&libraryMutex);
+	return ret;
+}
+
+int library_rom(int entry, char *name, size_t size) {
+	int ret = 1;
+	pthread_mutex_lock(&libraryMutex);
+	if (entry >= 0 && entry < entryCount && entries[entry]->rom[0]) {
+		snprintf(name, size, "%s", entries[entry]->rom);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&libraryMutex);
+	return ret;
+}
+
+struct history *library_history(int entry) {
+	struct history *history = NULL;
+	pthread_mutex_lock(&libraryMutex);
+	if (entry >= 0 && entry < entryCount) history = entries[entry]->history;
+	pthread_mutex_unlock(&libraryMutex);
+	return history;
+}
+
+void library_refresh(int entry) {
+	char title[64];
+	uint32_t fingerprint;
+
+	pthread_mutex_lock(&libraryMutex);
+	if (entry >= 0 && entry < entryCount && entries[entry]->history &&
+		!parse_folder(entries[entry]->name, title, sizeof(title), &fingerprint))
+		history_select(entries[entry]->history, title, fingerprint);
+	pthread_mutex_unlock(&libraryMutex);
+}
+
+int library_find(const char *name) {
+	int found = -1;
+	pthread_mutex_lock(&libraryMutex);
+	for (int i = 0; i < entryCount && found < 0; i++) {
+		if (!strcmp(entries[i]->name, name)) found = i;
+	}
+	pthread_mutex_unlock(&libraryMutex);
+	return found;
+}
@@ -0,0 +1,34 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ */
+
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <stddef.h>
+#include "history.h"
+
+// Look through the cache folder (the working directory) for cartridges that aren't known yet. Entries are
+// never removed or reordered, so their numbers can be used in inodes. Returns the number of entries
+int library_scan(void);
+
+// Folder name of an entry, <title>-<fingerprint> like its history or the title of a ROM without one.
+// Returns 1 past the last entry
+int library_name(int entry, char *name, size_t size);
+
+// File name of the cached ROM of an entry, returns 1 if there is none
+int library_rom(int entry, char *name, size_t size);
+
+// The save versions of an entry as of the last library_refresh(), NULL if it has none
+struct history *library_history(int entry);
+
+// Read the version list of an entry again, a device may have stored more since
+void library_refresh(int entry);
+
+// Entry with this folder name, or -1
+int library_find(const char *name);
+
+#endif
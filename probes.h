@@ -0,0 +1,45 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ Static tracepoints for perf and bpftrace. With systemtap's sys/sdt.h available every probe is a
+ single nop plus a note in the ELF file, and nothing runs until a tracer attaches to it:
+
+   bpftrace -e 'usdt:./gbxfuse:gbxfuse:block_start { @s[tid] = nsecs; }
+                usdt:./gbxfuse:gbxfuse:block_done /@s[tid]/ { @us = hist((nsecs - @s[tid]) / 1000); delete(@s[tid]); }'
+
+ Without the header, or when built with -DGBX_NO_PROBES, the probes expand to nothing and their
+ arguments are never evaluated.
+
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+// Cartridge states reported by the cart_state probe
+#define PROBE_CART_NONE 0		// no game in the slot
+#define PROBE_CART_READING 1	// a new game was found and is being dumped
+#define PROBE_CART_READY 2		// the dump is being served
+#define PROBE_CART_WRITING 3	// a changed save is written back to the cart
+
+#if !defined(GBX_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define GBX_HAVE_PROBES
+#endif
+#endif
+
+#ifdef GBX_HAVE_PROBES
+#define PROBE(name) DTRACE_PROBE(gbxfuse, name)
+#define PROBE1(name, a) DTRACE_PROBE1(gbxfuse, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(gbxfuse, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(gbxfuse, name, a, b, c)
+#else
+#define PROBE(name) do { } while (0)
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif
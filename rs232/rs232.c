@@ -34,9 +34,21 @@
 
 #include "rs232.h"
 
+static int port_name_set[64];  /* the port was given by RS232_SetPortName(), don't detect it */
+
+static void (*trace_hook)(int, const unsigned char *, int) = NULL;  /* see RS232_SetTrace() */
+static __thread int trace_cputs = 0;  /* RS232_cputs() records the whole string, not every byte */
+
+static unsigned long bytes_sent = 0, bytes_received = 0;  /* see RS232_GetCounters(), every port adds to them */
+
+static void trace_open_port(int comport_number);
+
 
 #if defined(__linux__) || defined(__FreeBSD__) || defined(__APPLE__)
 
+#include <glob.h>
+#include <dirent.h>
+
 #if defined(__APPLE__)
 #include <IOKit/serial/ioss.h>
 #endif
@@ -44,11 +56,15 @@
 #define RS232_PORTNR  63
 
 
-int Cport[RS232_PORTNR],
-    error;
+int Cport[RS232_PORTNR];
+
+static __thread int error;  /* ports may be opened by several threads at once */
+
+static int hung_up[RS232_PORTNR];  /* see RS232_IsHungUp() */
 
-struct termios new_port_settings,
-       old_port_settings[RS232_PORTNR];
+static __thread struct termios new_port_settings;
+
+struct termios old_port_settings[RS232_PORTNR];
 
 char comports[RS232_PORTNR][100]={"/dev/ttyS0","/dev/ttyS1","/dev/ttyS2","/dev/ttyS3","/dev/ttyS4","/dev/ttyS5",
                        "/dev/ttyS6","/dev/ttyS7","/dev/ttyS8","/dev/ttyS9","/dev/ttyS10","/dev/ttyS11",
@@ -80,53 +96,18 @@ int RS232_OpenComport(int comport_number, int baudrate, const char *mode)
     return(1);
   }
   
-	// Detect the com port
-	if (comport_number == 0) {
-		char *portCommand = "ls /dev/ttyUSB* > comport.ini";
-		system(portCommand);
-		
-		int portFound = 0;
-		char portName[200];
-		FILE* portFile = fopen ("comport.ini" , "rb");
-		if (portFile != NULL) {
-			if (fscanf(portFile, "%s", portName) == 1) {
-				strncpy(comports[0], portName, 50);
-				printf("Found %s\n", portName);
-				portFound = 1;
-			}
-			fclose(portFile);
-		}
-		
-		if (portFound == 0) {
-			char *portCommand = "ls /dev/tty.wchusbserial* > comport.ini";
-			system(portCommand);
-			
-			char portName[200];
-			FILE* portFile = fopen ("comport.ini" , "rb");
-			if (portFile != NULL) {
-				if (fscanf(portFile, "%s", portName) == 1) {
-					strncpy(comports[0], portName, 50);
-					printf("Found %s\n", portName);
-					portFound = 1;
-				}
-				fclose(portFile);
-			}
-		}
-		
-		if (portFound == 0) {
-			char *portCommand = "ls /dev/tty.usbserial* > comport.ini";
-			system(portCommand);
-			
-			char portName[200];
-			FILE* portFile = fopen ("comport.ini" , "rb");
-			if (portFile != NULL) {
-				if (fscanf(portFile, "%s", portName) == 1) {
-					strncpy(comports[0], portName, 50);
-					printf("Found %s\n", portName);
-					portFound = 1;
-				}
-				fclose(portFile);
+	// Detect the com port, the first USB serial device that is there
+	if (comport_number == 0 && !port_name_set[0]) {
+		const char *patterns[] = {"/dev/ttyUSB*", "/dev/tty.wchusbserial*", "/dev/tty.usbserial*"};
+		for (int i = 0; i < 3; i++) {
+			glob_t found;
+			int ok = glob(patterns[i], 0, NULL, &found) == 0 && found.gl_pathc > 0;
+			if (ok) {
+				strncpy(comports[0], found.gl_pathv[0], 99);
+				printf("Found %s\n", comports[0]);
 			}
+			globfree(&found);
+			if (ok) break;
 		}
 	}
 
@@ -290,6 +271,7 @@ http://man7.org/linux/man-pages/man3/termios.3.html
     perror("unable to open comport ");
     return(1);
   }
+  hung_up[comport_number] = 0;
 
   /* lock access so that another process can't also use the port */
   if(flock(Cport[comport_number], LOCK_EX | LOCK_NB) != 0)
@@ -345,6 +327,11 @@ http://man7.org/linux/man-pages/man3/termios.3.html
 
   if(ioctl(Cport[comport_number], TIOCMGET, &status) == -1)
   {
+    if(errno == ENOTTY || errno == EINVAL)  /* pseudo-terminals have no modem lines */
+    {
+      trace_open_port(comport_number);
+      return(0);
+    }
     tcsetattr(Cport[comport_number], TCSANOW, old_port_settings + comport_number);
     flock(Cport[comport_number], LOCK_UN);  /* free the port so that others can use it. */
     perror("unable to get portstatus");
@@ -362,6 +349,7 @@ http://man7.org/linux/man-pages/man3/termios.3.html
     return(1);
   }
 
+  trace_open_port(comport_number);
   return(0);
 }
 
@@ -374,7 +362,14 @@ int RS232_PollComport(int comport_number, unsigned char *buf, int size)
 
   if(n < 0)
   {
-    if(errno == EAGAIN)  return 0;
+    if(errno != EAGAIN && errno != EINTR)  hung_up[comport_number] = 1;  /* EIO once the device is unplugged */
+    return 0;
+  }
+
+  if(n > 0)
+  {
+    __atomic_fetch_add(&bytes_received, n, __ATOMIC_RELAXED);
+    if(trace_hook != NULL)  trace_hook(RS232_TRACE_RECEIVED, buf, n);
   }
 
   return(n);
@@ -384,6 +379,11 @@ int RS232_PollComport(int comport_number, unsigned char *buf, int size)
 int RS232_SendByte(int comport_number, unsigned char byte)
 {
   int n = write(Cport[comport_number], &byte, 1);
+  if(n > 0)
+  {
+    __atomic_fetch_add(&bytes_sent, n, __ATOMIC_RELAXED);
+    if(trace_hook != NULL && !trace_cputs)  trace_hook(RS232_TRACE_SENT, &byte, 1);
+  }
   if(n < 0)
   {
     if(errno == EAGAIN)
@@ -392,6 +392,7 @@ int RS232_SendByte(int comport_number, unsigned char byte)
     }
     else
     {
+      hung_up[comport_number] = 1;  /* a hung up tty still reads as empty, but writes fail with EIO */
       return 1;
     }
   }
@@ -403,6 +404,11 @@ int RS232_SendByte(int comport_number, unsigned char byte)
 int RS232_SendBuf(int comport_number, unsigned char *buf, int size)
 {
   int n = write(Cport[comport_number], buf, size);
+  if(n > 0)
+  {
+    __atomic_fetch_add(&bytes_sent, n, __ATOMIC_RELAXED);
+    if(trace_hook != NULL)  trace_hook(RS232_TRACE_SENT, buf, n);
+  }
   if(n < 0)
   {
     if(errno == EAGAIN)
@@ -411,6 +417,7 @@ int RS232_SendBuf(int comport_number, unsigned char *buf, int size)
     }
     else
     {
+      hung_up[comport_number] = 1;  /* see RS232_SendByte() */
       return 1;
     }
   }
@@ -425,15 +432,17 @@ void RS232_CloseComport(int comport_number)
 
   if(ioctl(Cport[comport_number], TIOCMGET, &status) == -1)
   {
-    perror("unable to get portstatus");
+    if(errno != ENOTTY && errno != EINVAL && !hung_up[comport_number])  perror("unable to get portstatus");
   }
-
-  status &= ~TIOCM_DTR;    /* turn off DTR */
-  status &= ~TIOCM_RTS;    /* turn off RTS */
-
-  if(ioctl(Cport[comport_number], TIOCMSET, &status) == -1)
+  else
   {
-    perror("unable to set portstatus");
+    status &= ~TIOCM_DTR;    /* turn off DTR */
+    status &= ~TIOCM_RTS;    /* turn off RTS */
+
+    if(ioctl(Cport[comport_number], TIOCMSET, &status) == -1)
+    {
+      perror("unable to set portstatus");
+    }
   }
 
   tcsetattr(Cport[comport_number], TCSANOW, old_port_settings + comport_number);
@@ -585,16 +594,107 @@ void RS232_drain(int comport_number)
 {
   if(tcdrain(Cport[comport_number]) == -1)
   {
-    perror("unable to drain COM write buffer");
+    if(errno == EIO)  hung_up[comport_number] = 1;
+    else  perror("unable to drain COM write buffer");
   }
 }
 
+
+/* read the first line of dir/name into buf, returns 0 if there was one */
+static int read_attribute(const char *dir, const char *name, char *buf, int size)
+{
+  char path[PATH_MAX + 64];
+  FILE *file;
+  int ok;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  file = fopen(path, "r");
+  if(file == NULL)  return(1);
+  ok = fgets(buf, size, file) != NULL;
+  fclose(file);
+  if(!ok)  return(1);
+  buf[strcspn(buf, "\n")] = 0;
+  return(0);
+}
+
+
+static int compare_usb_ports(const void *a, const void *b)
+{
+  return(strcmp(((const struct RS232_usb *)a)->devname, ((const struct RS232_usb *)b)->devname));
+}
+
+
+/* fill ports with the ttys under sysfs/class/tty that sit on a USB device, sorted by name.
+   Only sysfs is read, no device is opened. Returns how many there are, or -1 without sysfs */
+int RS232_ListUSBPorts(const char *sysfs, struct RS232_usb *ports, int max)
+{
+  char classdir[PATH_MAX], path[PATH_MAX + 300], dir[PATH_MAX], line[128];
+  struct dirent *entry;
+  DIR *ttys;
+  FILE *uevent;
+  int count = 0;
+
+  snprintf(classdir, sizeof(classdir), "%s/class/tty", sysfs);
+  ttys = opendir(classdir);
+  if(ttys == NULL)  return(-1);
+
+  while((entry = readdir(ttys)) != NULL && count < max)
+  {
+    struct RS232_usb *port = &ports[count];
+    char *slash;
+    int depth, fits;
+
+    if(entry->d_name[0] == '.')  continue;
+
+    /* virtual terminals have no device, USB ones point somewhere below the USB device */
+    snprintf(path, sizeof(path), "%s/%s/device", classdir, entry->d_name);
+    if(realpath(path, dir) == NULL)  continue;
+
+    /* the USB device is the first parent with an idVendor, a few levels up at most */
+    for(depth = 0; depth < 4; depth++)
+    {
+      if(read_attribute(dir, "idVendor", line, sizeof(line)) == 0)  break;
+      slash = strrchr(dir, '/');
+      if(slash == NULL || slash == dir)  break;
+      *slash = 0;
+    }
+    if(read_attribute(dir, "idVendor", line, sizeof(line)))  continue;
+    port->vid = strtoul(line, NULL, 16);
+    if(read_attribute(dir, "idProduct", line, sizeof(line)))  continue;
+    port->pid = strtoul(line, NULL, 16);
+    if(read_attribute(dir, "product", port->product, sizeof(port->product)))  port->product[0] = 0;
+
+    /* the node is /dev/DEVNAME from the uevent, which is the entry name unless udev was told otherwise. */
+    /* a name that doesn't fit couldn't be opened, so that port is left out */
+    fits = snprintf(port->devname, sizeof(port->devname), "/dev/%s", entry->d_name) < (int) sizeof(port->devname);
+    snprintf(path, sizeof(path), "%s/%s/uevent", classdir, entry->d_name);
+    uevent = fopen(path, "r");
+    if(uevent != NULL)
+    {
+      while(fgets(line, sizeof(line), uevent) != NULL)
+      {
+        if(strncmp(line, "DEVNAME=", 8))  continue;
+        line[strcspn(line, "\n")] = 0;
+        fits = snprintf(port->devname, sizeof(port->devname), "/dev/%s", line + 8) < (int) sizeof(port->devname);
+      }
+      fclose(uevent);
+    }
+    if(fits)  count++;
+  }
+  closedir(ttys);
+
+  qsort(ports, count, sizeof(*ports), compare_usb_ports);
+  return(count);
+}
+
 #else  /* windows */
 
 #define RS232_PORTNR  30
 
 HANDLE Cport[RS232_PORTNR];
 
+static int hung_up[RS232_PORTNR];  /* never set, a vanished COM port just times out */
+
 
 char *comports[RS232_PORTNR]={"\\\\.\\COM1",  "\\\\.\\COM2",  "\\\\.\\COM3",  "\\\\.\\COM4",
                               "\\\\.\\COM5",  "\\\\.\\COM6",  "\\\\.\\COM7",  "\\\\.\\COM8",
@@ -758,6 +858,7 @@ http://technet.microsoft.com/en-us/library/cc732236.aspx
     return(1);
   }
 
+  trace_open_port(comport_number);
   return(0);
 }
 
@@ -771,6 +872,12 @@ int RS232_PollComport(int comport_number, unsigned char *buf, int size)
 
   ReadFile(Cport[comport_number], buf, size, (LPDWORD)((void *)&n), NULL);
 
+  if(n > 0)
+  {
+    __atomic_fetch_add(&bytes_received, n, __ATOMIC_RELAXED);
+    if(trace_hook != NULL)  trace_hook(RS232_TRACE_RECEIVED, buf, n);
+  }
+
   return(n);
 }
 
@@ -781,6 +888,12 @@ int RS232_SendByte(int comport_number, unsigned char byte)
 
   WriteFile(Cport[comport_number], &byte, 1, (LPDWORD)((void *)&n), NULL);
 
+  if(n > 0)
+  {
+    __atomic_fetch_add(&bytes_sent, n, __ATOMIC_RELAXED);
+    if(trace_hook != NULL && !trace_cputs)  trace_hook(RS232_TRACE_SENT, &byte, 1);
+  }
+
   if(n<0)  return(1);
 
   return(0);
@@ -793,6 +906,11 @@ int RS232_SendBuf(int comport_number, unsigned char *buf, int size)
 
   if(WriteFile(Cport[comport_number], buf, size, (LPDWORD)((void *)&n), NULL))
   {
+    if(n > 0)
+  {
+    __atomic_fetch_add(&bytes_sent, n, __ATOMIC_RELAXED);
+    if(trace_hook != NULL)  trace_hook(RS232_TRACE_SENT, buf, n);
+  }
     return(n);
   }
 
@@ -892,12 +1010,69 @@ void RS232_drain(int comport_number)
   FlushFileBuffers(Cport[comport_number]);
 }
 
+
+/* there is no sysfs, the COM ports are all there is */
+int RS232_ListUSBPorts(const char *sysfs, struct RS232_usb *ports, int max)
+{
+  return(-1);
+}
+
 #endif
 
 
 void RS232_cputs(int comport_number, const char *text)  /* sends a string to serial port */
 {
+  if(trace_hook != NULL)
+  {
+    trace_hook(RS232_TRACE_SENT, (const unsigned char *)text, strlen(text));
+    trace_cputs = 1;
+  }
+
   while(*text != 0)   RS232_SendByte(comport_number, *(text++));
+
+  trace_cputs = 0;
+}
+
+
+/* hook gets everything sent and received from now on, NULL stops it */
+void RS232_SetTrace(void (*hook)(int, const unsigned char *, int))
+{
+  trace_hook = hook;
+}
+
+
+/* bytes sent and received since the start, over all ports */
+void RS232_GetCounters(unsigned long *sent, unsigned long *received)
+{
+  *sent = __atomic_load_n(&bytes_sent, __ATOMIC_RELAXED);
+  *received = __atomic_load_n(&bytes_received, __ATOMIC_RELAXED);
+}
+
+
+static void trace_open_port(int comport_number)
+{
+  if(trace_hook != NULL)  trace_hook(RS232_TRACE_OPENED, (const unsigned char *)comports[comport_number], strlen(comports[comport_number]));
+}
+
+
+/* 1 once a read or write failed because the device went away, until the port is opened again */
+int RS232_IsHungUp(int comport_number)
+{
+  return(hung_up[comport_number]);
+}
+
+
+/* use devname as comport_number instead of the default name or detecting it, e.g. a pty of the emulator */
+void RS232_SetPortName(int comport_number, const char *devname)
+{
+  if((comport_number>=RS232_PORTNR)||(comport_number<0))  return;
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__APPLE__)
+  strncpy(comports[comport_number], devname, 99);
+  comports[comport_number][99] = 0;
+#else
+  comports[comport_number] = (char *)devname;
+#endif
+  port_name_set[comport_number] = 1;
 }
 
 
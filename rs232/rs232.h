@@ -60,6 +60,18 @@ extern "C" {
 
 #endif
 
+#define RS232_TRACE_SENT      0
+#define RS232_TRACE_RECEIVED  1
+#define RS232_TRACE_OPENED    2
+
+/* a tty on a USB device, see RS232_ListUSBPorts() */
+struct RS232_usb
+{
+  char devname[100];
+  unsigned short vid, pid;
+  char product[64];
+};
+
 int RS232_OpenComport(int, int, const char *);
 int RS232_PollComport(int, unsigned char *, int);
 int RS232_SendByte(int, unsigned char);
@@ -78,6 +90,11 @@ void RS232_flushTX(int);
 void RS232_flushRXTX(int);
 void RS232_drain(int);
 int RS232_GetPortnr(const char *);
+void RS232_SetPortName(int, const char *);
+int RS232_ListUSBPorts(const char *, struct RS232_usb *, int);
+void RS232_SetTrace(void (*)(int, const unsigned char *, int));
+void RS232_GetCounters(unsigned long *, unsigned long *);
+int RS232_IsHungUp(int);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -30,46 +30,57 @@
 
 #include <stdio.h>
 #include "setup.h"
+#include "dat.h"
+#include "stats.h"
+#include "probes.h"
 
 // COM Port settings (default)
 #include "rs232/rs232.h"
-int cport_nr = 7; // /dev/ttyS7 (COM8 on windows)
-int bdrate = 1000000; // 1,000,000 baud
-
-// Common vars
-uint8_t gbxcartFirmwareVersion = 0;
-uint8_t gbxcartPcbVersion = 0;
-uint8_t readBuffer[257];
-uint8_t writeBuffer[257];
-char optionSelected = 0;
-
-char gameTitle[17];
-uint16_t cartridgeType = 0;
-uint32_t currAddr = 0x0000;
-uint32_t endAddr = 0x7FFF;
-uint16_t romSize = 0;
-uint32_t romEndAddr = 0;
-uint16_t romBanks = 0;
-int ramSize = 0;
-uint16_t ramBanks = 0;
-uint32_t ramEndAddress = 0;
-int eepromSize = 0;
-uint16_t eepromEndAddress = 0;
-int hasFlashSave = 0;
-uint8_t cartridgeMode = GB_MODE;
-uint32_t bytesReadPrevious = 0;
-uint32_t ledStatus = 0;
-uint32_t ledCountLeft = 0;
-uint32_t ledCountRight = 0;
-uint8_t ledSegment = 0;
-uint8_t ledProgress = 0;
-uint8_t ledBlinking = 0;
-uint8_t headerCheckSumOk = 0;
-uint8_t fastReadEnabled = 0;
-uint32_t lastAddrHash = 0;
-uint8_t idBuffer[2];
-
-static const uint8_t nintendoLogoGBA[] = {0x24, 0xFF, 0xAE, 0x51, 0x69, 0x9A, 0xA2, 0x21, 0x3D, 0x84, 0x82, 0x0A, 0x84, 0xE4, 0x09, 0xAD,
+__thread int cport_nr = 7; // /dev/ttyS7 (COM8 on windows)
+__thread int bdrate = 1000000; // 1,000,000 baud
+const char *sysfs_root = "/sys"; // where com_test_port() looks for the GBxCart, NULL to try every port
+__thread int port_fixed = 0; // the port was given, com_test_port() doesn't look anywhere else
+
+// Common vars, every device thread has its own
+__thread uint8_t gbxcartFirmwareVersion = 0;
+__thread uint8_t gbxcartPcbVersion = 0;
+__thread uint8_t readBuffer[257];
+__thread uint8_t writeBuffer[257];
+__thread char optionSelected = 0;
+
+__thread char gameTitle[17];
+__thread uint16_t cartridgeType = 0;
+__thread uint32_t currAddr = 0x0000;
+__thread uint32_t endAddr = 0x7FFF;
+__thread uint16_t romSize = 0;
+__thread uint32_t romEndAddr = 0;
+__thread uint16_t romBanks = 0;
+__thread int ramSize = 0;
+__thread uint16_t ramBanks = 0;
+__thread uint32_t ramEndAddress = 0;
+__thread int eepromSize = 0;
+__thread uint16_t eepromEndAddress = 0;
+__thread int hasFlashSave = 0;
+__thread uint8_t cartridgeMode = GB_MODE;
+__thread uint32_t bytesReadPrevious = 0;
+__thread uint32_t ledStatus = 0;
+__thread uint32_t ledCountLeft = 0;
+__thread uint32_t ledCountRight = 0;
+__thread uint8_t ledSegment = 0;
+__thread uint8_t ledProgress = 0;
+__thread uint8_t ledBlinking = 0;
+uint8_t ledsEnabled = 1;
+static __thread uint8_t ledPending = 0;		// ledStatus changed since it was last sent
+static __thread uint64_t ledLastUpdate = 0;	// us
+__thread uint8_t headerCheckSumOk = 0;
+__thread uint8_t fastReadEnabled = 0;
+__thread uint32_t lastAddrHash = 0;
+__thread uint8_t idBuffer[2];
+uint64_t sleepTimeNs = 0;
+uint32_t sleepCount = 0;
+__thread uint8_t transferAborted = 0;
+
+const uint8_t nintendoLogoGBA[] = {0x24, 0xFF, 0xAE, 0x51, 0x69, 0x9A, 0xA2, 0x21, 0x3D, 0x84, 0x82, 0x0A, 0x84, 0xE4, 0x09, 0xAD,
 										0x11, 0x24, 0x8B, 0x98, 0xC0, 0x81, 0x7F, 0x21, 0xA3, 0x52, 0xBE, 0x19, 0x93, 0x09, 0xCE, 0x20,
 										0x10, 0x46, 0x4A, 0x4A, 0xF8, 0x27, 0x31, 0xEC, 0x58, 0xC7, 0xE8, 0x33, 0x82, 0xE3, 0xCE, 0xBF, 
 										0x85, 0xF4, 0xDF, 0x94, 0xCE, 0x4B, 0x09, 0xC1, 0x94, 0x56, 0x8A, 0xC0, 0x13, 0x72, 0xA7, 0xFC, 
@@ -149,10 +160,16 @@ void delay_ms(uint16_t ms) {
 	#if defined (_WIN32)
 		Sleep(ms);
 	#else
-		struct timespec ts;
+		struct timespec ts, start, end;
 		ts.tv_sec = ms / 1000;
 		ts.tv_nsec = (ms * 1000000) % 1000000000;
+		clock_gettime(CLOCK_MONOTONIC, &start);
 		nanosleep(&ts, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		
+		// Keep track of the time spent sleeping for the benchmark
+		__atomic_fetch_add(&sleepTimeNs, (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&sleepCount, 1, __ATOMIC_RELAXED);
 	#endif
 }
 
@@ -186,10 +203,10 @@ void print_progress_percent (uint32_t bytesRead, uint32_t hashNumber) {
 	}
 }
 
-// Print progress
+// Work out the LED progress, nothing is sent to the cart here as this is called between blocks
 void led_progress_percent (uint32_t bytesRead, uint32_t divideNumber) {
-	if (gbxcartPcbVersion == GBXMAS) {
-		if (bytesRead >= bytesReadPrevious) {
+	if (gbxcartPcbVersion == GBXMAS && ledsEnabled && divideNumber > 0) {
+		while (bytesRead >= bytesReadPrevious && ledProgress < 28) {
 			bytesReadPrevious += divideNumber;
 			
 			if (ledSegment == 0) {
@@ -202,7 +219,6 @@ void led_progress_percent (uint32_t bytesRead, uint32_t divideNumber) {
 				ledStatus |= (1<<(ledCountRight+14));
 				ledCountRight++;
 			}
-			xmas_set_leds(ledStatus);
 			
 			if (ledBlinking <= 14) {
 				ledBlinking = ledBlinking + 14;
@@ -210,16 +226,28 @@ void led_progress_percent (uint32_t bytesRead, uint32_t divideNumber) {
 			else {
 				ledBlinking = ledBlinking - 13;
 			}
-			
-			if (ledProgress < 27) {
-				xmas_blink_led(ledBlinking);
-			}
 			ledProgress++;
+			ledPending = 1;
 		}
 	}
 }
 
+// Send the LED progress to the cart, only call this where no data is streaming (between banks or after a transfer).
+// Updates are limited to one per LED_UPDATE_INTERVAL unless force is set
+void led_update (uint8_t force) {
+	uint64_t now = stats_time();
+	if (!ledPending || (!force && now - ledLastUpdate < LED_UPDATE_INTERVAL)) return;
+	
+	xmas_set_leds(ledStatus);
+	if (ledProgress < 28) {
+		xmas_blink_led(ledBlinking);
+	}
+	ledPending = 0;
+	ledLastUpdate = now;
+}
+
 void xmas_set_leds (uint32_t value) {
+	if (!ledsEnabled) return;
 	if (optionSelected == 3) { // When writing, we need to break out of any commands the PC may have sent
 		set_mode('0');
 		delay_ms(5);
@@ -231,6 +259,7 @@ void xmas_set_leds (uint32_t value) {
 }
 
 void xmas_blink_led (uint8_t value) {
+	if (!ledsEnabled) return;
 	if (optionSelected == 3) { // When writing, we need to break out of any commands the PC may have sent
 		set_mode('0');
 		delay_ms(5);
@@ -249,6 +278,7 @@ void xmas_reset_values (void) {
 	ledSegment = 0;
 	ledProgress = 0;
 	ledBlinking = 0;
+	ledPending = 0;
 	bytesReadPrevious = 0;
 }
 
@@ -260,24 +290,28 @@ void xmas_wake_up (void) {
 }
 
 void xmas_setup (uint32_t progressNumber) {
-	if (gbxcartPcbVersion == GBXMAS) {
+	if (gbxcartPcbVersion == GBXMAS && ledsEnabled) {
 		xmas_wake_up();
 		xmas_reset_values();
 		xmas_set_leds(0);
 		ledBlinking = 1;
 		xmas_blink_led(ledBlinking);
 		bytesReadPrevious = progressNumber;
+		ledLastUpdate = stats_time();
 	}
 }
 
+// Called when a transfer ends, so the GBXMAS progress catches up here too
 void gbx_set_done_led (void) {
-	if ((gbxcartPcbVersion >= PCB_1_4 && gbxcartPcbVersion < GBXMAS)) {
+	led_update(1);
+	if ((gbxcartPcbVersion >= PCB_1_4 && gbxcartPcbVersion < GBXMAS) && ledsEnabled) {
 		set_mode(DONE_LED_ON);
 	}
 }
 
 void gbx_set_error_led (void) {
-	if ((gbxcartPcbVersion >= PCB_1_4 && gbxcartPcbVersion < GBXMAS)) {
+	led_update(1);
+	if ((gbxcartPcbVersion >= PCB_1_4 && gbxcartPcbVersion < GBXMAS) && ledsEnabled) {
 		set_mode(ERROR_LED_ON);
 	}
 }
@@ -307,8 +341,10 @@ void gbx_cart_power_down (void) {
 void com_wait_for_ack (void) {
 	uint8_t buffer[2];
 	uint8_t rxBytes = 0;
+	uint32_t polls = 0;
 	
-	while (rxBytes < 1) {
+	PROBE(ack_start);
+	while (rxBytes < 1 && !transferAborted) {
 		rxBytes = RS232_PollComport(cport_nr, buffer, 1);
 		
 		if (rxBytes > 0) {
@@ -317,7 +353,15 @@ void com_wait_for_ack (void) {
 			}
 			rxBytes = 0;
 		}
+		else if (++polls > 20000) { // Nothing for a while, keep waiting in 1ms steps up to ACK_TIMEOUT
+			delay_ms(1);
+			if (polls > 20000 + ACK_TIMEOUT || RS232_IsHungUp(cport_nr)) {
+				stats_add(STAT_TIMEOUTS, 1);
+				transferAborted = 1;
+			}
+		}
 	}
+	PROBE(ack_done);
 }
 
 // Stop reading blocks of data
@@ -338,40 +382,81 @@ void com_read_cont() {
 	}
 }
 
-// Test opening the COM port, if can't be open, try autodetecting device on other COM ports
-uint8_t com_test_port(void) {
-	bdrate = 1000000; // Default
-	
-	// Check if COM port responds correctly
-	if (RS232_OpenComport(cport_nr, bdrate, "8N1") == 0) { // Port opened
+// USB serial chips the GBxCart is built with, a product string is matched as a substring
+static const struct {
+	uint16_t vid, pid;
+	const char *product;
+} gbxcartIds[] = {
+	{0x1a86, 0x7523, NULL},		// CH340, GBxCart RW v1.x
+	{0x1a86, 0x5523, NULL},		// CH341
+	{0, 0, "GBxCart"},
+};
+
+static int is_gbxcart(const struct RS232_usb *port) {
+	for (size_t i = 0; i < sizeof(gbxcartIds) / sizeof(gbxcartIds[0]); i++) {
+		if (gbxcartIds[i].product ? strstr(port->product, gbxcartIds[i].product) != NULL :
+				port->vid == gbxcartIds[i].vid && port->pid == gbxcartIds[i].pid) return 1;
+	}
+	return 0;
+}
+
+int com_list_gbxcarts(struct RS232_usb *ports, int max) {
+	struct RS232_usb all[16];
+	int count = 0, total = sysfs_root ? RS232_ListUSBPorts(sysfs_root, all, 16) : -1;
+	for (int i = 0; i < total && count < max; i++) {
+		if (is_gbxcart(&all[i])) ports[count++] = all[i];
+	}
+	return total < 0 ? -1 : count;
+}
+
+// Open port at 1M and then at 1.7M baud until the GBxCart answers, returns 1 when it did
+static uint8_t probe_port(int port) {
+	int rates[] = {1000000, 1700000};
+	for (int i = 0; i < 2; i++) {
+		bdrate = rates[i];
+		if (RS232_OpenComport(port, bdrate, "8N1") != 0) break;	// not there, the other rate won't help
 		set_mode('0');
-		RS232_flushRX(cport_nr);
+		RS232_flushRX(port);
 		
 		uint8_t cartridgeMode = request_value(CART_MODE);
-		
-		// Responded ok
 		if (cartridgeMode == GB_MODE || cartridgeMode == GBA_MODE) {
 			return 1;
 		}
-		else {
-			RS232_CloseComport(cport_nr);
-			
-			bdrate = 1700000; // Try 1.7M
-			if (RS232_OpenComport(cport_nr, bdrate, "8N1") == 0) { // Port opened
-				set_mode('0');
-				RS232_flushRX(cport_nr);
-				uint8_t cartridgeMode = request_value(CART_MODE);
-				
-				// Responded ok
-				if (cartridgeMode == GB_MODE || cartridgeMode == GBA_MODE) {
+		RS232_CloseComport(port);
+	}
+	bdrate = 1000000;
+	return 0;
+}
+
+// Test opening the COM port, if can't be open, try autodetecting device on other COM ports
+uint8_t com_test_port(void) {
+	bdrate = 1000000; // Default
+	
+	// Only talk to the USB serial devices that look like a GBxCart, sysfs says which ones those are
+	if (!port_fixed) {
+		struct RS232_usb ports[16];
+		int count = com_list_gbxcarts(ports, 16);
+		if (count >= 0) {
+			for (int i = 0; i < count; i++) {
+				cport_nr = 0;
+				RS232_SetPortName(cport_nr, ports[i].devname);
+				if (probe_port(cport_nr)) {
+					printf("Found %s\n", ports[i].devname);
 					return 1;
 				}
 			}
-			
-			bdrate = 1000000;
+			return 0;
 		}
 	}
 	
+	// Check if COM port responds correctly
+	if (probe_port(cport_nr)) {
+		return 1;
+	}
+	if (port_fixed) {
+		return 0;
+	}
+	
 	// If port didn't get opened or responded wrong
 	for (uint8_t x = 0; x <= RS232_PORTNR; x++) {
 		//printf("Trying port %i\n", x);
@@ -410,7 +495,12 @@ uint16_t com_read_bytes (FILE *file, int count) {
 	uint8_t buffer[257];
 	uint16_t rxBytes = 0;
 	uint16_t readBytes = 0;
+	uint64_t start = stats_time();
 	
+	if (transferAborted) {
+		return 0;
+	}
+	PROBE1(block_start, count);
 	#if defined(__APPLE__)
 	uint8_t timeout = 0;
 	#else
@@ -432,11 +522,18 @@ uint16_t com_read_bytes (FILE *file, int count) {
 			
 			readBytes += rxBytes;
 		}
+		else if (RS232_IsHungUp(cport_nr)) { // The GBxCart was unplugged, nothing more will come
+			transferAborted = 1;
+			PROBE2(block_done, readBytes, count);
+			return readBytes;
+		}
 		#if defined(__APPLE__)
 		else {
 			delay_ms(5);
 			timeout++;
 			if (timeout >= 50) {
+				stats_add(STAT_TIMEOUTS, 1);
+				PROBE2(block_done, readBytes, count);
 				return readBytes;
 			}
 		}
@@ -444,14 +541,105 @@ uint16_t com_read_bytes (FILE *file, int count) {
 		else {
 			timeout++;
 			if (timeout >= 20000) {
+				stats_add(STAT_TIMEOUTS, 1);
+				PROBE2(block_done, readBytes, count);
 				return readBytes;
 			}
 		}
 		#endif
 	}
+	stats_latency(LAT_BLOCK, start);
+	PROBE2(block_done, readBytes, count);
 	return readBytes;
 }
 
+// Drop whatever is still arriving, returns once the line has been quiet for a few ms
+void com_flush_rx(void) {
+	uint8_t buffer[257];
+	uint8_t quiet = 0;
+	
+	while (quiet < 3) {
+		if (RS232_PollComport(cport_nr, buffer, 256) > 0) {
+			quiet = 0;
+		}
+		else {
+			delay_ms(1);
+			quiet++;
+		}
+	}
+}
+
+// Request a single block again after a short read. The block is read twice and only taken when both reads agree,
+// the stream is left waiting after it so the caller continues with com_read_cont() as usual.
+uint8_t com_read_block_again(uint32_t address, uint8_t mode, int count) {
+	uint8_t first[257];
+	uint8_t mismatches = 0;
+	uint8_t timeouts = 0;
+	
+	if (transferAborted) {
+		return 1;
+	}
+	stats_add(STAT_RETRIES, 1);
+	for (uint16_t attempt = 0; ; attempt++) {
+		com_read_stop();
+		com_flush_rx();
+		if (attempt > 0) {
+			delay_ms(attempt < 6 ? 1 << attempt : 64); // Back off a little if the link stays bad
+		}
+		
+		set_number(address, SET_START_ADDRESS);
+		set_mode(mode);
+		if (com_read_bytes(READ_BUFFER, count) != count) {
+			if (++timeouts >= BLOCK_READ_TIMEOUTS) { // Nothing is coming back, the cartridge or the GBxCart is gone
+				transferAborted = 1;
+				return 1;
+			}
+			continue;
+		}
+		memcpy(first, readBuffer, count);
+		
+		com_read_stop();
+		set_number(address, SET_START_ADDRESS);
+		set_mode(mode);
+		if (com_read_bytes(READ_BUFFER, count) != count) {
+			if (++timeouts >= BLOCK_READ_TIMEOUTS) { // Nothing is coming back, the cartridge or the GBxCart is gone
+				transferAborted = 1;
+				return 1;
+			}
+			continue;
+		}
+		if (memcmp(first, readBuffer, count) == 0) {
+			return 0;
+		}
+		if (++mismatches >= BLOCK_READ_MISMATCHES) {
+			return 1;
+		}
+	}
+}
+
+// Read length bytes from the start of the ROM into buffer, each block is requested again on its own when it comes in short
+static void read_rom_start(uint8_t *buffer, uint16_t length, uint8_t mode, uint8_t shift, uint8_t verify) {
+	currAddr = 0x0000;
+	if (!verify) {
+		set_number(currAddr, SET_START_ADDRESS);
+		set_mode(mode);
+	}
+	
+	while (currAddr < length) {
+		if (verify || com_read_bytes(READ_BUFFER, 64) != 64) { // Didn't receive 64 bytes, usually this only happens for Apple MACs
+			com_read_block_again(currAddr >> shift, mode, 64);
+		}
+		memcpy(&buffer[currAddr], readBuffer, 64);
+		currAddr += 64;
+		
+		// Request 64 bytes more
+		if (currAddr < length && !verify) {
+			com_read_cont();
+		}
+	}
+	com_read_stop();
+}
+
 // Read 1-256 bytes from the file (or buffer) and write it the COM port with the command given
 void com_write_bytes_from_file(uint8_t command, FILE *file, int count) {
 	uint8_t buffer[257];
@@ -499,6 +687,7 @@ void set_mode (char command) {
 	
 	RS232_cputs(cport_nr, modeString);
 	RS232_drain(cport_nr);
+	PROBE1(mode_send, command);
 	
 	delay_ms(1);
 	
@@ -515,6 +704,7 @@ void set_number (uint32_t number, uint8_t command) {
 	RS232_cputs(cport_nr, numberString);
 	RS232_SendByte(cport_nr, 0);
 	RS232_drain(cport_nr);
+	PROBE2(number_send, command, number);
 	delay_ms(1);
 	
 	//printf("%s\n", numberString);
@@ -543,6 +733,7 @@ uint8_t read_cartridge_mode (void) {
 
 // Send 1 byte and read 1 byte
 uint8_t request_value (uint8_t command) {
+	uint64_t start = stats_time();
 	set_mode(command);
 	
 	uint8_t buffer[2];
@@ -553,13 +744,18 @@ uint8_t request_value (uint8_t command) {
 		rxBytes = RS232_PollComport(cport_nr, buffer, 1);
 		
 		if (rxBytes > 0) {
+			stats_latency(LAT_REQUEST, start);
 			return buffer[0];
 		}
 		
+		if (RS232_IsHungUp(cport_nr)) {
+			return 0;
+		}
 		delay_ms(10);
 		timeoutCounter++;
 		//printf(".");
 		if (timeoutCounter >= 25) { // After 250ms, timeout
+			stats_add(STAT_TIMEOUTS, 1);
 			return 0;
 		}
 	}
@@ -573,7 +769,9 @@ uint8_t request_value (uint8_t command) {
 
 // Set bank for ROM/RAM switching, send address first and then bank number
 void set_bank (uint16_t address, uint8_t bank) {
+	uint64_t start = stats_time();
 	char AddrString[15];
+	PROBE2(bank_start, address, bank);
 	sprintf(AddrString, "%c%x", SET_BANK, address);
 	RS232_cputs(cport_nr, AddrString);
 	RS232_SendByte(cport_nr, 0);
@@ -586,6 +784,8 @@ void set_bank (uint16_t address, uint8_t bank) {
 	RS232_SendByte(cport_nr, 0);
 	RS232_drain(cport_nr);
 	delay_ms(5);
+	stats_latency(LAT_BANK, start);
+	PROBE2(bank_done, address, bank);
 }
 
 // MBC2 Fix (unknown why this fixes reading the ram, maybe has to read ROM before RAM?)
@@ -609,38 +809,17 @@ void mbc2_fix (void) {
 
 // Read the first 384 bytes of ROM and process the Gameboy header information
 int read_gb_header (void) {
-	currAddr = 0x0000;
-	endAddr = 0x0180;
-	
-	set_number(currAddr, SET_START_ADDRESS);
-	set_mode(READ_ROM_RAM);
-	
 	uint8_t startRomBuffer[385];
-	while (currAddr < endAddr) {
-		uint8_t comReadBytes = com_read_bytes(READ_BUFFER, 64);
-		
-		if (comReadBytes == 64) {
-			memcpy(&startRomBuffer[currAddr], readBuffer, 64);
-			currAddr += 64;
-			
-			// Request 64 bytes more
-			if (currAddr < endAddr) {
-				com_read_cont();
-			}
-		}
-		else { // Didn't receive 64 bytes, usually this only happens for Apple MACs
-			com_read_stop();
-			delay_ms(500);
-			
-			// Flush buffer
-			RS232_PollComport(cport_nr, readBuffer, 64);											
-			
-			// Start off where we left off
-			set_number(currAddr, SET_START_ADDRESS);
-			set_mode(READ_ROM_RAM);				
-		}
+	read_rom_start(startRomBuffer, 0x0180, READ_ROM_RAM, 0, 0);
+	
+	// A header that fails its checksum is read again block by block before trusting it
+	uint8_t romCheckSum = 0;
+	for (uint16_t x = 0x0134; x <= 0x014C; x++) {
+		romCheckSum = romCheckSum - startRomBuffer[x] - 1;
+	}
+	if (romCheckSum != startRomBuffer[0x14D]) {
+		read_rom_start(startRomBuffer, 0x0180, READ_ROM_RAM, 0, 1);
 	}
-	com_read_stop();
 	
 	// Blank out game title
 	for (uint8_t b = 0; b < 16; b++) {
@@ -775,7 +954,7 @@ int read_gb_header (void) {
 	}
 	
 	// Header checksum check
-	uint8_t romCheckSum = 0;
+	romCheckSum = 0;
 	for (uint16_t x = 0x0134; x <= 0x014C; x++) {
 		romCheckSum = romCheckSum - startRomBuffer[x] - 1;
 	}
@@ -1479,36 +1658,16 @@ int read_gba_header (void) {
 	uint8_t logoCheck = 0;
 	uint8_t startRomBuffer[385];
 	
-	currAddr = 0x0000;
-	endAddr = 0x00BF;
-	set_number(currAddr, SET_START_ADDRESS);
-	set_mode(GBA_READ_ROM);
+	read_rom_start(startRomBuffer, 0x00C0, GBA_READ_ROM, 1, 0);
 	
-	while (currAddr < endAddr) {
-		uint8_t comReadBytes = com_read_bytes(READ_BUFFER, 64);
-		
-		if (comReadBytes == 64) {
-			memcpy(&startRomBuffer[currAddr], readBuffer, 64);
-			currAddr += 64;
-			
-			// Request 64 bytes more
-			if (currAddr < endAddr) {
-				com_read_cont();
-			}
-		}
-		else { // Didn't receive 64 bytes, usually this only happens for Apple MACs
-			com_read_stop();
-			delay_ms(500);
-			
-			// Flush buffer
-			RS232_PollComport(cport_nr, readBuffer, 64);											
-			
-			// Start off where we left off
-			set_number(currAddr / 2, SET_START_ADDRESS);
-			set_mode(GBA_READ_ROM);	
-		}
+	// Same for the GBA header complement check
+	uint8_t complement = 0;
+	for (uint16_t x = 0xA0; x <= 0xBC; x++) {
+		complement = complement - startRomBuffer[x];
+	}
+	if ((uint8_t) (complement - 0x19) != startRomBuffer[0xBD]) {
+		read_rom_start(startRomBuffer, 0x00C0, GBA_READ_ROM, 1, 1);
 	}
-	com_read_stop();
 	
 	logoCheck = 1;
 	for (uint16_t logoAddress = 0x04; logoAddress <= 0x9F; logoAddress++) {
@@ -1547,32 +1706,51 @@ int read_gba_header (void) {
 	if (logoCheck == 1) {
 		printf ("OK\n");
 		
-		// ROM size
-		printf ("Calculating ROM size");
-		romSize = gba_check_rom_size();
-		
-		// EEPROM check
-		ramSize = 0;
-		printf ("\nChecking for EEPROM");
-		
-		// Check if we have a Intel flash cart, if so, skip the EEPROM check as it can interfer with reading the last 2MB of the ROM
-		if (gbxcartFirmwareVersion >= 10) {
-			if (gba_detect_intel_flash_cart() == FLASH_FOUND_INTEL) {
-				printf("... Skipping, Intel Flash cart detected");
-				eepromSize = 0;
+		// A DAT entry with a save type tells us everything the checks below would find out
+		const struct dat_entry *known = dat_find_layout((char *) &startRomBuffer[0xAC]);
+		if (known != NULL && known->saveType != DAT_SAVE_UNKNOWN) {
+			printf ("Found in DAT: %s", dat_name(known));
+			romSize = (known->size + 0xFFFFF) >> 20;
+			ramSize = 0;
+			eepromSize = EEPROM_NONE;
+			hasFlashSave = NOT_CHECKED;
+			switch (known->saveType) {
+				case DAT_SAVE_SRAM_256K: ramSize = SRAM_FLASH_256KBIT; break;
+				case DAT_SAVE_SRAM_512K: ramSize = SRAM_FLASH_512KBIT; break;
+				case DAT_SAVE_FLASH_512K: ramSize = SRAM_FLASH_512KBIT; break;
+				case DAT_SAVE_FLASH_1M: ramSize = SRAM_FLASH_1MBIT; hasFlashSave = FLASH_FOUND; break;
+				case DAT_SAVE_EEPROM_4K: eepromSize = EEPROM_4KBIT; break;
+				case DAT_SAVE_EEPROM_64K: eepromSize = EEPROM_64KBIT; break;
+			}
+		}
+		else {
+			// ROM size
+			printf ("Calculating ROM size");
+			romSize = gba_check_rom_size();
+		
+			// EEPROM check
+			ramSize = 0;
+			printf ("\nChecking for EEPROM");
+		
+			// Check if we have a Intel flash cart, if so, skip the EEPROM check as it can interfer with reading the last 2MB of the ROM
+			if (gbxcartFirmwareVersion >= 10) {
+				if (gba_detect_intel_flash_cart() == FLASH_FOUND_INTEL) {
+					printf("... Skipping, Intel Flash cart detected");
+					eepromSize = 0;
+				}
+				else {
+					eepromSize = gba_check_eeprom();
+				}
 			}
 			else {
 				eepromSize = gba_check_eeprom();
 			}
-		}
-		else {
-			eepromSize = gba_check_eeprom();
-		}
 		
-		// SRAM/Flash check/size, if no EEPROM present
-		if (eepromSize == 0 && ramSize == 0) {
-			printf ("\nCalculating SRAM/Flash size");
-			ramSize = gba_check_sram_flash();
+			// SRAM/Flash check/size, if no EEPROM present
+			if (eepromSize == 0 && ramSize == 0) {
+				printf ("\nCalculating SRAM/Flash size");
+				ramSize = gba_check_sram_flash();
+			}
 		}
 		
 		// If file exists, we know the ram has been erased before, so read memory info from this file
@@ -1581,6 +1759,9 @@ int read_gba_header (void) {
 		// Print out
 		printf ("\nROM size: %iMByte\n", romSize);
 		romEndAddr = ((1024 * 1024) * romSize);
+		if (known != NULL && known->saveType != DAT_SAVE_UNKNOWN) {
+			romEndAddr = known->size;
+		}
 		
 		if (hasFlashSave >= 2) {
 			printf("Flash size: ");
@@ -25,8 +25,10 @@
 
 // COM Port settings (default)
 #include "rs232/rs232.h"
-extern int cport_nr;
-extern int bdrate;
+extern __thread int cport_nr;
+extern __thread int bdrate;
+extern const char *sysfs_root;
+extern __thread int port_fixed;
 extern char *comports[200];
 
 #define CART_MODE 'C'
@@ -141,33 +143,48 @@ extern char *comports[200];
 
 // Common vars
 #define READ_BUFFER 0
-
-extern uint8_t gbxcartFirmwareVersion;
-extern uint8_t gbxcartPcbVersion;
-extern uint8_t readBuffer[257];
-extern uint8_t writeBuffer[257];
-extern char optionSelected;
-
-extern char gameTitle[17];
-extern uint16_t cartridgeType;
-extern uint32_t currAddr;
-extern uint32_t endAddr;
-extern uint16_t romSize;
-extern uint32_t romEndAddr;
-extern uint16_t romBanks;
-extern int ramSize;
-extern uint16_t ramBanks;
-extern uint32_t ramEndAddress;
-extern int eepromSize;
-extern uint16_t eepromEndAddress;
-extern int hasFlashSave;
-extern uint8_t cartridgeMode;
-extern uint32_t bytesReadPrevious;
-extern uint8_t ledBlinking;
-extern uint8_t ledProgress;
-extern uint8_t headerCheckSumOk;
-extern uint8_t fastReadEnabled;
-extern uint32_t lastAddrHash;
+#define LED_UPDATE_INTERVAL 1000000	// us between GBXMAS progress updates
+#define BLOCK_READ_MISMATCHES 8
+#define BLOCK_READ_TIMEOUTS 8		// short reads of one block before the transfer is given up
+#define ACK_TIMEOUT 1000			// ms
+
+// The link and the cartridge in it. Every GBxCart is driven by a thread of its own, so each one has a copy
+extern __thread uint8_t gbxcartFirmwareVersion;
+extern __thread uint8_t gbxcartPcbVersion;
+extern __thread uint8_t readBuffer[257];
+extern __thread uint8_t writeBuffer[257];
+extern __thread char optionSelected;
+
+extern __thread char gameTitle[17];
+extern __thread uint16_t cartridgeType;
+extern __thread uint32_t currAddr;
+extern __thread uint32_t endAddr;
+extern __thread uint16_t romSize;
+extern __thread uint32_t romEndAddr;
+extern __thread uint16_t romBanks;
+extern __thread int ramSize;
+extern __thread uint16_t ramBanks;
+extern __thread uint32_t ramEndAddress;
+extern __thread int eepromSize;
+extern __thread uint16_t eepromEndAddress;
+extern __thread int hasFlashSave;
+extern __thread uint8_t cartridgeMode;
+extern __thread uint32_t bytesReadPrevious;
+extern __thread uint8_t ledBlinking;
+extern __thread uint8_t ledProgress;
+extern uint8_t ledsEnabled;
+extern __thread uint8_t headerCheckSumOk;
+extern __thread uint8_t fastReadEnabled;
+extern __thread uint32_t lastAddrHash;
+extern const uint8_t nintendoLogoGBA[156];
+
+// Total time spent in delay_ms() and the number of calls, over all device threads
+extern uint64_t sleepTimeNs;
+extern uint32_t sleepCount;
+
+// Set when the cartridge stopped answering in the middle of a transfer. Reads and waits give up at once
+// until it is cleared, so the transfer runs to its end quickly and the caller can check it afterwards
+extern __thread uint8_t transferAborted;
 
 // Read the config.ini file for the COM port to use and baud rate
 void read_config(void);
@@ -190,6 +207,7 @@ char read_one_letter(void);
 void print_progress_percent(uint32_t bytesRead, uint32_t hashNumber);
 
 void led_progress_percent (uint32_t bytesRead, uint32_t hashNumber);
+void led_update (uint8_t force);
 void xmas_set_leds (uint32_t value);
 void xmas_blink_led (uint8_t value);
 void xmas_reset_values (void);
@@ -213,6 +231,9 @@ void com_read_cont(void);
 // Test opening the COM port,if can't be open, try autodetecting device on other COM ports
 uint8_t com_test_port(void);
 
+// The USB serial devices in sysfs_root that look like a GBxCart, returns how many or -1 without sysfs
+int com_list_gbxcarts(struct RS232_usb *ports, int max);
+
 // Check if OS can support the faster reading
 void fast_reading_check(void);
 
@@ -222,6 +243,13 @@ void fast_reading_check(void);
 // We expect no more than 64 bytes.
 uint16_t com_read_bytes(FILE *file, int count);
 
+// Drop whatever is still arriving on the COM port
+void com_flush_rx(void);
+
+// Request a single block again after a short read, it is read twice and only taken when both reads agree.
+// Returns 0 with the block in the global read buffer, 1 if the reads kept differing (the last one is kept).
+uint8_t com_read_block_again(uint32_t address, uint8_t mode, int count);
+
 // Read 1-128 bytes from the file (or buffer) and write it the COM port with the command given
 void com_write_bytes_from_file(uint8_t command, FILE *file, int count);
 
@@ -0,0 +1,204 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ Every thread counts into its own block, found through a thread local pointer, so recording is a plain
+ add without locks or shared cache lines. The blocks are never freed: when a thread exits its block is
+ marked unused and the next new thread takes it over and keeps adding to it, so the totals stay right.
+ stats_format() walks the list and sums the blocks with relaxed loads.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+#include "setup.h"
+
+#define STATS_BUCKETS 25		// bucket i counts latencies below 2^i us, the last one everything slower
+
+struct stats_thread {
+	uint64_t counters[STAT_COUNTERS];
+	uint64_t count[LAT_COUNT];
+	uint64_t sum[LAT_COUNT];		// us
+	uint64_t buckets[LAT_COUNT][STATS_BUCKETS];
+	int used;
+	struct stats_thread *next;
+};
+
+static struct stats_thread *threads;
+static __thread struct stats_thread *mine;
+static pthread_key_t threadKey;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+
+static const char *latencyNames[LAT_COUNT] = {"request", "block", "bank", "fuse.lookup", "fuse.getattr",
+	"fuse.readdir", "fuse.open", "fuse.read", "fuse.write", "fuse.xattr"};
+
+// Dump progress of every device, stats_format() adds them up
+static struct stats_progress *progressList;
+
+static uint64_t startTime;
+
+static void release_thread(void *ptr) {
+	struct stats_thread *s = ptr;
+	__atomic_store_n(&s->used, 0, __ATOMIC_RELEASE);
+}
+
+static void make_key(void) {
+	pthread_key_create(&threadKey, release_thread);
+	startTime = stats_time();
+}
+
+static struct stats_thread *local(void) {
+	struct stats_thread *s;
+	if (mine) return mine;
+
+	pthread_once(&keyOnce, make_key);
+	for (s = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); s; s = s->next) {
+		int unused = 0;
+		if (__atomic_compare_exchange_n(&s->used, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+	}
+	if (s == NULL) {
+		s = calloc(1, sizeof(*s));
+		if (s == NULL) return NULL;
+		s->used = 1;
+		s->next = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&threads, &s->next, s, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	pthread_setspecific(threadKey, s);
+	mine = s;
+	return s;
+}
+
+// Only the owner writes, readers may see the old or the new value but never a torn one
+static void add(uint64_t *value, uint64_t n) {
+	__atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t *value) {
+	return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+void stats_add(int counter, uint64_t n) {
+	struct stats_thread *s = local();
+	if (s) add(&s->counters[counter], n);
+}
+
+uint64_t stats_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+void stats_latency(int histogram, uint64_t start) {
+	struct stats_thread *s = local();
+	uint64_t us = stats_time() - start;
+	int bucket = 0;
+	if (s == NULL) return;
+
+	while (bucket < STATS_BUCKETS - 1 && us >= (1ULL << bucket)) bucket++;
+	add(&s->count[histogram], 1);
+	add(&s->sum[histogram], us);
+	add(&s->buckets[histogram][bucket], 1);
+}
+
+void stats_progress_init(struct stats_progress *progress) {
+	memset(progress, 0, sizeof(*progress));
+	progress->next = __atomic_load_n(&progressList, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&progressList, &progress->next, progress, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void stats_progress(struct stats_progress *progress, uint32_t done, uint32_t total) {
+	uint64_t now = stats_time();
+	if (done == 0) {
+		__atomic_store_n(&progress->start, now, __ATOMIC_RELAXED);
+		__atomic_store_n(&progress->rate, 0, __ATOMIC_RELAXED);
+		progress->stepTime = now;
+		progress->stepDone = 0;
+	}
+	else if (done > progress->stepDone && now > progress->stepTime) {
+		__atomic_store_n(&progress->rate, (done - progress->stepDone) * 1000000ULL / (now - progress->stepTime), __ATOMIC_RELAXED);
+		progress->stepTime = now;
+		progress->stepDone = done;
+	}
+	if (done >= total) __atomic_store_n(&progress->end, now, __ATOMIC_RELAXED);
+	__atomic_store_n(&progress->total, total, __ATOMIC_RELAXED);
+	__atomic_store_n(&progress->done, done, __ATOMIC_RELAXED);
+}
+
+int stats_progress_get(const struct stats_progress *progress, uint32_t *done, uint32_t *total) {
+	*done = __atomic_load_n(&progress->done, __ATOMIC_RELAXED);
+	*total = __atomic_load_n(&progress->total, __ATOMIC_RELAXED);
+	return *total > 0 && *done < *total;
+}
+
+int stats_format(char *buf, size_t size) {
+	uint64_t counters[STAT_COUNTERS] = {0}, count[LAT_COUNT] = {0}, sum[LAT_COUNT] = {0};
+	uint64_t buckets[LAT_COUNT][STATS_BUCKETS];
+	unsigned long sent = 0, received = 0;
+	size_t len = 0;
+	uint64_t now = stats_time();
+
+	pthread_once(&keyOnce, make_key);
+	memset(buckets, 0, sizeof(buckets));
+	for (struct stats_thread *s = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); s; s = s->next) {
+		for (int i = 0; i < STAT_COUNTERS; i++) counters[i] += load(&s->counters[i]);
+		for (int i = 0; i < LAT_COUNT; i++) {
+			count[i] += load(&s->count[i]);
+			sum[i] += load(&s->sum[i]);
+			for (int b = 0; b < STATS_BUCKETS; b++) buckets[i][b] += load(&s->buckets[i][b]);
+		}
+	}
+	RS232_GetCounters(&sent, &received);
+
+#define PRINT(...) do { if (len < size) len += snprintf(buf + len, size - len, __VA_ARGS__); } while (0)
+	double uptime = (now - startTime) / 1e6;
+	PRINT("uptime_s %.1f\n", uptime);
+	PRINT("link.bytes_in %lu\nlink.bytes_out %lu\n", received, sent);
+	PRINT("link.average_in_bps %.0f\n", uptime > 0 ? received / uptime : 0);
+	PRINT("link.retries %llu\nlink.timeouts %llu\n", (unsigned long long) counters[STAT_RETRIES], (unsigned long long) counters[STAT_TIMEOUTS]);
+	PRINT("link.sleeps %u\nlink.sleep_s %.3f\n", __atomic_load_n(&sleepCount, __ATOMIC_RELAXED), __atomic_load_n(&sleepTimeNs, __ATOMIC_RELAXED) / 1e9);
+
+	// Over several devices: the dumps running now, or the last ones if none is, from the first start on
+	uint64_t done = 0, total = 0, start = 0, end = 0, rate = 0;
+	int dumping = 0;
+	for (struct stats_progress *p = __atomic_load_n(&progressList, __ATOMIC_ACQUIRE); p; p = p->next) {
+		uint64_t pDone = load(&p->done), pTotal = load(&p->total), pStart = load(&p->start);
+		int running = pTotal > 0 && pDone < pTotal;
+		if (running && !dumping) done = total = rate = start = 0;		// only count the running ones
+		else if (dumping && !running) continue;
+		dumping |= running;
+		done += pDone;
+		total += pTotal;
+		if (running) rate += load(&p->rate);
+		if (pStart && (!start || pStart < start)) start = pStart;
+		if (load(&p->end) > end) end = load(&p->end);
+	}
+	double elapsed = ((dumping ? now : end) - start) / 1e6;
+	PRINT("dump.state %s\ndump.done %llu\ndump.total %llu\n", dumping ? "reading" : "idle", (unsigned long long) done, (unsigned long long) total);
+	PRINT("dump.percent %.1f\n", total ? 100.0 * done / total : 0);
+	PRINT("dump.current_bps %llu\n", (unsigned long long) (dumping ? rate : 0));
+	PRINT("dump.average_bps %.0f\n", start && elapsed > 0 ? done / elapsed : 0);
+	PRINT("dump.eta_s %.0f\n", dumping && rate ? (double) (total - done) / rate : 0);
+
+	PRINT("cache.hits %llu\ncache.misses %llu\n", (unsigned long long) counters[STAT_CACHE_HITS], (unsigned long long) counters[STAT_CACHE_MISSES]);
+	PRINT("rom.dumps %llu\nsave.dumps %llu\nsave.writes %llu\n", (unsigned long long) counters[STAT_ROM_DUMPS],
+		(unsigned long long) counters[STAT_SAVE_DUMPS], (unsigned long long) counters[STAT_SAVE_WRITES]);
+
+	// One line per histogram: count, mean and the non empty buckets as <upper bound in us>:count
+	for (int i = 0; i < LAT_COUNT; i++) {
+		PRINT("latency.%s count=%llu mean_us=%llu", latencyNames[i], (unsigned long long) count[i],
+			(unsigned long long) (count[i] ? sum[i] / count[i] : 0));
+		for (int b = 0; b < STATS_BUCKETS; b++) {
+			if (!buckets[i][b]) continue;
+			if (b == STATS_BUCKETS - 1) PRINT(" inf:%llu", (unsigned long long) buckets[i][b]);
+			else PRINT(" <%llu:%llu", 1ULL << b, (unsigned long long) buckets[i][b]);
+		}
+		PRINT("\n");
+	}
+#undef PRINT
+	return len < size ? len : size - 1;
+}
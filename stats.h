@@ -0,0 +1,67 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Event counters
+#define STAT_RETRIES 0			// blocks requested again after a short read
+#define STAT_TIMEOUTS 1			// reads that gave up waiting for data
+#define STAT_CACHE_HITS 2
+#define STAT_CACHE_MISSES 3
+#define STAT_ROM_DUMPS 4
+#define STAT_SAVE_DUMPS 5
+#define STAT_SAVE_WRITES 6
+#define STAT_COUNTERS 7
+
+// Latency histograms, the serial commands first and then the FUSE operations
+#define LAT_REQUEST 0			// request_value(), one command and its answer
+#define LAT_BLOCK 1				// com_read_bytes(), one block
+#define LAT_BANK 2				// set_bank()
+#define LAT_LOOKUP 3
+#define LAT_GETATTR 4
+#define LAT_READDIR 5
+#define LAT_OPEN 6
+#define LAT_READ 7
+#define LAT_WRITE 8
+#define LAT_XATTR 9
+#define LAT_COUNT 10
+
+// Add n to a counter of the calling thread
+void stats_add(int counter, uint64_t n);
+
+// Monotonic time in microseconds, the start of a stats_latency() measurement
+uint64_t stats_time(void);
+
+// Record the time since start in a histogram of the calling thread
+void stats_latency(int histogram, uint64_t start);
+
+// Dump progress of one device, only written by its cartridge thread
+struct stats_progress {
+	uint64_t done, total;
+	uint64_t start, end;	// us
+	uint64_t stepTime, stepDone;
+	uint64_t rate;			// bytes/s over the last step
+	struct stats_progress *next;
+};
+
+// Clear progress and add it to the ones stats_format() reports. It has to stay around until exit
+void stats_progress_init(struct stats_progress *progress);
+
+// Progress of the dump in bytes, done 0 starts it and done == total ends it
+void stats_progress(struct stats_progress *progress, uint32_t done, uint32_t total);
+
+// Progress of the current dump, returns 1 while one is running
+int stats_progress_get(const struct stats_progress *progress, uint32_t *done, uint32_t *total);
+
+// Write the sum over all threads as text into buf, returns its length
+int stats_format(char *buf, size_t size);
+
+#endif
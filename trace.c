@@ -0,0 +1,152 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ The rs232 layer hands every read and write to trace_record(), which only copies it into a ring
+ that was allocated up front. A separate thread writes the ring to the file every 100ms, or sooner
+ when it is half full, so the dumping code never waits on the disk. Only the thread that owns the
+ serial port records, so there is one producer and one consumer and the ring needs no lock.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "trace.h"
+#include "rs232/rs232.h"
+
+#define TRACE_RING_SIZE (4 << 20)
+
+static FILE *file;
+static char *ring;
+static uint64_t head, tail;		// written by the producer and the flush thread, only ever grow
+static uint64_t lastTime;
+static uint32_t lost;
+static int stop;
+static pthread_t flusher;
+static pthread_mutex_t flushMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flushCond = PTHREAD_COND_INITIALIZER;
+
+static void ring_put(uint64_t pos, const void *data, size_t len) {
+	size_t offset = pos % TRACE_RING_SIZE;
+	size_t first = len < TRACE_RING_SIZE - offset ? len : TRACE_RING_SIZE - offset;
+	memcpy(ring + offset, data, first);
+	memcpy(ring, (const char *) data + first, len - first);
+}
+
+static void put_event(uint64_t *pos, uint8_t type, const void *data, uint16_t len, uint32_t delta) {
+	struct trace_event event = {delta, len, type, 0};
+	ring_put(*pos, &event, sizeof(event));
+	ring_put(*pos + sizeof(event), data, len);
+	*pos += sizeof(event) + len;
+}
+
+static void trace_record(int type, const unsigned char *data, int len) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t time = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+	uint32_t delta = time - lastTime > UINT32_MAX ? UINT32_MAX : time - lastTime;
+
+	do {
+		uint16_t chunk = len > UINT16_MAX ? UINT16_MAX : len;
+		uint64_t pos = head;
+		size_t need = sizeof(struct trace_event) + chunk + (lost ? sizeof(struct trace_event) + sizeof(lost) : 0);
+		uint64_t space = TRACE_RING_SIZE - (pos - __atomic_load_n(&tail, __ATOMIC_ACQUIRE));
+
+		if (need > space) {
+			lost++;
+			return;
+		}
+		if (lost) {
+			put_event(&pos, TRACE_LOST, &lost, sizeof(lost), 0);
+			lost = 0;
+		}
+		put_event(&pos, type, data, chunk, delta);
+		__atomic_store_n(&head, pos, __ATOMIC_RELEASE);
+		if (space - need < TRACE_RING_SIZE / 2) pthread_cond_signal(&flushCond);
+
+		data += chunk;
+		len -= chunk;
+		delta = 0;
+	} while (len > 0);
+	lastTime = time;
+}
+
+// Write everything between tail and head to the file
+static void flush_ring(void) {
+	uint64_t end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	while (tail < end) {
+		size_t offset = tail % TRACE_RING_SIZE;
+		size_t len = end - tail < TRACE_RING_SIZE - offset ? end - tail : TRACE_RING_SIZE - offset;
+		fwrite(ring + offset, 1, len, file);
+		__atomic_store_n(&tail, tail + len, __ATOMIC_RELEASE);
+	}
+	fflush(file);
+}
+
+static void *flush_thread(void *ptr) {
+	struct timespec t;
+	(void) ptr;
+
+	pthread_mutex_lock(&flushMutex);
+	while (!stop) {
+		clock_gettime(CLOCK_REALTIME, &t);
+		t.tv_nsec += 100000000;
+		if (t.tv_nsec >= 1000000000) {
+			t.tv_nsec -= 1000000000;
+			t.tv_sec++;
+		}
+		pthread_cond_timedwait(&flushCond, &flushMutex, &t);
+		flush_ring();
+	}
+	pthread_mutex_unlock(&flushMutex);
+	return NULL;
+}
+
+int trace_open(const char *path) {
+	file = fopen(path, "wb");
+	if (file == NULL) {
+		perror(path);
+		return 1;
+	}
+	ring = malloc(TRACE_RING_SIZE);
+	if (ring == NULL || fwrite(TRACE_MAGIC, 1, 8, file) != 8) {
+		fclose(file);
+		free(ring);
+		return 1;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	lastTime = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+	stop = 0;
+	if (pthread_create(&flusher, NULL, flush_thread, NULL)) {
+		fclose(file);
+		free(ring);
+		return 1;
+	}
+	RS232_SetTrace(trace_record);
+	atexit(trace_close);		// main doesn't wait for the cartridge thread, so closing it there isn't enough
+	printf("Tracing serial traffic to %s\n", path);
+	return 0;
+}
+
+void trace_close(void) {
+	if (file == NULL) return;
+	RS232_SetTrace(NULL);
+
+	pthread_mutex_lock(&flushMutex);
+	stop = 1;
+	pthread_cond_signal(&flushCond);
+	pthread_mutex_unlock(&flushMutex);
+	pthread_join(flusher, NULL);
+
+	flush_ring();
+	if (lost) fprintf(stderr, "Trace ring overflowed, %u events not recorded\n", lost);
+	fclose(file);
+	free(ring);
+	file = NULL;
+}
@@ -0,0 +1,35 @@
+/*
+ Author: Nisker
+ Created: 19/10/2026
+ License: GPL-3.0
+
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// A trace file is TRACE_MAGIC followed by events, each a trace_event and its payload.
+// The first three types are the RS232_TRACE_* values the rs232 layer reports
+#define TRACE_MAGIC "GBXTRC1"
+
+#define TRACE_TX 0		// bytes sent to the GBxCart
+#define TRACE_RX 1		// bytes received from it
+#define TRACE_OPEN 2	// the port was opened, the payload is its device name
+#define TRACE_LOST 3	// the ring was full, the payload is the number of events that weren't recorded
+
+struct trace_event {
+	uint32_t delta;		// microseconds since the previous event
+	uint16_t length;	// of the payload
+	uint8_t type;
+	uint8_t pad;
+};
+
+// Record all serial traffic into path until trace_close() or exit. Returns 0 on success
+int trace_open(const char *path);
+
+// Write out what is left in the ring and close the file
+void trace_close(void);
+
+#endif